@@ -0,0 +1,99 @@
+#!/usr/bin/env bash
+#
+# Runs the benchmark workloads in bench/*.shi and prints the results as JSON.
+#
+#   bench/run.sh [--save] [filter]
+#
+# Each workload is run $BENCH_RUNS times (default 3) and the fastest wall time
+# is kept, along with the GC counters reported by SHI_STATS for that run. When
+# bench/baseline.json exists, a comparison is printed on stderr and workloads
+# slower than the baseline by more than $BENCH_THRESHOLD percent (default 10)
+# are flagged. --save stores the results as the new baseline. Interpreter
+# settings such as SHI_GC_ORDER=hier are passed on from the environment.
+
+cd "$(dirname "$0")/.."
+
+save=
+if [ "$1" == "--save" ]; then
+  save=1
+  shift
+fi
+filter="$1"
+
+runs=${BENCH_RUNS:-3}
+threshold=${BENCH_THRESHOLD:-10}
+shi=${SHI:-./bin/shi}
+baseline=bench/baseline.json
+results=bench/results.json
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Input for read-all.shi
+head -c 262144 /dev/zero | tr '\0' 'x' | fold -w 79 >"$tmp/large.txt"
+
+# Extracts the numeric value of "key" from a single line JSON object.
+function field() {
+  echo "$1" | sed -n "s/.*\"$2\":\([0-9]*\).*/\1/p"
+}
+
+function bench() {
+  local name=$1 file=$2
+  local best= stats=
+  for ((i = 0; i < runs; i++)); do
+    local start=$(date +%s%N)
+    local out=$(SHI_STATS=1 $shi "$file" "$tmp/large.txt" 2>&1 >/dev/null)
+    local end=$(date +%s%N)
+    local ms=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+      best=$ms
+      stats=$(echo "$out" | tail -1)
+    fi
+  done
+  echo "{\"name\":\"$name\",\"wall_ms\":$best,\"gc_count\":$(field "$stats" gc_count),\"gc_pause_us\":$(field "$stats" gc_pause_us),\"peak_heap\":$(field "$stats" peak_heap),\"allocated\":$(field "$stats" allocated)}"
+}
+
+lines=()
+for file in bench/*.shi; do
+  name=$(basename "$file" .shi)
+  if [[ -n "$filter" && ! "$name" =~ $filter ]]; then
+    continue
+  fi
+  line=$(bench "$name" "$file")
+  lines+=("$line")
+
+  if [ -f "$baseline" ]; then
+    old=$(grep "\"name\":\"$name\"" "$baseline")
+    if [ -n "$old" ]; then
+      new_ms=$(field "$line" wall_ms)
+      old_ms=$(field "$old" wall_ms)
+      delta=$(((new_ms - old_ms) * 100 / (old_ms > 0 ? old_ms : 1)))
+      flag=
+      if [ "$delta" -gt "$threshold" ]; then
+        flag=" REGRESSION"
+      fi
+      printf '%-12s %6d ms (baseline %6d ms, %+d%%)%s\n' "$name" "$new_ms" \
+        "$old_ms" "$delta" "$flag" >&2
+      continue
+    fi
+  fi
+  printf '%-12s %6d ms\n' "$name" "$(field "$line" wall_ms)" >&2
+done
+
+{
+  echo "["
+  for ((i = 0; i < ${#lines[@]}; i++)); do
+    if [ $((i + 1)) -lt ${#lines[@]} ]; then
+      echo "${lines[$i]},"
+    else
+      echo "${lines[$i]}"
+    fi
+  done
+  echo "]"
+} >"$results"
+
+cat "$results"
+if [ -n "$save" ]; then
+  cp "$results" "$baseline"
+  echo "Saved baseline to $baseline" >&2
+fi
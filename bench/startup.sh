@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+#
+# Measures interpreter startup time by running an empty program
+# $STARTUP_RUNS times (default 200), once loading the prelude and once from a
+# heap image, and prints the means as JSON.
+#
+#   bench/startup.sh [path/to/shi]
+
+cd "$(dirname "$0")/.."
+
+shi=${1:-./bin/shi}
+runs=${STARTUP_RUNS:-200}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+function measure() {
+  local name=$1
+  shift
+  local start=$(date +%s%N)
+  for ((i = 0; i < runs; i++)); do
+    echo nil | "$@" >/dev/null
+  done
+  local end=$(date +%s%N)
+  echo "{\"name\":\"$name\",\"runs\":$runs,\"mean_us\":$(((end - start) / runs / 1000))}"
+}
+
+echo '(defn shi-main () nil)' >"$tmp/main.shi"
+$shi --save-image "$tmp/main.img" "$tmp/main.shi"
+
+measure startup $shi
+measure startup-image $shi --image "$tmp/main.img"
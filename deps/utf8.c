@@ -317,8 +317,9 @@ int u8_unescape(char *buf, int sz, char *src)
             amt = u8_read_escape_sequence(src, &ch);
         }
         else {
-            ch = (u_int32_t)*src;
-            amt = 1;
+            /* copy other bytes as they are, UTF-8 sequences included */
+            buf[c++] = *src++;
+            continue;
         }
         src += amt;
         amt = u8_wc_toutf8(temp, ch);
@@ -361,10 +362,15 @@ int u8_escape_wchar(char *buf, int sz, u_int32_t ch)
 }
 
 int u8_escape(char *buf, int sz, char *src, int escape_quotes)
+{
+    return u8_escape_len(buf, sz, src, strlen(src), escape_quotes);
+}
+
+int u8_escape_len(char *buf, int sz, char *src, int srclen, int escape_quotes)
 {
     int c=0, i=0, amt;
 
-    while (src[i] && c < sz) {
+    while (i < srclen && c < sz) {
         if (escape_quotes && src[i] == '"') {
             amt = snprintf(buf, sz - c, "\\\"");
             i++;
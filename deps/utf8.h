@@ -47,6 +47,9 @@ int u8_unescape(char *buf, int sz, char *src);
    backslashes as well. */
 int u8_escape(char *buf, int sz, char *src, int escape_quotes);
 
+/* like u8_escape, but reads exactly srclen bytes of src, NULs included */
+int u8_escape_len(char *buf, int sz, char *src, int srclen, int escape_quotes);
+
 /* utility predicates used by the above */
 int octal_digit(char c);
 int hex_digit(char c);
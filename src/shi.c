@@ -1,6 +1,10 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <termios.h>
 #include <setjmp.h>
 #include <stdarg.h>
@@ -21,11 +25,20 @@
 #include <signal.h>
 #include <sys/socket.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define X86_SIMD
+#endif
+
 #include "../deps/libev/ev.h"
 #include "../deps/linenoise.h"
 #include "../deps/pcg_basic.h"
 #include "../deps/utf8.h"
+#ifdef SHI_BOOTSTRAP
+#include "prelude.src.inc"
+#else
 #include "prelude.inc"
+#endif
 
 #define OBJ_HM_SIZE 32
 static const char *VERSION = "0.1.0";
@@ -61,16 +74,39 @@ static __attribute((noreturn)) void error(char *error_v) {
 enum {
   // Regular values visible from the user
   TINT = 1,
+  // Integer outside the int64_t range, see the bignum section
+  TBIG,
+  TFLOAT,
   TSTR,
+  // Substring sharing the bytes of a TSTR, see the string section
+  TSLICE,
   TCELL,
   TSYM,
   TOBJ,
   TPRI,
   TFUN,
   TMAC,
+  TWEAK,
+  TWTABLE,
+  TRES,
+  TVEC,
+  TARRAY,
+  TBYTES,
+  // String builder
+  TSB,
+  // Compiled regular expression, see the regex section
+  TREGEX,
+  // Incremental JSON parser, see primitives: json
+  TJSON,
+  // Entry of a weak table
+  TEPH,
+  // Backing store of a vector
+  TVBUF,
 
   // Intermediary value only present during GC, points to obj in new semispace
   TMOVED,
+  // Unused space left in the to-space by the parallel collector
+  TFREE,
 
   // Constants, statically allocated and will never be managed by GC
   TTRUE,
@@ -78,8 +114,14 @@ enum {
   TDOT,
   TCPAREN,
   TCCURLY,
+  TCBRACKET,
 };
 
+// element types of typed arrays
+enum { ARR_I32, ARR_I64, ARR_F64 };
+static const char *array_kinds[] = {"i32", "i64", "f64"};
+static const size_t array_elem_size[] = {4, 8, 8};
+
 // primitive fn typedef
 struct Val;
 typedef struct Val *Primitive(void *root, struct Val **env, struct Val **args);
@@ -88,16 +130,42 @@ typedef struct Val {
   // type is used to determine what value is represented in the union
   int type;
 
-  // size is the total allocated size of the object. "type" + "size" +
-  // "contents" + extra padding
-  int size;
+  union {
+    // size is the total allocated size of the object. "type" + "size" +
+    // "contents" + extra padding.
+    int size;
+    // offset of the object's new location in the to-space (only exists
+    // during GC runs)
+    unsigned int moved;
+  };
 
   // value contents
   union {
     // integer
-    int intv;
-    // string
-    char strv[1];
+    int64_t intv;
+    // bignum: sign (-1 or 1) and magnitude in 32-bit limbs, least significant
+    // first. Only holds values that don't fit in intv.
+    struct {
+      int sign;
+      int nlimbs;
+      uint32_t limbs[];
+    };
+    // float
+    double floatv;
+    // string: byte length, lazily cached hash (0 until computed) and then
+    // either the bytes, which may contain NULs but are always followed by
+    // one, or for a slice the TSTR holding them and their offset there.
+    struct {
+      uint32_t slen;
+      uint32_t shash;
+      union {
+        char strv[0];
+        struct {
+          struct Val *sparent;
+          size_t soff;
+        };
+      };
+    };
     // list
     struct {
       struct Val *car;
@@ -119,17 +187,69 @@ typedef struct Val {
       struct Val *body;
       struct Val *env;
     };
-    // forwarding pointer (only exists during GC runs)
-    void *moved;
+    // weak reference, cleared by GC when the target is not otherwise reachable
+    struct Val *target;
+    // resource handle: file descriptor closed by GC once unreachable, -1 when
+    // closed
+    int fd;
+    // weak table: chains of entries hashed by key identity
+    struct {
+      size_t count;
+      struct Val *buckets[];
+    };
+    // vector: the first len slots of buf, a TVBUF
+    // regex: the pattern, whose compiled program is kept in the regex cache
+    struct Val *pattern;
+    // string builder: the first len bytes of buf, a TBYTES
+    struct {
+      struct Val *buf;
+      size_t len;
+    };
+    // JSON stream parser: the bytes fed and not parsed yet in the string
+    // builder jsb, of which the first jscan have been scanned, ending at
+    // nesting depth jdepth in the jstate scanner state
+    struct {
+      struct Val *jsb;
+      size_t jscan;
+      int jdepth, jstate;
+    };
+    // typed array: alen numbers of the machine type given by akind, stored
+    // inline
+    struct {
+      int akind;
+      size_t alen;
+      uint8_t adata[];
+    };
+    // bytevector: blen bytes of binary data, stored inline
+    struct {
+      size_t blen;
+      uint8_t bdata[];
+    };
+    // vector backing store, the slots past the vector's length are Nil
+    struct {
+      size_t cap;
+      struct Val *slots[];
+    };
+    // weak table entry (ephemeron): the value is kept alive only as long as
+    // the key is reachable from outside the table
+    struct {
+      struct Val *next;
+      struct Val *key;
+      struct Val *value;
+    };
   };
 } Val;
 
+// Returns the number of bytes obj occupies on the heap.
+static inline size_t obj_size(Val *obj) { return (size_t)obj->size; }
+
 // Constants
-static Val *True = &(Val){TTRUE, 0, {0}};
-static Val *Nil = &(Val){TNIL, 0, {0}};
-static Val *Dot = &(Val){TDOT, 0, {0}};
-static Val *Cparen = &(Val){TCPAREN, 0, {0}};
-static Val *Ccurly = &(Val){TCCURLY, 0, {0}};
+static Val *True = &(Val){.type = TTRUE};
+static Val *Nil = &(Val){.type = TNIL};
+static Val *Dot = &(Val){.type = TDOT};
+static Val *Cparen = &(Val){.type = TCPAREN};
+static Val *Ccurly = &(Val){.type = TCCURLY};
+static Val *Cbracket = &(Val){.type = TCBRACKET};
 
 // The list containing all symbols. Such data structure is traditionally called
 // the "obarray", but I avoid using it as a variable name as this is not an
@@ -145,6 +265,8 @@ typedef struct WatcherState {
   int type;
   Val *env;
   Val *callback;
+  // The fd or handle watched by an io watcher, kept alive while it runs
+  Val *fd;
 } WatcherState;
 
 static ev_watcher_list *ev_watchers = NULL;
@@ -165,19 +287,79 @@ static const unsigned int MEMORY_SIZE = 67108864; // 64mb
 // The pointer pointing to the beginning of the current heap
 static void *memory;
 
-// The pointer pointing to the beginning of the old heap
+// The pointer pointing to the beginning of the old heap, and its size while
+// GC is copying out of it
 static void *from_space;
+static size_t from_space_size = 0;
+
+// The tenured space while a major GC is copying out of it, see gc: pretenure
+static uint8_t *from_tenured = NULL;
+static size_t from_tenured_size = 0;
+
+// The allocation region of (with-region thunk), see gc: region. Objects are
+// allocated from it while region_depth is non-zero.
+static uint8_t *region_start = NULL;
+static size_t region_used = 0;
+static int region_depth = 0;
+static uint8_t *from_region = NULL;
+static size_t from_region_size = 0;
 
 // The number of bytes allocated from the heap
 static size_t mem_nused = 0;
 
+// The total number of bytes allocated since startup (never reset by GC)
+static size_t mem_total = 0;
+
+// The highest value mem_nused reached, i.e. the peak heap size
+static size_t mem_peak = 0;
+
+// Number of GC runs and total time spent in them
+static size_t gc_count = 0;
+static uint64_t gc_pause_ns = 0;
+
 // Flags to debug GC
 static bool gc_running = false;
 static bool debug_gc = false;
 static bool always_gc = false;
 
+// Copy order, see SHI_GC_ORDER and forward_chain()
+static bool gc_hier = false;
+
+// Number of collector threads, see SHI_GC_THREADS
+static int gc_threads = 1;
+
 static void gc(void *root);
 
+// Drops the cached character indexes of strings, see string kernels
+static void char_index_clear(void);
+
+// Allocation sites told apart by pretenuring, see gc: pretenure
+enum {
+  SITE_DEFAULT,
+  SITE_READER,
+  SITE_SYMBOL,
+  SITE_FUNCTION,
+  SITE_PRIMITIVE,
+  SITE_ENV,
+  SITE_OBJ,
+  NSITES,
+};
+
+// The site objects allocated with alloc() are attributed to
+static int alloc_site = SITE_DEFAULT;
+
+// Sites whose objects are allocated straight into the tenured space
+static bool pretenured[NSITES];
+
+// One in this many allocations is sampled to measure survival rates
+#define SITE_SAMPLE_EVERY 16
+static unsigned int sample_tick = 0;
+
+static Val *tenured_alloc(void *root, size_t size);
+static void site_sample(Val *obj, size_t size, int site, bool tenured);
+static Val *region_alloc(void *root, size_t size);
+static void region_remember_block(Val *obj, size_t size);
+
 // Currently we are using Cheney's copying GC algorithm, with which the
 // available memory is split into two halves and all objects are moved from one
 // half to another every time GC is invoked. That means the address of the
@@ -258,14 +440,12 @@ static inline size_t roundup(size_t var, size_t size) {
   return (var + size - 1) & ~(size - 1);
 }
 
-// Allocates memory block. This may start GC if we don't have enough memory.
-static Val *alloc(void *root, int type, size_t size) {
-  // The object must be large enough to contain a pointer for the forwarding
-  // pointer. Make it larger if it's smaller than that.
-  size = roundup(size, sizeof(void *));
-
-  // Add the size of the type tag and size fields.
-  size += offsetof(Val, intv);
+// Allocates memory block for an object made at the given site. This may start
+// GC if we don't have enough memory.
+static Val *alloc_at(void *root, int type, size_t size, int site) {
+  // Add the size of the type tag and size fields. The forwarding address is
+  // kept in the header too, so an object may have no contents at all.
+  size += offsetof(Val, car);
 
   // Round up the object size to the nearest alignment boundary, so that the
   // next object will be allocated at the proper alignment boundary. Currently
@@ -281,6 +461,31 @@ static Val *alloc(void *root, int type, size_t size) {
   if (always_gc && !gc_running)
     gc(root);
 
+  // Inside (with-region thunk) everything that fits goes to the region
+  if (region_depth > 0) {
+    Val *obj = region_alloc(root, size);
+    if (obj) {
+      obj->type = type;
+      obj->size = size;
+      mem_total += size;
+      return obj;
+    }
+  }
+
+  // Objects from pretenured sites skip the young heap while the tenured space
+  // has room for them.
+  if (pretenured[site] && region_depth == 0) {
+    Val *obj = tenured_alloc(root, size);
+    if (obj) {
+      obj->type = type;
+      obj->size = size;
+      mem_total += size;
+      if (++sample_tick % SITE_SAMPLE_EVERY == 0)
+        site_sample(obj, size, site, true);
+      return obj;
+    }
+  }
+
   // Otherwise, run GC only when the available memory is not large enough.
   if (!always_gc && MEMORY_SIZE < mem_nused + size)
     gc(root);
@@ -296,9 +501,168 @@ static Val *alloc(void *root, int type, size_t size) {
   obj->type = type;
   obj->size = size;
   mem_nused += size;
+  mem_total += size;
+  if (mem_nused > mem_peak)
+    mem_peak = mem_nused;
+  if (++sample_tick % SITE_SAMPLE_EVERY == 0)
+    site_sample(obj, size, site, false);
+  if (region_depth > 0)
+    region_remember_block(obj, size);
   return obj;
 }
 
+static Val *alloc(void *root, int type, size_t size) {
+  return alloc_at(root, type, size, alloc_site);
+}
+
+// }}}
+
+// {{{ profile
+
+// Deterministic profiler backing `(profile thunk)`. While `profiling` is on,
+// apply() and apply_func() keep one entry per called function or primitive
+// counting calls, inclusive/exclusive time and the bytes allocated while it
+// was the innermost profiled call.
+
+typedef struct ProfEntry {
+  // Function, macro or primitive being measured. Forwarded by the GC.
+  Val *fn;
+  // Symbol the function was first called through, or NULL if anonymous.
+  Val *name;
+  long calls;
+  // Number of activations currently on the profile stack, so that recursive
+  // calls only count their outermost activation in the inclusive time.
+  int active;
+  uint64_t incl_ns;
+  uint64_t excl_ns;
+  size_t bytes;
+} ProfEntry;
+
+typedef struct ProfFrame {
+  size_t entry;
+  uint64_t start_ns;
+  uint64_t child_ns;
+  size_t start_bytes;
+  size_t child_bytes;
+} ProfFrame;
+
+static bool profiling = false;
+
+static ProfEntry *prof_entries = NULL;
+static size_t prof_nentries = 0;
+static size_t prof_entries_cap = 0;
+
+// Open addressing table from function address to prof_entries index + 1.
+// Addresses change when GC runs, so it is rebuilt by prof_rehash().
+static size_t *prof_index = NULL;
+static size_t prof_index_cap = 0;
+
+static ProfFrame *prof_stack = NULL;
+static size_t prof_depth = 0;
+static size_t prof_stack_cap = 0;
+
+// Symbol at the head of the form being applied, consumed by prof_entry().
+static Val *prof_call_name = NULL;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t prof_slot(Val *fn) {
+  return ((uintptr_t)fn >> 3) & (prof_index_cap - 1);
+}
+
+static void prof_index_insert(size_t i) {
+  size_t s = prof_slot(prof_entries[i].fn);
+  while (prof_index[s])
+    s = (s + 1) & (prof_index_cap - 1);
+  prof_index[s] = i + 1;
+}
+
+static void prof_rehash() {
+  if (prof_index_cap < prof_nentries * 2) {
+    while (prof_index_cap < prof_nentries * 2)
+      prof_index_cap = prof_index_cap ? prof_index_cap * 2 : 64;
+    free(prof_index);
+    prof_index = malloc(sizeof(size_t) * prof_index_cap);
+  }
+  memset(prof_index, 0, sizeof(size_t) * prof_index_cap);
+  for (size_t i = 0; i < prof_nentries; i++)
+    prof_index_insert(i);
+}
+
+// Returns the index of the entry for fn, creating it if needed.
+static size_t prof_entry(Val *fn) {
+  Val *name = prof_call_name;
+  prof_call_name = NULL;
+
+  if (prof_index_cap) {
+    for (size_t s = prof_slot(fn); prof_index[s];
+         s = (s + 1) & (prof_index_cap - 1)) {
+      if (prof_entries[prof_index[s] - 1].fn == fn)
+        return prof_index[s] - 1;
+    }
+  }
+
+  if (prof_nentries == prof_entries_cap) {
+    prof_entries_cap = prof_entries_cap ? prof_entries_cap * 2 : 64;
+    prof_entries = realloc(prof_entries, sizeof(ProfEntry) * prof_entries_cap);
+  }
+  prof_entries[prof_nentries] = (ProfEntry){fn, name, 0, 0, 0, 0, 0};
+  prof_nentries++;
+  if (prof_index_cap < prof_nentries * 2)
+    prof_rehash();
+  else
+    prof_index_insert(prof_nentries - 1);
+  return prof_nentries - 1;
+}
+
+static void prof_enter(size_t entry) {
+  if (prof_depth == prof_stack_cap) {
+    prof_stack_cap = prof_stack_cap ? prof_stack_cap * 2 : 256;
+    prof_stack = realloc(prof_stack, sizeof(ProfFrame) * prof_stack_cap);
+  }
+  prof_entries[entry].calls++;
+  prof_entries[entry].active++;
+  prof_stack[prof_depth++] = (ProfFrame){entry, now_ns(), 0, mem_total, 0};
+}
+
+static void prof_leave() {
+  ProfFrame *f = &prof_stack[--prof_depth];
+  ProfEntry *e = &prof_entries[f->entry];
+  uint64_t elapsed = now_ns() - f->start_ns;
+  size_t allocated = mem_total - f->start_bytes;
+
+  e->active--;
+  if (e->active == 0)
+    e->incl_ns += elapsed;
+  e->excl_ns += elapsed - f->child_ns;
+  e->bytes += allocated - f->child_bytes;
+
+  if (prof_depth > 0) {
+    prof_stack[prof_depth - 1].child_ns += elapsed;
+    prof_stack[prof_depth - 1].child_bytes += allocated;
+  }
+}
+
+// Pops profile frames left behind by a non-local exit (error).
+static void prof_unwind(size_t depth) {
+  prof_call_name = NULL;
+  while (prof_depth > depth)
+    prof_leave();
+}
+
+static void prof_reset() {
+  profiling = false;
+  prof_call_name = NULL;
+  prof_nentries = 0;
+  prof_depth = 0;
+  if (prof_index_cap)
+    memset(prof_index, 0, sizeof(size_t) * prof_index_cap);
+}
+
 // }}}
 
 // {{{ gc
@@ -312,6 +676,48 @@ static Val *alloc(void *root, int type, size_t size) {
 static Val *scan1;
 static Val *scan2;
 
+static inline bool in_from_space(Val *obj) {
+  size_t offset = (uint8_t *)obj - (uint8_t *)from_space;
+  return offset < from_space_size ||
+         (size_t)((uint8_t *)obj - from_tenured) < from_tenured_size ||
+         (size_t)((uint8_t *)obj - from_region) < from_region_size;
+}
+
+// Copies obj, which must not have been moved yet, to the end of the to-space
+// and leaves a tombstone behind.
+static inline Val *copy_object(Val *obj) {
+  Val *newloc = scan2;
+  size_t size = obj_size(obj);
+  memcpy(newloc, obj, size);
+  scan2 = (Val *)((uint8_t *)scan2 + size);
+
+  // Put a tombstone at the location where the object used to occupy, so that
+  // the following call of forward() can find the object's new location.
+  obj->type = TMOVED;
+  obj->moved = (uint8_t *)newloc - (uint8_t *)memory;
+  return newloc;
+}
+
+// Hierarchical copy order. Plain Cheney scanning is breadth-first, so the
+// cells of a list end up interleaved with everything else reachable at the
+// same depth, and walking the list after GC jumps all over the to-space.
+// Instead, right after a cell is copied this copies the rest of its cdr chain
+// behind it, each cell followed by its car when that is a leaf. Nested lists
+// and other cars are still copied when the scan reaches them.
+static void forward_chain(Val *cell) {
+  for (;;) {
+    Val *car = cell->car;
+    if (in_from_space(car) &&
+        (car->type == TINT || car->type == TSTR || car->type == TSYM))
+      cell->car = copy_object(car);
+    Val *next = cell->cdr;
+    if (!in_from_space(next) || next->type != TCELL)
+      return;
+    cell->cdr = copy_object(next);
+    cell = cell->cdr;
+  }
+}
+
 // Moves one object from the from-space to the to-space. Returns the object's
 // new address. If the object has already been moved, does nothing but just
 // returns
@@ -319,1492 +725,7165 @@ static Val *scan2;
 static inline Val *forward(Val *obj) {
   // If the object's address is not in the from-space, the object is not managed
   // by GC nor it has already been moved to the to-space.
-  ptrdiff_t offset = (uint8_t *)obj - (uint8_t *)from_space;
-  if (offset < 0 || MEMORY_SIZE <= offset)
+  if (!in_from_space(obj))
     return obj;
 
   // The pointer is pointing to the from-space, but the object there was a
   // tombstone. Follow the forwarding pointer to find the new location of
   // the object.
   if (obj->type == TMOVED)
-    return obj->moved;
+    return (Val *)((uint8_t *)memory + obj->moved);
 
   // Otherwise, the object has not been moved yet. Move it.
-  Val *newloc = scan2;
-  memcpy(newloc, obj, obj->size);
-  scan2 = (Val *)((uint8_t *)scan2 + obj->size);
-
-  // Put a tombstone at the location where the object used to occupy, so that
-  // the following call of forward() can find the object's new location.
-  obj->type = TMOVED;
-  obj->moved = newloc;
+  Val *newloc = copy_object(obj);
+  if (gc_hier && newloc->type == TCELL)
+    forward_chain(newloc);
   return newloc;
 }
 
+// Number of buckets in a weak table
+#define WTABLE_SIZE 64
+
+// Returns the pointer fields of obj that keep other objects alive, which are
+// always stored contiguously, and sets *n to their number.
+static Val **obj_pointers(Val *obj, size_t *n) {
+  switch (obj->type) {
+  case TWTABLE:
+    *n = WTABLE_SIZE;
+    return obj->buckets;
+  case TEPH:
+    *n = 1;
+    return &obj->next;
+  case TVEC:
+  case TSB:
+    *n = 1;
+    return &obj->buf;
+  case TSLICE:
+    *n = 1;
+    return &obj->sparent;
+  case TREGEX:
+    *n = 1;
+    return &obj->pattern;
+  case TJSON:
+    *n = 1;
+    return &obj->jsb;
+  case TVBUF:
+    *n = obj->cap;
+    return obj->slots;
+  case TCELL:
+    *n = 2;
+    return &obj->car;
+  case TOBJ:
+    *n = OBJ_HM_SIZE + 1;
+    return &obj->proto;
+  case TFUN:
+  case TMAC:
+    *n = 3;
+    return &obj->params;
+  case TINT:
+  case TBIG:
+  case TFLOAT:
+  case TARRAY:
+  case TBYTES:
+  case TSTR:
+  case TSYM:
+  case TPRI:
+  case TWEAK:
+  case TRES:
+  case TFREE:
+    // Any of the above types does not contain a pointer to a GC-managed
+    // object, or only weak ones.
+    *n = 0;
+    return NULL;
+  default:
+    // TODO append obj->type
+    error("bug: copy: unknown type");
+  }
+}
+
+// Like obj_pointers(), but includes the weak pointers.
+static Val **obj_pointers_all(Val *obj, size_t *n) {
+  switch (obj->type) {
+  case TWEAK:
+    *n = 1;
+    return &obj->target;
+  case TEPH:
+    *n = 3;
+    return &obj->next;
+  default:
+    return obj_pointers(obj, n);
+  }
+}
+
+// Forwards every pointer held by obj.
+static inline void scan_object(Val *obj) {
+  size_t n;
+  Val **fields = obj_pointers(obj, &n);
+  for (size_t i = 0; i < n; i++)
+    fields[i] = forward(fields[i]);
+}
+
 static void *alloc_semispace() {
   // return malloc(MEMORY_SIZE);
   return mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
               -1, 0);
 }
 
-static char *pr_str(void *root, Val *);
+// }}}
 
-// Copies the root objects.
-static void forward_root_objects(void *root) {
-  symbols = forward(symbols);
+// {{{ gc: perm
 
-  // In `root` [0] it a pointer to the previous root, [n] is an object on the
-  // stack and [n+1] is the ROOT_END delimiter
-  for (void **frame = root; frame; frame = *(void ***)frame) {
-    for (int i = 1; frame[i] != ROOT_END; i++) {
-      if (frame[i]) {
-        frame[i] = forward(frame[i]);
-      }
-    }
-  }
+// (freeze-heap) turns the live part of the current semispace into a permanent
+// region that the collector never copies again. A process that loads the
+// prelude, freezes and then forks keeps those pages shared with its children,
+// since only writes by the program itself dirty them.
+//
+// Perm objects may be mutated to point at young objects, so every store into
+// an existing object goes through write_barrier(), which marks the card
+// holding the slot. GC treats the objects on dirty cards as extra roots and
+// cleans the cards that no longer point into a collected space. The card table
+// lives outside the region so marking it does not touch the shared pages. The
+// tenured space (see gc: pretenure) is tracked with the same kind of cards.
+#define CARD_SHIFT 9
+#define CARD_SIZE (1 << CARD_SHIFT)
+
+typedef struct PermSpace {
+  uint8_t *start;
+  size_t size;
+  // One byte per card, non-zero when dirty
+  uint8_t *cards;
+  // The object covering the first byte of each card
+  Val **card_start;
+} PermSpace;
+
+static PermSpace *perm_spaces = NULL;
+static size_t perm_nspaces = 0;
+static size_t perm_bytes = 0;
+
+// The space pretenured objects are allocated from. Empty until needed.
+static PermSpace tenured = {NULL, 0, NULL, NULL};
+
+static inline bool in_region(void *p) {
+  return (size_t)((uint8_t *)p - region_start) < region_used;
+}
 
-  // Persist/Forward watchers root objects
-  for (ev_watcher_list *w = ev_watchers; w != NULL; w = w->next) {
-    WatcherState *wdata = w->data;
-    wdata->env = forward(wdata->env);
-    wdata->callback = forward(wdata->callback);
+static void region_remember(Val **slot);
+
+// Records a store into *slot. Must be called after overwriting a pointer field
+// of an object that may not have been allocated just now.
+static inline void write_barrier(Val **slot) {
+  if (region_depth > 0 && in_region(*slot) && !in_region(slot))
+    region_remember(slot);
+  size_t offset = (uint8_t *)slot - tenured.start;
+  if (offset < tenured.size) {
+    tenured.cards[offset >> CARD_SHIFT] = 1;
+    return;
+  }
+  if (perm_nspaces == 0)
+    return;
+  for (size_t i = 0; i < perm_nspaces; i++) {
+    offset = (uint8_t *)slot - perm_spaces[i].start;
+    if (offset < perm_spaces[i].size) {
+      perm_spaces[i].cards[offset >> CARD_SHIFT] = 1;
+      return;
+    }
   }
 }
 
-// Implements Cheney's copying garbage collection algorithm.
-// http://en.wikipedia.org/wiki/Cheney%27s_algorithm
-static void gc(void *root) {
-  assert(!gc_running);
-  gc_running = true;
-
-  // Allocate a new semi-space.
-  from_space = memory;
-  memory = alloc_semispace();
+// Returns true if obj lives in a space that GC may move it out of.
+static inline bool in_collected_heap(Val *obj) {
+  size_t offset = (uint8_t *)obj - (uint8_t *)memory;
+  return offset < MEMORY_SIZE ||
+         (size_t)((uint8_t *)obj - tenured.start) < tenured.size;
+}
 
-  // Initialize the two pointers for GC. Initially they point to the beginning
-  // of the to-space.
-  scan1 = scan2 = memory;
+// Records that the object at p of the given size starts or covers the
+// first byte of the cards it spans.
+static void space_add_object(PermSpace *ps, uint8_t *p, size_t size) {
+  size_t first = (p - ps->start + CARD_SIZE - 1) >> CARD_SHIFT;
+  size_t last = (p + size - 1 - ps->start) >> CARD_SHIFT;
+  for (size_t c = first; c <= last; c++)
+    ps->card_start[c] = (Val *)p;
+}
 
-  // Copy the GC root objects first. This moves the pointer scan2.
-  forward_root_objects(root);
+// Sets up clean cards for the objects between start and start + size. The
+// card table is sized for capacity bytes so that the region can grow.
+static void space_init(PermSpace *ps, uint8_t *start, size_t size,
+                        size_t capacity) {
+  ps->start = start;
+  ps->size = size;
+  size_t ncards = (capacity + CARD_SIZE - 1) >> CARD_SHIFT;
+  ps->cards = calloc(ncards ? ncards : 1, 1);
+  ps->card_start = calloc(ncards ? ncards : 1, sizeof(Val *));
+  for (uint8_t *p = start; p < start + size; p += obj_size((Val *)p))
+    space_add_object(ps, p, obj_size((Val *)p));
+}
 
-  // Copy the objects referenced by the GC root objects located between scan1
-  // and scan2. Once it's
-  // finished, all live objects (i.e. objects reachable from the root) will have
-  // been copied to
-  // the to-space.
-  while (scan1 < scan2) {
-    switch (scan1->type) {
-    case TINT:
-    case TSTR:
-    case TSYM:
-    case TPRI:
-      // Any of the above types does not contain a pointer to a GC-managed
-      // object.
-      break;
-    case TOBJ:
-      scan1->proto = forward(scan1->proto);
-      for (size_t i = 0; i < OBJ_HM_SIZE; i++) {
-        scan1->props[i] = forward(scan1->props[i]);
+// Forwards the pointers held by the objects on the dirty cards of ps and
+// cleans the cards that are left without pointers into a collected space.
+static void space_scan_cards(PermSpace *ps) {
+  size_t ncards = (ps->size + CARD_SIZE - 1) >> CARD_SHIFT;
+  for (size_t c = 0; c < ncards; c++) {
+    if (!ps->cards[c])
+      continue;
+    uint8_t *end = ps->start + ((c + 1) << CARD_SHIFT);
+    if (end > ps->start + ps->size)
+      end = ps->start + ps->size;
+    bool young = false;
+    for (Val *obj = ps->card_start[c]; (uint8_t *)obj < end;
+         obj = (Val *)((uint8_t *)obj + obj_size(obj))) {
+      // Weak pointers held by perm objects are treated as strong
+      size_t n;
+      Val **fields = obj_pointers_all(obj, &n);
+      for (size_t j = 0; j < n; j++) {
+        fields[j] = forward(fields[j]);
+        young |= in_collected_heap(fields[j]);
       }
-      break;
-    case TCELL:
-      scan1->car = forward(scan1->car);
-      scan1->cdr = forward(scan1->cdr);
-      break;
-    case TFUN:
-    case TMAC:
-      scan1->params = forward(scan1->params);
-      scan1->body = forward(scan1->body);
-      scan1->env = forward(scan1->env);
-      break;
-    default:
-      // TODO append scan1->type
-      error("bug: copy: unknown type");
     }
-    scan1 = (Val *)((uint8_t *)scan1 + scan1->size);
+    ps->cards[c] = young;
   }
+}
 
-  // Finish up GC.
-  // free(from_space);
-  munmap(from_space, MEMORY_SIZE);
-  size_t old_nused = mem_nused;
-  mem_nused = (size_t)((uint8_t *)scan1 - (uint8_t *)memory);
-  if (debug_gc)
-    fprintf(stderr, "GC: %zu bytes out of %zu bytes copied.\n", mem_nused,
-            old_nused);
-  gc_running = false;
+// Forwards the pointers held by the objects on dirty cards. The tenured
+// space is only scanned by minor collections, major ones copy it instead.
+static void perm_scan_cards() {
+  for (size_t i = 0; i < perm_nspaces; i++)
+    space_scan_cards(&perm_spaces[i]);
+  if (tenured.start && !from_tenured)
+    space_scan_cards(&tenured);
 }
 
-// }}}
+static void gc_full(void *root);
 
-// {{{ constructors
+// Collects the heap, then turns what is left of it into a permanent region
+// and continues allocating from a fresh semispace.
+static size_t freeze_heap(void *root) {
+  gc_full(root);
 
-static Val *make_int(void *root, int value) {
-  Val *r = alloc(root, TINT, sizeof(int));
-  r->intv = value;
-  return r;
-}
+  perm_spaces = realloc(perm_spaces, sizeof(PermSpace) * (perm_nspaces + 1));
+  // Every object in the region was just copied by the GC, so it can only
+  // point to itself or older perm regions: all cards start clean.
+  space_init(&perm_spaces[perm_nspaces], memory, mem_nused, mem_nused);
+  perm_nspaces++;
+  perm_bytes += mem_nused;
 
-static Val *make_str(void *root, char *value) {
-  Val *str = alloc(root, TSTR, strlen(value) + 1);
-  strcpy(str->strv, value);
-  return str;
-}
+  // Give back the unused tail of the semispace
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t used = (mem_nused + page - 1) / page * page;
+  if (used < MEMORY_SIZE)
+    munmap((uint8_t *)memory + used, MEMORY_SIZE - used);
 
-static Val *make_symbol(void *root, char *name) {
-  Val *sym = alloc(root, TSYM, strlen(name) + 1);
-  strcpy(sym->symv, name);
-  return sym;
+  size_t frozen = mem_nused;
+  memory = alloc_semispace();
+  mem_nused = 0;
+  return frozen;
 }
 
-// {{{ constructors: list
+// }}}
 
-// cell/list constructor
-static Val *cons(void *root, Val **car, Val **cdr) {
-  Val *cell = alloc(root, TCELL, sizeof(Val *) * 2);
-  cell->car = *car;
-  cell->cdr = *cdr;
-  return cell;
+// {{{ gc: pretenure
+
+// Most objects die young, but some allocation sites produce objects that live
+// about as long as the program: the code built by the reader, interned
+// symbols, closures, the global env. Copying those on every collection is
+// wasted work. alloc() samples one in SITE_SAMPLE_EVERY allocations, and each
+// collection checks which of the sampled objects it had to copy. A site whose
+// samples mostly survive becomes pretenured: its objects are allocated
+// straight into the tenured space, which minor collections never copy. Stores
+// into tenured objects mark cards like stores into perm regions, so a minor
+// collection only looks at the dirty cards to find the young objects the
+// tenured space points to.
+//
+// Once a site turns pretenured the next collection is a major one. It copies
+// the young heap and the live part of the tenured space together, and the
+// result becomes the new tenured space, so that the long-lived objects made
+// before the decision stop being copied too. A major collection also runs
+// when the tenured space fills up. It checks the samples taken in the tenured
+// space, so a site whose objects stop surviving goes back to the young heap.
+
+#define SITE_MAX_SAMPLES 4096
+// Sampled bytes needed before deciding about a site. The counts are halved
+// whenever they exceed the window, so old samples weigh less.
+#define PRETENURE_MIN_BYTES 1024
+#define PRETENURE_WINDOW (16 << 10)
+// Survival rates in percent at which a site starts and stops being pretenured
+#define PRETENURE_ON 90
+#define PRETENURE_OFF 50
+
+typedef struct SiteStats {
+  const char *name;
+  // Bytes sampled and how many of them survived
+  size_t sampled;
+  size_t survived;
+} SiteStats;
+
+static SiteStats sites[NSITES] = {
+    [SITE_DEFAULT] = {"default", 0, 0},
+    [SITE_READER] = {"reader", 0, 0},
+    [SITE_SYMBOL] = {"symbol", 0, 0},
+    [SITE_FUNCTION] = {"function", 0, 0},
+    [SITE_PRIMITIVE] = {"primitive", 0, 0},
+    [SITE_ENV] = {"env", 0, 0},
+    [SITE_OBJ] = {"obj", 0, 0},
+};
+
+typedef struct SiteSample {
+  Val *obj;
+  uint32_t size;
+  uint8_t site;
+} SiteSample;
+
+// Young samples are checked by the next collection, tenured ones by the next
+// major collection.
+static SiteSample young_samples[SITE_MAX_SAMPLES];
+static size_t young_nsamples = 0;
+static SiteSample tenured_samples[SITE_MAX_SAMPLES];
+static size_t tenured_nsamples = 0;
+
+// Turned off by SHI_NO_PRETENURE
+static bool pretenuring = true;
+
+// Set when a site turns pretenured, makes the next gc() a major collection
+static bool major_pending = false;
+
+// Set when a major collection could not make room in the tenured space, so
+// that pretenured sites use the young heap until the next one
+static bool tenured_full = false;
+
+static size_t major_count = 0;
+
+static void site_sample(Val *obj, size_t size, int site, bool tenured) {
+  SiteSample *samples = tenured ? tenured_samples : young_samples;
+  size_t *n = tenured ? &tenured_nsamples : &young_nsamples;
+  if (*n < SITE_MAX_SAMPLES)
+    samples[(*n)++] = (SiteSample){obj, size, site};
 }
 
-// Returns the length of the given list. -1 if it's not a proper list.
-static int length(Val *list) {
-  int len = 0;
-  for (; list->type == TCELL; list = list->cdr)
-    len++;
-  return list == Nil ? len : -1;
+// Counts the samples that were copied by the current collection and updates
+// the pretenuring decisions. Must run before the from-space is released.
+static void sites_update(bool major) {
+  size_t sampled[NSITES] = {0};
+  size_t survived[NSITES] = {0};
+  for (size_t i = 0; i < young_nsamples; i++) {
+    SiteSample *s = &young_samples[i];
+    sampled[s->site] += s->size;
+    if (s->obj->type == TMOVED)
+      survived[s->site] += s->size;
+  }
+  young_nsamples = 0;
+  if (major) {
+    for (size_t i = 0; i < tenured_nsamples; i++) {
+      SiteSample *s = &tenured_samples[i];
+      sampled[s->site] += s->size;
+      if (s->obj->type == TMOVED)
+        survived[s->site] += s->size;
+    }
+    tenured_nsamples = 0;
+  }
+
+  for (int i = 0; i < NSITES; i++) {
+    if (sampled[i] == 0)
+      continue;
+    SiteStats *st = &sites[i];
+    st->sampled += sampled[i];
+    st->survived += survived[i];
+    while (st->sampled > PRETENURE_WINDOW) {
+      st->sampled /= 2;
+      st->survived /= 2;
+    }
+    if (!pretenuring || st->sampled < PRETENURE_MIN_BYTES)
+      continue;
+    size_t rate = st->survived * 100 / st->sampled;
+    if (!pretenured[i] && rate >= PRETENURE_ON) {
+      pretenured[i] = true;
+      major_pending = true;
+    } else if (pretenured[i] && rate < PRETENURE_OFF) {
+      pretenured[i] = false;
+    }
+  }
 }
 
-// Destructively reverses the given list.
-static Val *reverse(Val *p) {
-  Val *ret = Nil;
-  while (p != Nil) {
-    Val *head = p;
-    p = p->cdr;
-    head->cdr = ret;
-    ret = head;
+static void gc_major(void *root);
+
+// Returns room for size bytes in the tenured space, or NULL if there is none.
+static Val *tenured_alloc(void *root, size_t size) {
+  if (tenured_full)
+    return NULL;
+  if (!tenured.start)
+    space_init(&tenured, alloc_semispace(), 0, MEMORY_SIZE);
+  if (MEMORY_SIZE < tenured.size + size) {
+    gc_major(root);
+    if (MEMORY_SIZE < tenured.size + size) {
+      tenured_full = true;
+      return NULL;
+    }
   }
-  return ret;
+  uint8_t *p = tenured.start + tenured.size;
+  space_add_object(&tenured, p, size);
+  tenured.size += size;
+  // The caller is about to store pointers to young objects into it
+  size_t first = (p - tenured.start) >> CARD_SHIFT;
+  size_t last = (p + size - 1 - tenured.start) >> CARD_SHIFT;
+  memset(tenured.cards + first, 1, last - first + 1);
+  return (Val *)p;
 }
 
-// Returns ((x . y) . a)
-static Val *acons(void *root, Val **x, Val **y, Val **a) {
-  DEFINE1(root, cell);
-  *cell = cons(root, x, y);
-  return cons(root, cell, a);
+// Releases the tenured space after a major collection copied out of it.
+static void tenured_release() {
+  munmap(tenured.start, MEMORY_SIZE);
+  free(tenured.cards);
+  free(tenured.card_start);
+  tenured = (PermSpace){NULL, 0, NULL, NULL};
 }
 
+#undef SITE_MAX_SAMPLES
+#undef PRETENURE_MIN_BYTES
+#undef PRETENURE_WINDOW
+#undef PRETENURE_ON
+#undef PRETENURE_OFF
+
+#undef CARD_SHIFT
+#undef CARD_SIZE
+
 // }}}
 
-// {{{ constructors: obj
+// {{{ gc: parallel
 
-static void obj_set(void *, Val **, Val **, Val **);
+// With SHI_GC_THREADS=n the copying phase runs on n threads. The roots are
+// still forwarded by the calling thread; the objects they reach are then
+// traced cooperatively:
+//
+//  - Each thread copies into its own local allocation buffer (LAB), a chunk
+//    of the to-space claimed from the shared top with an atomic add. The
+//    copied but not yet scanned part of a LAB is the thread's own queue of
+//    grey objects, like the region between scan1 and scan2 in the serial
+//    collector.
+//  - Grey ranges are handed out through a shared work list: a thread pushes
+//    the unscanned rest of a LAB when the LAB fills up, or when another
+//    thread has run out of work, and pops from the list when its own LAB is
+//    fully scanned.
+//  - Two threads may race to copy the same object. Each copies it first and
+//    then tries to install the forwarding header with a CAS; the loser gives
+//    its copy back and uses the winner's.
+//
+// Space left at the end of a LAB is covered by a TFREE object, so the
+// to-space stays walkable object by object. Small heaps are not worth the
+// thread startup and are always collected serially, as is everything in
+// hier copy order, which only applies to the serial collector.
+
+// Heaps smaller than this are collected by a single thread
+#define GC_PARALLEL_MIN (4 << 20)
+#define GC_LAB_SIZE (64 << 10)
+// Objects larger than this get a chunk of their own instead of a LAB slot
+#define GC_LARGE_OBJECT (GC_LAB_SIZE / 16)
+// A thread gives away its grey objects when some other thread is idle and
+// it has at least this many bytes of them
+#define GC_DONATE_MIN 1024
+
+// The header of an object, read and written as one word
+typedef union GcHeader {
+  uint64_t word;
+  struct {
+    int type;
+    unsigned int size;
+  };
+} GcHeader;
+
+typedef struct GcRange {
+  uint8_t *start;
+  uint8_t *end;
+} GcRange;
+
+typedef struct GcThread {
+  pthread_t thread;
+  // Grey objects are between scan and lab_top, free space between lab_top
+  // and lab_end
+  uint8_t *scan;
+  uint8_t *lab_top;
+  uint8_t *lab_end;
+} GcThread;
+
+static pthread_mutex_t par_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t par_cond = PTHREAD_COND_INITIALIZER;
+static GcRange *par_work = NULL;
+static size_t par_nwork = 0;
+static size_t par_work_cap = 0;
+static int par_nthreads;
+static int par_idle;
+static bool par_done;
+
+// Offset of the first unclaimed byte of the to-space
+static size_t par_top;
+
+static void par_fill(uint8_t *start, uint8_t *end) {
+  if (start >= end)
+    return;
+  Val *filler = (Val *)start;
+  filler->type = TFREE;
+  filler->size = end - start;
+}
 
-static Val *make_obj(void *root, Val **proto) {
-  Val *r = alloc(root, TOBJ, sizeof(Val *) * (OBJ_HM_SIZE + 1));
-  r->proto = *proto;
-  for (size_t i = 0; i < OBJ_HM_SIZE; i++) {
-    r->props[i] = Nil;
+static uint8_t *par_claim(size_t size) {
+  size_t offset = __atomic_fetch_add(&par_top, size, __ATOMIC_RELAXED);
+  if (offset + size > MEMORY_SIZE) {
+    // Cannot unwind out of a GC thread. This only happens when the live data
+    // nearly fills the heap, where the serial collector would fail right
+    // after GC anyway.
+    fprintf(stderr, "GC: to-space exhausted\n");
+    abort();
   }
-  return r;
+  return (uint8_t *)memory + offset;
 }
 
-static Val *make_obj_alist(void *root, Val **proto, Val **props) {
-  DEFINE3(root, obj, key, val);
-  *obj = make_obj(root, proto);
-  for (Val *pair = *props; pair != Nil; pair = pair->cdr) {
-    *key = pair->car->car;
-    *val = pair->car->cdr;
-    obj_set(root, obj, key, val);
+static void par_push(uint8_t *start, uint8_t *end) {
+  if (start >= end)
+    return;
+  pthread_mutex_lock(&par_lock);
+  if (par_nwork == par_work_cap) {
+    par_work_cap = par_work_cap ? par_work_cap * 2 : 64;
+    par_work = realloc(par_work, sizeof(GcRange) * par_work_cap);
   }
-  return *obj;
+  par_work[par_nwork++] = (GcRange){start, end};
+  pthread_cond_signal(&par_cond);
+  pthread_mutex_unlock(&par_lock);
 }
 
-static size_t obj_hash(Val *key) {
-  u_int64_t hash;
-  size_t i = 0;
+// Waits for a grey range. Returns false once every thread is out of work.
+static bool par_pop(GcRange *range) {
+  pthread_mutex_lock(&par_lock);
+  __atomic_add_fetch(&par_idle, 1, __ATOMIC_RELAXED);
+  while (par_nwork == 0 && !par_done) {
+    if (par_idle == par_nthreads) {
+      par_done = true;
+      pthread_cond_broadcast(&par_cond);
+      break;
+    }
+    pthread_cond_wait(&par_cond, &par_lock);
+  }
+  __atomic_sub_fetch(&par_idle, 1, __ATOMIC_RELAXED);
+  bool found = par_nwork > 0;
+  if (found)
+    *range = par_work[--par_nwork];
+  pthread_mutex_unlock(&par_lock);
+  return found;
+}
 
-  char *keyval;
-  if (key->type == TSTR) {
-    keyval = key->strv;
-  } else if (key->type == TSYM) {
-    keyval = key->symv;
-  } else if (key->type == TINT) {
-    char buf[11];
-    memset(buf, 0, 11);
-    sprintf(buf, "%d", key->intv);
-    keyval = buf;
-  } else {
-    error("obj_hash: key given is not sym, str, or int");
+static uint8_t *par_lab_alloc(GcThread *t, size_t size) {
+  if (t->lab_top + size > t->lab_end) {
+    par_fill(t->lab_top, t->lab_end);
+    par_push(t->scan, t->lab_top);
+    t->scan = t->lab_top = par_claim(GC_LAB_SIZE);
+    t->lab_end = t->lab_top + GC_LAB_SIZE;
   }
+  uint8_t *p = t->lab_top;
+  t->lab_top += size;
+  return p;
+}
 
-  size_t keylen = strlen(keyval);
+// The parallel counterpart of forward()
+static Val *par_forward(GcThread *t, Val *obj) {
+  if (!in_from_space(obj))
+    return obj;
 
-  // http://en.wikipedia.org/wiki/Jenkins_hash_function
-  for (hash = i = 0; i < keylen; ++i) {
-    hash += keyval[i];
-    hash += (hash << 10);
-    hash ^= (hash >> 6);
+  GcHeader h = {.word = __atomic_load_n((uint64_t *)obj, __ATOMIC_ACQUIRE)};
+  if (h.type == TMOVED)
+    return (Val *)((uint8_t *)memory + h.size);
+
+  size_t size = h.size;
+  bool large = size > GC_LARGE_OBJECT;
+  uint8_t *newloc = large ? par_claim(size) : par_lab_alloc(t, size);
+  memcpy(newloc, obj, size);
+  // The header may have been overwritten by a winning thread while copying
+  ((GcHeader *)newloc)->word = h.word;
+
+  GcHeader moved = {.type = TMOVED, .size = newloc - (uint8_t *)memory};
+  if (__atomic_compare_exchange_n((uint64_t *)obj, &h.word, moved.word, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    if (large)
+      par_push(newloc, newloc + size);
+    return (Val *)newloc;
   }
-  hash += (hash << 3);
-  hash ^= (hash >> 11);
-  hash += (hash << 15);
-
-  return hash % OBJ_HM_SIZE;
-}
 
-static bool obj_valid_key(Val *key) {
-  size_t t = key->type;
-  return t == TSYM || t == TSTR || t == TINT;
+  // Another thread moved it first; h now holds its forwarding header.
+  if (large)
+    par_fill(newloc, newloc + size);
+  else
+    t->lab_top -= size;
+  return (Val *)((uint8_t *)memory + h.size);
 }
 
-static bool obj_key_eq(Val *a, Val *b) {
-  if (a->type == TSYM && b->type == TSYM) {
-    return a == b;
-  } else if (a->type == TINT && b->type == TINT) {
-    return a->intv == b->intv;
-  } else if (a->type == TSTR && b->type == TSTR) {
-    return strcmp(a->strv, b->strv) == 0;
-  } else {
-    return false;
-  }
+static void par_scan_object(GcThread *t, Val *obj) {
+  size_t n;
+  Val **fields = obj_pointers(obj, &n);
+  for (size_t i = 0; i < n; i++)
+    fields[i] = par_forward(t, fields[i]);
 }
 
-// Gets the alist cell for k in obj (or NULL)
-// Take an already computed hash (used in obj_set)
-static Val *_obj_get(Val *obj, size_t h, Val *k) {
-  Val *list = obj->props[h];
-  for (Val *pair = list; pair != Nil; pair = pair->cdr) {
-    if (obj_key_eq(k, pair->car->car)) {
-      return pair->car;
+static void *par_worker(void *arg) {
+  GcThread *t = arg;
+  GcRange range;
+  for (;;) {
+    // Drain the LAB. The object is taken off the queue before it is scanned,
+    // so that a LAB retired while scanning it does not hand it out again.
+    while (t->scan < t->lab_top) {
+      if (__atomic_load_n(&par_idle, __ATOMIC_RELAXED) > 0 &&
+          t->lab_top - t->scan >= GC_DONATE_MIN) {
+        par_push(t->scan, t->lab_top);
+        t->scan = t->lab_top;
+        break;
+      }
+      Val *obj = (Val *)t->scan;
+      t->scan += obj_size(obj);
+      par_scan_object(t, obj);
+    }
+    if (t->scan < t->lab_top)
+      continue;
+    if (!par_pop(&range))
+      break;
+    for (uint8_t *p = range.start; p < range.end;) {
+      Val *obj = (Val *)p;
+      p += obj_size(obj);
+      par_scan_object(t, obj);
     }
   }
+  par_fill(t->lab_top, t->lab_end);
   return NULL;
 }
 
-// Gets the alist cell for k in obj (or NULL)
-static Val *obj_get(Val *obj, Val *k) {
-  return _obj_get(obj, obj_hash(k), k);
+static bool gc_use_parallel() {
+  return gc_threads > 1 && !gc_hier && mem_nused >= GC_PARALLEL_MIN;
 }
 
-// Gets the alist cell for k in obj or any of it's prototypes
-static Val *obj_find(Val *obj, Val *k) {
-  size_t h = obj_hash(k);
-  for (Val *o = obj; o != Nil; o = o->proto) {
-    Val *v = _obj_get(o, h, k);
-    if (v != NULL) {
-      return v;
-    }
-  }
-  return NULL;
+// Traces everything reachable from the objects between scan1 and scan2 on
+// gc_threads threads. Returns the end of the used to-space.
+static Val *gc_parallel() {
+  par_top = (uint8_t *)scan2 - (uint8_t *)memory;
+  par_nthreads = gc_threads;
+  par_idle = 0;
+  par_done = false;
+  par_nwork = 0;
+  par_push((uint8_t *)scan1, (uint8_t *)scan2);
+
+  GcThread threads[par_nthreads];
+  memset(threads, 0, sizeof(threads));
+  for (int i = 1; i < par_nthreads; i++)
+    if (pthread_create(&threads[i].thread, NULL, par_worker, &threads[i]))
+      par_nthreads = i;
+  par_worker(&threads[0]);
+  for (int i = 1; i < par_nthreads; i++)
+    pthread_join(threads[i].thread, NULL);
+  return (Val *)((uint8_t *)memory + par_top);
 }
 
-// Set object key to value
-static void obj_set(void *root, Val **obj, Val **key, Val **val) {
-  DEFINE2(root, list, pair);
+#undef GC_PARALLEL_MIN
+#undef GC_LAB_SIZE
+#undef GC_LARGE_OBJECT
+#undef GC_DONATE_MIN
 
-  size_t h = obj_hash(*key);
-  *pair = _obj_get(*obj, h, *key);
-  *list = (*obj)->props[h];
+// }}}
 
-  if (*pair == NULL) {
-    // Not found, insert
-    *pair = cons(root, key, val);
-    *pair = cons(root, pair, list);
-    (*obj)->props[h] = *pair;
-  } else {
-    // Found, set-cdr
-    (*pair)->cdr = *val;
+// {{{ gc: weak
+
+// Weak references and weak tables are kept in registries outside the heap.
+// The collector does not follow their weak fields while tracing; once every
+// strongly reachable object has been copied, gc_weak() walks the registries:
+//
+//  - Entries of live weak tables whose key was reached get their value
+//    traced, which may reach more keys, so this repeats until nothing new is
+//    copied (the ephemeron fixpoint).
+//  - Entries whose key was not reached are dropped and the tables rehashed,
+//    as the keys they hash by address have moved.
+//  - Weak references whose target was not reached are cleared.
+//
+// Weak objects in a perm region keep their referents alive, like any other
+// pointer found on a dirty card.
+
+static Val **weak_refs = NULL;
+static size_t weak_nrefs = 0;
+static size_t weak_refs_cap = 0;
+
+static Val **weak_tables = NULL;
+static size_t weak_ntables = 0;
+static size_t weak_tables_cap = 0;
+
+// Appends obj to a growable array of objects tracked outside the heap.
+static void registry_add(Val ***list, size_t *n, size_t *cap, Val *obj) {
+  if (*n == *cap) {
+    *cap = *cap ? *cap * 2 : 16;
+    *list = realloc(*list, sizeof(Val *) * *cap);
   }
+  (*list)[(*n)++] = obj;
 }
 
-// Remove a k/v from object
-static void obj_del(Val *obj, Val *k) {
-  size_t h = obj_hash(k);
-  Val **list = &obj->props[h];
+static inline size_t weak_hash(Val *key) {
+  return ((uintptr_t)key >> 3) % WTABLE_SIZE;
+}
 
-  for (Val **pair = list; (*pair) != Nil; *pair = (*pair)->cdr) {
-    if (obj_key_eq(k, (*pair)->car->car)) {
-      *pair = (*pair)->cdr;
+// Returns where obj lives after this collection, or NULL if it has not been
+// reached (yet).
+static Val *gc_survivor(Val *obj) {
+  if (!in_from_space(obj))
+    return obj;
+  return obj->type == TMOVED ? (Val *)((uint8_t *)memory + obj->moved) : NULL;
+}
+
+// Copies everything reachable from the objects between scan1 and scan2.
+static void gc_drain() {
+  while (scan1 < scan2) {
+    scan_object(scan1);
+    scan1 = (Val *)((uint8_t *)scan1 + obj_size(scan1));
+  }
+}
+
+// Rebuilds the buckets of a weak table. During GC, also drops the entries
+// whose keys were not reached.
+static void weak_rehash(Val *table, bool in_gc) {
+  Val *entries = Nil;
+  for (size_t i = 0; i < WTABLE_SIZE; i++) {
+    Val *e = table->buckets[i];
+    while (e != Nil) {
+      Val *next = e->next;
+      if (!in_gc || gc_survivor(e->key)) {
+        e->next = entries;
+        entries = e;
+      } else {
+        // The entry has been copied but is garbage now; don't leave pointers
+        // into the from-space behind for heap walks.
+        e->next = e->key = e->value = Nil;
+      }
+      e = next;
     }
+    table->buckets[i] = Nil;
+  }
+  table->count = 0;
+  while (entries != Nil) {
+    Val *e = entries;
+    entries = e->next;
+    size_t h = weak_hash(e->key);
+    e->next = table->buckets[h];
+    write_barrier(&e->next);
+    table->buckets[h] = e;
+    write_barrier(&table->buckets[h]);
+    table->count++;
   }
 }
 
-// }}}
+static void gc_weak() {
+  for (;;) {
+    Val *top = scan2;
+    for (size_t i = 0; i < weak_ntables; i++) {
+      // A table may itself become reachable through an entry's value
+      Val *table = gc_survivor(weak_tables[i]);
+      if (!table)
+        continue;
+      for (size_t b = 0; b < WTABLE_SIZE; b++) {
+        for (Val *e = table->buckets[b]; e != Nil; e = e->next) {
+          Val *key = gc_survivor(e->key);
+          if (key) {
+            e->key = key;
+            e->value = forward(e->value);
+          }
+        }
+      }
+    }
+    if (scan2 == top)
+      break;
+    gc_drain();
+  }
 
-static Val *make_primitive(void *root, Primitive *fn) {
-  Val *r = alloc(root, TPRI, sizeof(Primitive *));
-  r->priv = fn;
-  return r;
-}
+  size_t n = 0;
+  for (size_t i = 0; i < weak_ntables; i++) {
+    Val *table = gc_survivor(weak_tables[i]);
+    if (!table)
+      continue;
+    weak_rehash(table, true);
+    weak_tables[n++] = table;
+  }
+  weak_ntables = n;
 
-static Val *make_function(void *root, Val **env, int type, Val **params,
-                          Val **body) {
-  assert(type == TFUN || type == TMAC);
-  Val *r = alloc(root, type, sizeof(Val *) * 3);
-  r->params = *params;
-  r->body = *body;
-  r->env = *env;
-  return r;
+  n = 0;
+  for (size_t i = 0; i < weak_nrefs; i++) {
+    Val *ref = gc_survivor(weak_refs[i]);
+    if (!ref)
+      continue;
+    Val *target = gc_survivor(ref->target);
+    ref->target = target ? target : Nil;
+    weak_refs[n++] = ref;
+  }
+  weak_nrefs = n;
 }
 
 // }}}
 
-// {{{ util + pretty-print
-
-// May create a new symbol. If there's a symbol with the same name, it will not
-// create a new symbol but return the existing one.
-static Val *intern(void *root, char *name) {
-  for (Val *p = symbols; p != Nil; p = p->cdr)
-    if (strcmp(name, p->car->symv) == 0)
-      return p->car;
-  DEFINE1(root, sym);
-  *sym = make_symbol(root, name);
-  symbols = cons(root, sym, &symbols);
-  return *sym;
+// {{{ gc: handles
+
+// Resource handles wrap file descriptors returned by open, socket and accept.
+// Handles that were not reached by a collection are closed before the
+// from-space goes away, so a handler that errors out before calling close
+// does not leak its fd. Handles in a perm region are never collected.
+
+static Val **handles = NULL;
+static size_t nhandles = 0;
+static size_t handles_cap = 0;
+
+static void gc_finalize_handles() {
+  size_t n = 0;
+  for (size_t i = 0; i < nhandles; i++) {
+    Val *h = gc_survivor(handles[i]);
+    if (h) {
+      handles[n++] = h;
+    } else if (handles[i]->fd >= 0) {
+      close(handles[i]->fd);
+    }
+  }
+  nhandles = n;
 }
 
-#define PP_MAX_LEN 16384
-static char *pr_str(void *root, Val *obj) {
+static char *pr_str(void *root, Val *);
 
-  char *buf = malloc(sizeof(char) * PP_MAX_LEN);
-  bzero(buf, sizeof(char) * PP_MAX_LEN);
-  char *s;
-  Val *val;
-  int len = 0;
+// Copies the root objects.
+static void forward_root_objects(void *root) {
+  symbols = forward(symbols);
 
-  switch (obj->type) {
-  case TCELL:
-    len += sprintf(&buf[len], "(");
-    for (;;) {
-      s = pr_str(root, obj->car);
-      len += sprintf(&buf[len], "%s", s);
-      free(s);
-      if (obj->cdr == Nil)
-        break;
-      if (obj->cdr->type != TCELL) {
-        len += sprintf(&buf[len], " . ");
-        s = pr_str(root, obj->cdr);
-        len += sprintf(&buf[len], "%s", s);
-        free(s);
-        break;
+  // In `root` [0] it a pointer to the previous root, [n] is an object on the
+  // stack and [n+1] is the ROOT_END delimiter
+  for (void **frame = root; frame; frame = *(void ***)frame) {
+    for (int i = 1; frame[i] != ROOT_END; i++) {
+      if (frame[i]) {
+        frame[i] = forward(frame[i]);
       }
-      len += sprintf(&buf[len], " ");
-      obj = obj->cdr;
-    }
-    len += sprintf(&buf[len], ")");
-    return buf;
-  case TSTR:
-    len += sprintf(&buf[len], "\"");
-    len += u8_escape(&buf[len], PP_MAX_LEN - len, obj->strv, '"');
-    len += sprintf(&buf[len], "\"");
-    return buf;
-  case TOBJ:
-    val = obj_find(obj, intern(root, "*object-name*"));
-    if (val != NULL && val->cdr->type == TSTR) {
-      len += sprintf(&buf[len], "<object %s %p>", val->cdr->strv, obj);
-    } else {
-      len += sprintf(&buf[len], "<object %s %p>", "nil", obj);
     }
-    return buf;
+  }
 
-#define CASE(type, ...)                                                        \
-  case type:                                                                   \
-    len += sprintf(&buf[len], __VA_ARGS__);                                    \
-    return buf
+  // Persist/Forward watchers root objects
+  for (ev_watcher_list *w = ev_watchers; w != NULL; w = w->next) {
+    WatcherState *wdata = w->data;
+    wdata->env = forward(wdata->env);
+    wdata->callback = forward(wdata->callback);
+    wdata->fd = forward(wdata->fd);
+  }
 
-    CASE(TINT, "%d", obj->intv);
-    CASE(TSYM, "%s", obj->symv);
-    CASE(TPRI, "<primitive>");
-    CASE(TFUN, "<function>");
-    CASE(TMAC, "<macro>");
-    CASE(TMOVED, "<moved>");
-    CASE(TTRUE, "t");
-    CASE(TNIL, "()");
+  // Profiled functions and their names
+  for (size_t i = 0; i < prof_nentries; i++) {
+    prof_entries[i].fn = forward(prof_entries[i].fn);
+    if (prof_entries[i].name)
+      prof_entries[i].name = forward(prof_entries[i].name);
+  }
+}
 
-#undef CASE
+static void region_reset();
 
-  default:
-    // DEBUG
-    // len += sprintf(&buf[len], "<tag %d>", obj->type);
-    // return buf;
-    free(buf);
-    // TODO append obj->type
-    error("Bug: print: Unknown tag type");
+// Implements Cheney's copying garbage collection algorithm.
+// http://en.wikipedia.org/wiki/Cheney%27s_algorithm
+// A minor collection copies the young heap. A full one copies the tenured
+// space along with it, leaving every live object in the young heap.
+static void gc_collect(void *root, bool full) {
+  assert(!gc_running);
+  gc_running = true;
+  uint64_t start_ns = now_ns();
+
+  // Allocate a new semi-space.
+  from_space = memory;
+  from_space_size = MEMORY_SIZE;
+  memory = alloc_semispace();
+  from_region = region_start;
+  from_region_size = region_used;
+  if (full && tenured.start) {
+    from_tenured = tenured.start;
+    from_tenured_size = tenured.size;
   }
-}
 
-int setnonblock(int fd) {
-  int flags;
+  // Initialize the two pointers for GC. Initially they point to the beginning
+  // of the to-space.
+  scan1 = scan2 = memory;
 
-  flags = fcntl(fd, F_GETFL);
-  flags |= O_NONBLOCK;
-  return fcntl(fd, F_SETFL, flags);
-}
+  // Copy the GC root objects first. This moves the pointer scan2.
+  forward_root_objects(root);
+  perm_scan_cards();
 
-// }}}
+  // Copy the objects referenced by the GC root objects located between scan1
+  // and scan2. Once it's
+  // finished, all live objects (i.e. objects reachable from the root) will have
+  // been copied to
+  // the to-space.
+  if (gc_use_parallel())
+    scan1 = scan2 = gc_parallel();
+  else
+    gc_drain();
+  gc_weak();
+  gc_finalize_handles();
+  sites_update(full);
 
-// {{{ reader
+  // Finish up GC.
+  // free(from_space);
+  munmap(from_space, MEMORY_SIZE);
+  from_space_size = 0;
+  size_t old_nused = mem_nused + from_tenured_size + from_region_size;
+  if (from_tenured) {
+    tenured_release();
+    from_tenured = NULL;
+    from_tenured_size = 0;
+  }
+  region_reset();
+  if (prof_nentries > 0)
+    prof_rehash();
+  char_index_clear();
+  mem_nused = (size_t)((uint8_t *)scan1 - (uint8_t *)memory);
+  if (debug_gc)
+    fprintf(stderr, "GC: %zu bytes out of %zu bytes copied.\n", mem_nused,
+            old_nused);
+  gc_count++;
+  gc_pause_ns += now_ns() - start_ns;
+  gc_running = false;
+}
 
-#define SYMBOL_MAX_LEN 200
-#define STRING_MAX_LEN 1000
-const char symbol_chars[] = "~!#$%^&*-_=+:/?<>";
+static void gc(void *root) {
+  if (major_pending)
+    gc_major(root);
+  else
+    gc_collect(root, false);
+}
 
-static bool valid_symbol_start_char(char c) {
-  return (isalpha(c) || strchr(symbol_chars, c)) && c != '\0';
+// Collects everything into the young heap and drops the tenured space, for
+// callers that need the whole heap in one place.
+static void gc_full(void *root) {
+  gc_collect(root, true);
 }
 
-static bool valid_symbol_char(char c) {
-  return (isalnum(c) || strchr(symbol_chars, c)) && c != '\0';
+// Collects the young heap and the tenured space together and makes what
+// survives the new tenured space.
+static void gc_major(void *root) {
+  gc_collect(root, true);
+  space_init(&tenured, memory, mem_nused, MEMORY_SIZE);
+  memory = alloc_semispace();
+  mem_nused = 0;
+  major_pending = false;
+  tenured_full = false;
+  major_count++;
 }
 
-typedef struct Reader {
-  int pos;
-  int size;
-  char *input;
-} Reader;
+// Collects all garbage, including the garbage in the tenured space.
+static void gc_all(void *root) {
+  if (tenured.start)
+    gc_major(root);
+  else
+    gc(root);
+}
 
-static Val *reader_expr(Reader *r, void *root);
+// }}}
 
-static Reader *reader_new(char *input) {
-  Reader *r = malloc(sizeof(Reader));
-  r->pos = -1;
-  r->size = strlen(input);
-  r->input = malloc(sizeof(char) * (r->size + 1));
-  strcpy(r->input, input);
+// {{{ gc: region
+
+// (with-region thunk) runs thunk with every allocation going to a bump
+// pointer region instead of the young heap. Handlers that produce lots of
+// short-lived garbage then leave nothing behind for GC: when the thunk
+// returns, the few objects that are still reachable are copied out of the
+// region and the region is reset as a whole.
+//
+// Objects escape the region through the roots (the return value among them)
+// or by being stored into an older object. The latter goes through
+// write_barrier(), which remembers the slot. Blocks too large for the region
+// are allocated from the heap and remembered as a whole, every object in
+// them, since they are filled in with region pointers without a barrier.
+// Leaving the region is then a small Cheney pass whose from-space is the
+// region and whose to-space is the free end of the young heap. Weak
+// references and tables, and handles, are settled like in a collection.
+//
+// A GC while a region is active copies the live part of the region along
+// with the young heap and empties it, so the remembered slots never have to
+// survive a collection. Nested regions share the outermost one.
+
+#define REGION_SIZE (4 << 20)
+
+static Val ***region_slots = NULL;
+static size_t region_nslots = 0;
+static size_t region_slots_cap = 0;
+
+// Heap blocks allocated while in the region, by extent: an alloc_list block
+// is a single allocation holding many cells
+typedef struct {
+  Val *start;
+  size_t size;
+} RegionBlock;
+
+static RegionBlock *region_blocks = NULL;
+static size_t region_nblocks = 0;
+static size_t region_blocks_cap = 0;
+
+// Bytes copied out of regions because they escaped
+static size_t region_escaped = 0;
+
+static Val *region_alloc(void *root, size_t size) {
+  if (size > REGION_SIZE)
+    return NULL;
+  if (!region_start)
+    region_start = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (REGION_SIZE < region_used + size)
+    gc(root);
+  Val *obj = (Val *)(region_start + region_used);
+  region_used += size;
+  return obj;
+}
+
+static void region_remember(Val **slot) {
+  if (region_nslots == region_slots_cap) {
+    region_slots_cap = region_slots_cap ? region_slots_cap * 2 : 64;
+    region_slots = realloc(region_slots, sizeof(Val **) * region_slots_cap);
+  }
+  region_slots[region_nslots++] = slot;
+}
+
+static void region_remember_block(Val *obj, size_t size) {
+  if (region_nblocks == region_blocks_cap) {
+    region_blocks_cap = region_blocks_cap ? region_blocks_cap * 2 : 16;
+    region_blocks =
+        realloc(region_blocks, sizeof(RegionBlock) * region_blocks_cap);
+  }
+  region_blocks[region_nblocks++] = (RegionBlock){obj, size};
+}
+
+// Forgets the region contents once nothing points into it anymore.
+static void region_reset() {
+  region_used = 0;
+  region_nslots = 0;
+  region_nblocks = 0;
+  from_region = NULL;
+  from_region_size = 0;
+}
+
+// Copies the objects that escaped the region to the young heap and empties
+// the region.
+static void region_end(void *root) {
+  if (region_used == 0)
+    return;
+  // A collection empties the region too
+  if (MEMORY_SIZE < mem_nused + region_used) {
+    gc(root);
+    return;
+  }
+
+  assert(!gc_running);
+  gc_running = true;
+  uint64_t start_ns = now_ns();
+  from_region = region_start;
+  from_region_size = region_used;
+  scan1 = scan2 = (Val *)((uint8_t *)memory + mem_nused);
+
+  forward_root_objects(root);
+  for (size_t i = 0; i < region_nslots; i++)
+    *region_slots[i] = forward(*region_slots[i]);
+  for (size_t i = 0; i < region_nblocks; i++) {
+    uint8_t *p = (uint8_t *)region_blocks[i].start;
+    uint8_t *end = p + region_blocks[i].size;
+    for (; p < end; p += obj_size((Val *)p))
+      scan_object((Val *)p);
+  }
+  gc_drain();
+  gc_weak();
+  gc_finalize_handles();
+
+  size_t escaped = (uint8_t *)scan1 - (uint8_t *)memory - mem_nused;
+  region_escaped += escaped;
+  mem_nused += escaped;
+  if (mem_nused > mem_peak)
+    mem_peak = mem_nused;
+  if (prof_nentries > 0)
+    prof_rehash();
+  char_index_clear();
+  if (debug_gc)
+    fprintf(stderr, "GC: %zu bytes out of %zu bytes escaped the region.\n",
+            escaped, region_used);
+  region_reset();
+  gc_pause_ns += now_ns() - start_ns;
+  gc_running = false;
+}
+
+// Leaves the regions entered since depth, after an error unwound past them.
+static void region_unwind(void *root, int depth) {
+  if (region_depth <= depth)
+    return;
+  region_depth = depth;
+  if (region_depth == 0)
+    region_end(root);
+}
+
+#undef REGION_SIZE
+
+// }}}
+
+// {{{ constructors
+
+static Val *make_int(void *root, int64_t value) {
+  Val *r = alloc(root, TINT, sizeof(int64_t));
+  r->intv = value;
   return r;
 }
 
-static void reader_destroy(Reader *r) {
-  free(r->input);
-  free(r);
+static Val *make_float(void *root, double value) {
+  Val *r = alloc(root, TFLOAT, sizeof(double));
+  r->floatv = value;
+  return r;
 }
 
-static int reader_peek(Reader *r) {
-  if ((r->pos + 1) == r->size) {
-    return EOF;
+// Allocates a string of len bytes, copied from value unless it is NULL.
+static Val *make_str_len(void *root, const char *value, size_t len) {
+  if (len > UINT32_MAX)
+    error("String too long");
+  size_t size = offsetof(Val, strv) - offsetof(Val, car);
+  Val *str = alloc(root, TSTR, size + len + 1);
+  str->slen = len;
+  str->shash = 0;
+  if (value)
+    memcpy(str->strv, value, len);
+  str->strv[len] = '\0';
+  return str;
+}
+
+static Val *make_str(void *root, char *value) {
+  return make_str_len(root, value, strlen(value));
+}
+
+static bool is_str(Val *v) { return v->type == TSTR || v->type == TSLICE; }
+
+// Returns the bytes of a string or slice, valid until the next allocation.
+static char *str_ptr(Val *str) {
+  return str->type == TSTR ? str->strv : str->sparent->strv + str->soff;
+}
+
+// Copies str to buf, which has room for slen + 1 bytes, for use as a C string
+// (a path, a symbol name...). An embedded NUL would silently cut it short, so
+// that raises msg instead.
+static char *str_to_c(Val *str, char *buf, char *msg) {
+  if (memchr(str_ptr(str), '\0', str->slen))
+    error(msg);
+  memcpy(buf, str_ptr(str), str->slen);
+  buf[str->slen] = '\0';
+  return buf;
+}
+
+// Slices shorter than this are copied, the copy being no larger than the
+// slice itself.
+#define SLICE_MIN_LEN 16
+
+// Makes the substring of len bytes at off in the string or slice str, which
+// shares its bytes unless it is short.
+static Val *make_slice(void *root, Val **str, size_t off, size_t len) {
+  if (off == 0 && len == (*str)->slen)
+    return *str;
+  if (len < SLICE_MIN_LEN) {
+    Val *r = make_str_len(root, NULL, len);
+    memcpy(r->strv, str_ptr(*str) + off, len);
+    return r;
   }
-  return r->input[r->pos + 1];
+  size_t size = offsetof(Val, soff) + sizeof(size_t) - offsetof(Val, car);
+  Val *r = alloc(root, TSLICE, size);
+  r->slen = len;
+  r->shash = 0;
+  if ((*str)->type == TSLICE) {
+    r->sparent = (*str)->sparent;
+    r->soff = (*str)->soff + off;
+  } else {
+    r->sparent = *str;
+    r->soff = off;
+  }
+  return r;
 }
 
-static int reader_next(Reader *r) {
-  r->pos++;
-  if (r->pos == r->size) {
-    return EOF;
+static Val *make_symbol(void *root, char *name) {
+  Val *sym = alloc_at(root, TSYM, strlen(name) + 1, SITE_SYMBOL);
+  strcpy(sym->symv, name);
+  return sym;
+}
+
+// {{{ constructors: list
+
+// cell/list constructor
+static Val *cons(void *root, Val **car, Val **cdr) {
+  Val *cell = alloc(root, TCELL, sizeof(Val *) * 2);
+  cell->car = *car;
+  cell->cdr = *cdr;
+  return cell;
+}
+
+// Allocates a list of n cells laid out contiguously in address order, so that
+// walking it touches memory sequentially. The cars are Nil.
+static Val *alloc_list(void *root, size_t n) {
+  const size_t cell_size = offsetof(Val, car) + sizeof(Val *) * 2;
+  Val *list = alloc(root, TCELL, cell_size * n - offsetof(Val, car));
+  uint8_t *p = (uint8_t *)list;
+  for (size_t i = 0; i < n; i++, p += cell_size) {
+    Val *cell = (Val *)p;
+    cell->type = TCELL;
+    cell->size = cell_size;
+    cell->car = Nil;
+    cell->cdr = i + 1 < n ? (Val *)(p + cell_size) : Nil;
   }
-  return r->input[r->pos];
+  return list;
 }
 
-// Skips the input until newline is found. Newline is one of \r, \r\n or \n.
-static void reader_skip_line(Reader *r) {
-  for (;;) {
-    int c = reader_next(r);
-    if (c == EOF || c == '\n') {
-      return;
+// Returns a new contiguous list holding the elements of the reversed list
+// *rev in their original order, followed by *tail.
+static Val *list_from_reversed(void *root, Val **rev, Val **tail) {
+  size_t n = 0;
+  for (Val *p = *rev; p != Nil; p = p->cdr)
+    n++;
+  if (n == 0)
+    return *tail;
+  const size_t cell_size = offsetof(Val, car) + sizeof(Val *) * 2;
+  Val *list = alloc_list(root, n);
+  uint8_t *last = (uint8_t *)list + cell_size * (n - 1);
+  ((Val *)last)->cdr = *tail;
+  for (Val *p = *rev; p != Nil; p = p->cdr, last -= cell_size)
+    ((Val *)last)->car = p->car;
+  return list;
+}
+
+// Returns the length of the given list. -1 if it's not a proper list.
+static int length(Val *list) {
+  int len = 0;
+  for (; list->type == TCELL; list = list->cdr)
+    len++;
+  return list == Nil ? len : -1;
+}
+
+// Destructively reverses the given list.
+static Val *reverse(Val *p) {
+  Val *ret = Nil;
+  while (p != Nil) {
+    Val *head = p;
+    p = p->cdr;
+    head->cdr = ret;
+    write_barrier(&head->cdr);
+    ret = head;
+  }
+  return ret;
+}
+
+// Returns ((x . y) . a)
+static Val *acons(void *root, Val **x, Val **y, Val **a) {
+  DEFINE1(root, cell);
+  *cell = cons(root, x, y);
+  return cons(root, cell, a);
+}
+
+// }}}
+
+// {{{ constructors: bignum
+
+// Integers that overflow int64_t are promoted to bignums, and results that fit
+// again are demoted back to ints, so a TBIG never holds a value an int could.
+// Arithmetic works on unpacked Bigs whose limbs live in malloc'ed buffers, so
+// that the GC run by allocating the result can't move them.
+typedef struct {
+  // -1, 0 or 1
+  int sign;
+  // limbs in use, the most significant one is never 0
+  size_t n;
+  uint32_t *d;
+} Big;
+
+// Multiplications where both operands have at least this many limbs are split
+// in halves with Karatsuba's method, below it schoolbook is faster.
+#define KARATSUBA_MIN 32
+
+static inline bool is_int(Val *v) { return v->type == TINT || v->type == TBIG; }
+
+static Big big_alloc(size_t n) {
+  return (Big){.sign = 0, .n = n, .d = calloc(n ? n : 1, sizeof(uint32_t))};
+}
+
+static void big_free(Big *b) {
+  free(b->d);
+  b->d = NULL;
+}
+
+static void big_trim(Big *b) {
+  while (b->n && b->d[b->n - 1] == 0)
+    b->n--;
+  if (b->n == 0)
+    b->sign = 0;
+}
+
+static Big big_from_int(int64_t v) {
+  Big b = big_alloc(2);
+  uint64_t m = v < 0 ? -(uint64_t)v : (uint64_t)v;
+  b.d[0] = (uint32_t)m;
+  b.d[1] = (uint32_t)(m >> 32);
+  b.sign = v < 0 ? -1 : 1;
+  big_trim(&b);
+  return b;
+}
+
+static Big big_from_val(Val *v) {
+  if (v->type == TINT)
+    return big_from_int(v->intv);
+  Big b = big_alloc(v->nlimbs);
+  memcpy(b.d, v->limbs, sizeof(uint32_t) * v->nlimbs);
+  b.sign = v->sign;
+  return b;
+}
+
+// Returns b as an int if it fits, as a new bignum otherwise. Frees b.
+static Val *make_big(void *root, Big *b) {
+  if (b->n <= 2) {
+    uint64_t m = b->n == 0   ? 0
+                 : b->n == 1 ? b->d[0]
+                             : b->d[0] | (uint64_t)b->d[1] << 32;
+    if (m <= INT64_MAX || (b->sign < 0 && m == (uint64_t)INT64_MAX + 1)) {
+      big_free(b);
+      return make_int(root, b->sign < 0 ? (int64_t)-m : (int64_t)m);
     }
-    if (c == '\r') {
-      if (reader_peek(r) == '\n') {
-        reader_next(r);
+  }
+  Val *r = alloc(root, TBIG, sizeof(int) * 2 + sizeof(uint32_t) * b->n);
+  r->sign = b->sign;
+  r->nlimbs = b->n;
+  memcpy(r->limbs, b->d, sizeof(uint32_t) * b->n);
+  big_free(b);
+  return r;
+}
+
+// Compares the trimmed magnitudes a and b.
+static int mag_cmp(const uint32_t *a, size_t an, const uint32_t *b, size_t bn) {
+  if (an != bn)
+    return an < bn ? -1 : 1;
+  for (size_t i = an; i-- > 0;)
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  return 0;
+}
+
+// r[0..rn) += a[0..an), with rn >= an. Returns the carry out of r.
+static uint32_t mag_add_into(uint32_t *r, size_t rn, const uint32_t *a,
+                             size_t an) {
+  uint64_t c = 0;
+  size_t i = 0;
+  for (; i < an; i++, c >>= 32) {
+    c += (uint64_t)r[i] + a[i];
+    r[i] = (uint32_t)c;
+  }
+  for (; c && i < rn; i++, c >>= 32) {
+    c += r[i];
+    r[i] = (uint32_t)c;
+  }
+  return (uint32_t)c;
+}
+
+// r[0..rn) -= a[0..an), with rn >= an and r >= a.
+static void mag_sub_into(uint32_t *r, size_t rn, const uint32_t *a,
+                         size_t an) {
+  int64_t borrow = 0;
+  size_t i = 0;
+  for (; i < an; i++) {
+    int64_t t = (int64_t)r[i] - a[i] - borrow;
+    r[i] = (uint32_t)t;
+    borrow = t < 0;
+  }
+  for (; borrow && i < rn; i++) {
+    int64_t t = (int64_t)r[i] - borrow;
+    r[i] = (uint32_t)t;
+    borrow = t < 0;
+  }
+}
+
+// r[0..an+bn) = a * b. The operands may have leading zero limbs.
+static void mag_mul(uint32_t *r, const uint32_t *a, size_t an,
+                    const uint32_t *b, size_t bn) {
+  if (an < bn) {
+    const uint32_t *t = a;
+    a = b;
+    b = t;
+    size_t tn = an;
+    an = bn;
+    bn = tn;
+  }
+  memset(r, 0, sizeof(uint32_t) * (an + bn));
+
+  if (bn < KARATSUBA_MIN) {
+    for (size_t i = 0; i < bn; i++) {
+      uint64_t c = 0;
+      for (size_t j = 0; j < an; j++, c >>= 32) {
+        c += (uint64_t)a[j] * b[i] + r[i + j];
+        r[i + j] = (uint32_t)c;
       }
-      return;
+      r[i + an] = (uint32_t)c;
+    }
+    return;
+  }
+
+  // Unbalanced operands: multiply b by bn-limb chunks of a, so that each
+  // product is balanced.
+  if (an >= 2 * bn) {
+    uint32_t *t = malloc(sizeof(uint32_t) * 2 * bn);
+    for (size_t off = 0; off < an; off += bn) {
+      size_t cn = an - off < bn ? an - off : bn;
+      mag_mul(t, a + off, cn, b, bn);
+      mag_add_into(r + off, an + bn - off, t, cn + bn);
     }
+    free(t);
+    return;
   }
+
+  // Karatsuba: with a = a1 B^m + a0 and b = b1 B^m + b0,
+  // a b = z2 B^2m + ((a0 + a1)(b0 + b1) - z2 - z0) B^m + z0
+  // where z2 = a1 b1 and z0 = a0 b0.
+  size_t m = an / 2, a1n = an - m, b1n = bn - m;
+  mag_mul(r, a, m, b, m);
+  mag_mul(r + 2 * m, a + m, a1n, b + m, b1n);
+
+  size_t san = a1n + 1, sbn = (b1n > m ? b1n : m) + 1, zn = san + sbn;
+  uint32_t *sa = calloc(san + sbn + zn, sizeof(uint32_t));
+  uint32_t *sb = sa + san, *z = sb + sbn;
+  memcpy(sa, a + m, sizeof(uint32_t) * a1n);
+  mag_add_into(sa, san, a, m);
+  memcpy(sb, b, sizeof(uint32_t) * m);
+  mag_add_into(sb, sbn, b + m, b1n);
+  mag_mul(z, sa, san, sb, sbn);
+  mag_sub_into(z, zn, r, 2 * m);
+  mag_sub_into(z, zn, r + 2 * m, a1n + b1n);
+  while (zn && z[zn - 1] == 0)
+    zn--;
+  mag_add_into(r + m, an + bn - m, z, zn);
+  free(sa);
 }
 
-// Reads a list. Note that '(' has already been read.
-static Val *reader_list(Reader *r, void *root) {
-  DEFINE3(root, obj, head, last);
-  *head = Nil;
-  for (;;) {
-    *obj = reader_expr(r, root);
-    if (!*obj)
-      error("Unclosed parenthesis");
-    if (*obj == Cparen)
-      return reverse(*head);
-    if (*obj == Dot) {
-      *last = reader_expr(r, root);
-      if (reader_expr(r, root) != Cparen)
-        error("Closed parenthesis expected after dot");
-      Val *ret = reverse(*head);
-      (*head)->cdr = *last;
-      return ret;
+// q[0..an) = a / d, returns a % d. q may be a.
+static uint32_t mag_divmod_1(uint32_t *q, const uint32_t *a, size_t an,
+                             uint32_t d) {
+  uint64_t rem = 0;
+  for (size_t i = an; i-- > 0;) {
+    uint64_t cur = rem << 32 | a[i];
+    q[i] = (uint32_t)(cur / d);
+    rem = cur % d;
+  }
+  return (uint32_t)rem;
+}
+
+// Knuth's algorithm D (TAOCP 4.3.1). a and b are trimmed, an >= bn >= 2.
+// q gets an - bn + 1 limbs and r gets bn limbs.
+static void mag_divmod(uint32_t *q, uint32_t *r, const uint32_t *a, size_t an,
+                       const uint32_t *b, size_t bn) {
+  // Normalize so that the top bit of the divisor is set
+  int s = __builtin_clz(b[bn - 1]);
+  uint32_t *u = calloc(an + 1 + bn, sizeof(uint32_t)), *v = u + an + 1;
+  for (size_t i = bn - 1; i > 0; i--)
+    v[i] = b[i] << s | (uint32_t)((uint64_t)b[i - 1] >> (32 - s));
+  v[0] = b[0] << s;
+  u[an] = (uint32_t)((uint64_t)a[an - 1] >> (32 - s));
+  for (size_t i = an - 1; i > 0; i--)
+    u[i] = a[i] << s | (uint32_t)((uint64_t)a[i - 1] >> (32 - s));
+  u[0] = a[0] << s;
+
+  for (size_t j = an - bn + 1; j-- > 0;) {
+    // Estimate the quotient limb from the top two limbs, off by at most 2
+    uint64_t num = (uint64_t)u[j + bn] << 32 | u[j + bn - 1];
+    uint64_t qhat = num / v[bn - 1], rhat = num % v[bn - 1];
+    while (qhat >> 32 || qhat * v[bn - 2] > (rhat << 32 | u[j + bn - 2])) {
+      qhat--;
+      rhat += v[bn - 1];
+      if (rhat >> 32)
+        break;
     }
-    *head = cons(root, obj, head);
+
+    // u[j..j+bn] -= qhat * v
+    uint64_t carry = 0;
+    int64_t borrow = 0;
+    for (size_t i = 0; i < bn; i++) {
+      uint64_t p = qhat * v[i] + carry;
+      carry = p >> 32;
+      int64_t t = (int64_t)u[i + j] - (uint32_t)p - borrow;
+      u[i + j] = (uint32_t)t;
+      borrow = t < 0;
+    }
+    int64_t t = (int64_t)u[j + bn] - (int64_t)carry - borrow;
+    u[j + bn] = (uint32_t)t;
+
+    // qhat was one too large, add v back
+    if (t < 0) {
+      qhat--;
+      u[j + bn] += mag_add_into(u + j, bn, v, bn);
+    }
+    q[j] = (uint32_t)qhat;
   }
+
+  for (size_t i = 0; i < bn; i++)
+    r[i] = u[i] >> s | (uint32_t)((uint64_t)u[i + 1] << (32 - s));
+  free(u);
 }
 
-// Reads an alist. Note that '{' has already been read.
-static Val *reader_alist(Reader *r, void *root) {
-  DEFINE6(root, obj, head, ahead, pair, list_sym, cons_sym);
-  *head = Nil;
+// Returns a + b, or a - b when subtract is set.
+static Big big_add(Big *a, Big *b, bool subtract) {
+  Big *x = a, *y = b;
+  int xs = a->sign, ys = subtract ? -b->sign : b->sign;
+  Big r;
+  if (xs * ys >= 0) {
+    if (x->n < y->n) {
+      x = b;
+      y = a;
+    }
+    r = big_alloc(x->n + 1);
+    memcpy(r.d, x->d, sizeof(uint32_t) * x->n);
+    mag_add_into(r.d, r.n, y->d, y->n);
+    r.sign = xs ? xs : ys;
+  } else {
+    if (mag_cmp(x->d, x->n, y->d, y->n) < 0) {
+      x = b;
+      y = a;
+      xs = ys;
+    }
+    r = big_alloc(x->n);
+    memcpy(r.d, x->d, sizeof(uint32_t) * x->n);
+    mag_sub_into(r.d, r.n, y->d, y->n);
+    r.sign = xs;
+  }
+  big_trim(&r);
+  return r;
+}
 
-  for (;;) {
-    *obj = reader_expr(r, root);
-    if (!*obj)
-      error("Unclosed curly brace");
-    if (*obj == Dot)
-      error("Stray dot in alist");
-    if (*obj == Cparen)
-      error("Stray closing parent in alist");
-    if (*obj == Ccurly) {
-      if (length(*head) % 2 != 0) {
-        error("Alist contains un-even number of elements");
-      }
-      if (*head == Nil) {
-        return Nil;
-      }
+static Big big_mul(Big *a, Big *b) {
+  Big r = big_alloc(a->n + b->n);
+  if (a->n && b->n)
+    mag_mul(r.d, a->d, a->n, b->d, b->n);
+  r.sign = a->sign * b->sign;
+  big_trim(&r);
+  return r;
+}
+
+// Truncating division, b must not be 0. The remainder takes the sign of a.
+static void big_divmod(Big *a, Big *b, Big *q, Big *r) {
+  if (mag_cmp(a->d, a->n, b->d, b->n) < 0) {
+    *q = big_alloc(0);
+    *r = big_alloc(a->n);
+    memcpy(r->d, a->d, sizeof(uint32_t) * a->n);
+  } else if (b->n == 1) {
+    *q = big_alloc(a->n);
+    *r = big_alloc(1);
+    r->d[0] = mag_divmod_1(q->d, a->d, a->n, b->d[0]);
+  } else {
+    *q = big_alloc(a->n - b->n + 1);
+    *r = big_alloc(b->n);
+    mag_divmod(q->d, r->d, a->d, a->n, b->d, b->n);
+  }
+  q->sign = a->sign * b->sign;
+  r->sign = a->sign;
+  big_trim(q);
+  big_trim(r);
+}
+
+static double mag_to_double(const uint32_t *d, size_t n, int sign) {
+  double r = 0;
+  for (size_t i = n; i-- > 0;)
+    r = r * 4294967296.0 + d[i];
+  return sign < 0 ? -r : r;
+}
+
+// Returns the integral double d as a Big.
+static Big big_from_double(double d) {
+  int exp;
+  frexp(d, &exp);
+  Big b = big_alloc(exp > 0 ? exp / 32 + 1 : 1);
+  double m = fabs(d);
+  for (size_t i = 0; m >= 1; i++) {
+    b.d[i] = (uint32_t)fmod(m, 4294967296.0);
+    m = floor(m / 4294967296.0);
+  }
+  b.sign = d < 0 ? -1 : 1;
+  big_trim(&b);
+  return b;
+}
+
+static int big_cmp(Big *a, Big *b) {
+  if (a->sign != b->sign)
+    return a->sign < b->sign ? -1 : 1;
+  int c = mag_cmp(a->d, a->n, b->d, b->n);
+  return a->sign < 0 ? -c : c;
+}
+
+// Parses the len decimal digits at s.
+static Big big_from_digits(const char *s, size_t len, bool negative) {
+  Big b = big_alloc(len / 9 + 1);
+  size_t n = 0;
+  for (size_t i = 0; i < len;) {
+    // Shift in up to 9 digits at a time
+    uint32_t chunk = 0, scale = 1;
+    for (int k = 0; k < 9 && i < len; k++, i++) {
+      chunk = chunk * 10 + (s[i] - '0');
+      scale *= 10;
+    }
+    uint64_t c = chunk;
+    for (size_t j = 0; j < n; j++, c >>= 32) {
+      c += (uint64_t)b.d[j] * scale;
+      b.d[j] = (uint32_t)c;
+    }
+    if (c)
+      b.d[n++] = (uint32_t)c;
+  }
+  b.n = n;
+  b.sign = negative ? -1 : 1;
+  big_trim(&b);
+  return b;
+}
+
+// Returns the decimal representation of the bignum v, to be freed by the
+// caller.
+static char *big_to_str(Val *v) {
+  Big b = big_from_val(v);
+  int sign = b.sign;
+  size_t cap = b.n * 10 + 2;
+  char *s = malloc(cap);
+  char *p = s + cap;
+  *--p = '\0';
+  while (b.n) {
+    uint32_t chunk = mag_divmod_1(b.d, b.d, b.n, 1000000000);
+    big_trim(&b);
+    for (int k = 0; k < 9 && (b.n || chunk); k++, chunk /= 10)
+      *--p = '0' + chunk % 10;
+  }
+  if (sign < 0)
+    *--p = '-';
+  memmove(s, p, s + cap - p);
+  big_free(&b);
+  return s;
+}
+
+// }}}
+
+// {{{ constructors: obj
+
+static void obj_set(void *, Val **, Val **, Val **);
+
+// Objects and the cells holding their properties are attributed to the obj
+// site, unless they are made for an env frame.
+static inline int obj_site() {
+  return alloc_site == SITE_DEFAULT ? SITE_OBJ : alloc_site;
+}
+
+static Val *make_obj(void *root, Val **proto) {
+  Val *r = alloc_at(root, TOBJ, sizeof(Val *) * (OBJ_HM_SIZE + 1), obj_site());
+  r->proto = *proto;
+  for (size_t i = 0; i < OBJ_HM_SIZE; i++) {
+    r->props[i] = Nil;
+  }
+  return r;
+}
+
+static Val *make_obj_alist(void *root, Val **proto, Val **props) {
+  DEFINE4(root, obj, key, val, pair);
+  *obj = make_obj(root, proto);
+  for (*pair = *props; *pair != Nil; *pair = (*pair)->cdr) {
+    *key = (*pair)->car->car;
+    *val = (*pair)->car->cdr;
+    obj_set(root, obj, key, val);
+  }
+  return *obj;
+}
+
+// http://en.wikipedia.org/wiki/Jenkins_hash_function
+static uint32_t jenkins_hash(const char *key, size_t len) {
+  uint32_t hash = 0;
+  for (size_t i = 0; i < len; ++i) {
+    hash += key[i];
+    hash += (hash << 10);
+    hash ^= (hash >> 6);
+  }
+  hash += (hash << 3);
+  hash ^= (hash >> 11);
+  hash += (hash << 15);
+  return hash;
+}
+
+// Strings are immutable, so their hash is computed once and kept in the
+// object. A hash that happens to be 0 is simply recomputed every time.
+static uint32_t str_hash(Val *str) {
+  if (str->shash == 0)
+    str->shash = jenkins_hash(str_ptr(str), str->slen);
+  return str->shash;
+}
+
+static size_t obj_hash(Val *key) {
+  char buf[21];
+  uint32_t hash;
+  if (is_str(key)) {
+    hash = str_hash(key);
+  } else if (key->type == TSYM) {
+    hash = jenkins_hash(key->symv, strlen(key->symv));
+  } else if (key->type == TINT) {
+    hash = jenkins_hash(buf, sprintf(buf, "%" PRId64, key->intv));
+  } else if (key->type == TBIG) {
+    hash = jenkins_hash((char *)key->limbs, sizeof(uint32_t) * key->nlimbs);
+  } else {
+    error("obj_hash: key given is not sym, str, or int");
+  }
+  return hash % OBJ_HM_SIZE;
+}
+
+static bool obj_valid_key(Val *key) {
+  size_t t = key->type;
+  return t == TSYM || t == TSTR || t == TSLICE || t == TINT || t == TBIG;
+}
+
+static bool obj_key_eq(Val *a, Val *b) {
+  if (a->type == TSYM && b->type == TSYM) {
+    return a == b;
+  } else if (a->type == TINT && b->type == TINT) {
+    return a->intv == b->intv;
+  } else if (a->type == TFLOAT && b->type == TFLOAT) {
+    return a->floatv == b->floatv;
+  } else if (a->type == TBIG && b->type == TBIG) {
+    return a->sign == b->sign && a->nlimbs == b->nlimbs &&
+           memcmp(a->limbs, b->limbs, sizeof(uint32_t) * a->nlimbs) == 0;
+  } else if (is_str(a) && is_str(b)) {
+    if (a->slen != b->slen ||
+        (a->shash && b->shash && a->shash != b->shash))
+      return false;
+    return memcmp(str_ptr(a), str_ptr(b), a->slen) == 0;
+  } else {
+    return false;
+  }
+}
+
+// Gets the alist cell for k in obj (or NULL)
+// Take an already computed hash (used in obj_set)
+static Val *_obj_get(Val *obj, size_t h, Val *k) {
+  Val *list = obj->props[h];
+  for (Val *pair = list; pair != Nil; pair = pair->cdr) {
+    if (obj_key_eq(k, pair->car->car)) {
+      return pair->car;
+    }
+  }
+  return NULL;
+}
+
+// Gets the alist cell for k in obj (or NULL)
+static Val *obj_get(Val *obj, Val *k) {
+  return _obj_get(obj, obj_hash(k), k);
+}
+
+// Gets the alist cell for k in obj or any of it's prototypes
+static Val *obj_find(Val *obj, Val *k) {
+  size_t h = obj_hash(k);
+  for (Val *o = obj; o != Nil; o = o->proto) {
+    Val *v = _obj_get(o, h, k);
+    if (v != NULL) {
+      return v;
+    }
+  }
+  return NULL;
+}
+
+// Set object key to value
+static void obj_set(void *root, Val **obj, Val **key, Val **val) {
+  DEFINE2(root, list, pair);
+
+  size_t h = obj_hash(*key);
+  *pair = _obj_get(*obj, h, *key);
+  *list = (*obj)->props[h];
+
+  if (*pair == NULL) {
+    // Not found, insert
+    int saved_site = alloc_site;
+    alloc_site = obj_site();
+    *pair = cons(root, key, val);
+    *pair = cons(root, pair, list);
+    alloc_site = saved_site;
+    (*obj)->props[h] = *pair;
+    write_barrier(&(*obj)->props[h]);
+  } else {
+    // Found, set-cdr
+    (*pair)->cdr = *val;
+    write_barrier(&(*pair)->cdr);
+  }
+}
+
+// Remove a k/v from object
+static void obj_del(Val *obj, Val *k) {
+  size_t h = obj_hash(k);
+  Val **list = &obj->props[h];
+
+  for (Val **pair = list; (*pair) != Nil;) {
+    if (obj_key_eq(k, (*pair)->car->car)) {
+      *pair = (*pair)->cdr;
+      write_barrier(pair);
+    } else {
+      pair = &(*pair)->cdr;
+    }
+  }
+}
+
+// }}}
+
+static Val *make_weak_ref(void *root, Val **target) {
+  Val *r = alloc(root, TWEAK, sizeof(Val *));
+  r->target = *target;
+  registry_add(&weak_refs, &weak_nrefs, &weak_refs_cap, r);
+  return r;
+}
+
+static Val *make_weak_table(void *root) {
+  Val *r = alloc(root, TWTABLE, sizeof(size_t) + sizeof(Val *) * WTABLE_SIZE);
+  r->count = 0;
+  for (size_t i = 0; i < WTABLE_SIZE; i++)
+    r->buckets[i] = Nil;
+  registry_add(&weak_tables, &weak_ntables, &weak_tables_cap, r);
+  return r;
+}
+
+static Val *make_vbuf(void *root, size_t cap) {
+  Val *r = alloc(root, TVBUF, sizeof(size_t) + sizeof(Val *) * cap);
+  r->cap = cap;
+  for (size_t i = 0; i < cap; i++)
+    r->slots[i] = Nil;
+  return r;
+}
+
+// Makes an empty vector with room for cap elements.
+static Val *make_vec(void *root, size_t cap) {
+  DEFINE1(root, buf);
+  *buf = make_vbuf(root, cap > 0 ? cap : 4);
+  Val *r = alloc(root, TVEC, sizeof(Val *) + sizeof(size_t));
+  r->buf = *buf;
+  r->len = 0;
+  return r;
+}
+
+static Val *make_handle(void *root, int fd) {
+  Val *r = alloc(root, TRES, sizeof(int));
+  r->fd = fd;
+  registry_add(&handles, &nhandles, &handles_cap, r);
+  return r;
+}
+
+static Val *make_primitive(void *root, Primitive *fn) {
+  Val *r = alloc_at(root, TPRI, sizeof(Primitive *), SITE_PRIMITIVE);
+  r->priv = fn;
+  return r;
+}
+
+static Val *make_function(void *root, Val **env, int type, Val **params,
+                          Val **body) {
+  assert(type == TFUN || type == TMAC);
+  Val *r = alloc_at(root, type, sizeof(Val *) * 3, SITE_FUNCTION);
+  r->params = *params;
+  r->body = *body;
+  r->env = *env;
+  return r;
+}
+
+// }}}
+
+// {{{ util + pretty-print
+
+// May create a new symbol. If there's a symbol with the same name, it will not
+// create a new symbol but return the existing one.
+static Val *intern(void *root, char *name) {
+  for (Val *p = symbols; p != Nil; p = p->cdr)
+    if (strcmp(name, p->car->symv) == 0)
+      return p->car;
+  DEFINE1(root, sym);
+  *sym = make_symbol(root, name);
+  symbols = cons(root, sym, &symbols);
+  return *sym;
+}
+
+#define PP_MAX_LEN 16384
+// Prints d with the fewest digits that read back as the same double, keeping
+// a '.' or an exponent so that it reads back as a float too.
+static int float_str(char *buf, double d) {
+  if (isnan(d))
+    return sprintf(buf, "nan");
+  if (isinf(d))
+    return sprintf(buf, d < 0 ? "-inf" : "inf");
+  int len = 0;
+  for (int prec = 15; prec <= 17; prec++) {
+    len = sprintf(buf, "%.*g", prec, d);
+    if (strtod(buf, NULL) == d)
+      break;
+  }
+  if (!strpbrk(buf, ".e"))
+    len += sprintf(&buf[len], ".0");
+  return len;
+}
+
+// Appends s to the string of len bytes in *buf, which has room for *cap,
+// growing it as needed, and returns the new length. Lists and vectors are
+// printed this way since their elements have no bound on their total length.
+static size_t pr_put(char **buf, size_t *cap, size_t len, const char *s) {
+  size_t n = strlen(s);
+  if (len + n + 1 > *cap) {
+    *cap = *cap * 2 > len + n + 1 ? *cap * 2 : len + n + 1;
+    *buf = realloc(*buf, *cap);
+  }
+  memcpy(*buf + len, s, n + 1);
+  return len + n;
+}
+
+static char *pr_str(void *root, Val *obj) {
+
+  char *buf = malloc(sizeof(char) * PP_MAX_LEN);
+  bzero(buf, sizeof(char) * PP_MAX_LEN);
+  char *s;
+  Val *val;
+  size_t len = 0, cap = PP_MAX_LEN;
+
+  switch (obj->type) {
+  case TCELL:
+    len = pr_put(&buf, &cap, len, "(");
+    for (;;) {
+      s = pr_str(root, obj->car);
+      len = pr_put(&buf, &cap, len, s);
+      free(s);
+      if (obj->cdr == Nil)
+        break;
+      if (obj->cdr->type != TCELL) {
+        len = pr_put(&buf, &cap, len, " . ");
+        s = pr_str(root, obj->cdr);
+        len = pr_put(&buf, &cap, len, s);
+        free(s);
+        break;
+      }
+      len = pr_put(&buf, &cap, len, " ");
+      obj = obj->cdr;
+    }
+    pr_put(&buf, &cap, len, ")");
+    return buf;
+  case TVEC:
+    len = pr_put(&buf, &cap, len, "[");
+    for (size_t i = 0; i < obj->len; i++) {
+      if (i)
+        len = pr_put(&buf, &cap, len, " ");
+      s = pr_str(root, obj->buf->slots[i]);
+      len = pr_put(&buf, &cap, len, s);
+      free(s);
+    }
+    pr_put(&buf, &cap, len, "]");
+    return buf;
+  case TSTR:
+  case TSLICE:
+    len += sprintf(&buf[len], "\"");
+    len += u8_escape_len(&buf[len], PP_MAX_LEN - len, str_ptr(obj), obj->slen,
+                         '"');
+    len += sprintf(&buf[len], "\"");
+    return buf;
+  case TREGEX:
+    len += sprintf(&buf[len], "<regex \"");
+    len += u8_escape_len(&buf[len], PP_MAX_LEN - len - 2,
+                         str_ptr(obj->pattern), obj->pattern->slen, '"');
+    len += sprintf(&buf[len], "\">");
+    return buf;
+  case TOBJ:
+    val = obj_find(obj, intern(root, "*object-name*"));
+    if (val != NULL && is_str(val->cdr)) {
+      len += sprintf(&buf[len], "<object %.*s %p>", (int)val->cdr->slen,
+                     str_ptr(val->cdr), obj);
+    } else {
+      len += sprintf(&buf[len], "<object %s %p>", "nil", obj);
+    }
+    return buf;
+
+#define CASE(type, ...)                                                        \
+  case type:                                                                   \
+    len += sprintf(&buf[len], __VA_ARGS__);                                    \
+    return buf
+
+  case TFLOAT:
+    len += float_str(&buf[len], obj->floatv);
+    return buf;
+
+  case TBIG:
+    s = big_to_str(obj);
+    snprintf(buf, PP_MAX_LEN, "%s", s);
+    free(s);
+    return buf;
+
+    CASE(TINT, "%" PRId64, obj->intv);
+    CASE(TSYM, "%s", obj->symv);
+    CASE(TPRI, "<primitive>");
+    CASE(TFUN, "<function>");
+    CASE(TMAC, "<macro>");
+    CASE(TWEAK, "<weak-ref>");
+    CASE(TWTABLE, "<weak-table>");
+    CASE(TARRAY, "<array %s %zu>", array_kinds[obj->akind], obj->alen);
+    CASE(TBYTES, "<bytes %zu>", obj->blen);
+    CASE(TSB, "<sb %zu>", obj->len);
+    CASE(TJSON, "<json-parser>");
+    CASE(TRES, obj->fd >= 0 ? "<handle %d>" : "<handle closed>", obj->fd);
+    CASE(TMOVED, "<moved>");
+    CASE(TTRUE, "t");
+    CASE(TNIL, "()");
+
+#undef CASE
+
+  default:
+    // DEBUG
+    // len += sprintf(&buf[len], "<tag %d>", obj->type);
+    // return buf;
+    free(buf);
+    // TODO append obj->type
+    error("Bug: print: Unknown tag type");
+  }
+}
+
+int setnonblock(int fd) {
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  flags |= O_NONBLOCK;
+  return fcntl(fd, F_SETFL, flags);
+}
+
+// }}}
+
+// {{{ reader
+
+#define SYMBOL_MAX_LEN 200
+#define STRING_MAX_LEN 1000
+const char symbol_chars[] = "~!#$%^&*-_=+:/?<>";
+
+static bool valid_symbol_start_char(char c) {
+  return (isalpha(c) || strchr(symbol_chars, c)) && c != '\0';
+}
+
+static bool valid_symbol_char(char c) {
+  return (isalnum(c) || strchr(symbol_chars, c)) && c != '\0';
+}
+
+typedef struct Reader {
+  int pos;
+  int size;
+  char *input;
+} Reader;
+
+static Val *reader_expr(Reader *r, void *root);
+
+static Reader *reader_new(const char *input, size_t len) {
+  Reader *r = malloc(sizeof(Reader));
+  r->pos = -1;
+  r->size = len;
+  r->input = malloc(sizeof(char) * (r->size + 1));
+  memcpy(r->input, input, len);
+  r->input[len] = '\0';
+  return r;
+}
+
+static void reader_destroy(Reader *r) {
+  free(r->input);
+  free(r);
+}
+
+static int reader_peek(Reader *r) {
+  if ((r->pos + 1) == r->size) {
+    return EOF;
+  }
+  return r->input[r->pos + 1];
+}
+
+// Returns the character n positions ahead, reader_peek() being 1.
+static int reader_peek_at(Reader *r, int n) {
+  if (r->pos + n >= r->size) {
+    return EOF;
+  }
+  return r->input[r->pos + n];
+}
+
+static int reader_next(Reader *r) {
+  r->pos++;
+  if (r->pos == r->size) {
+    return EOF;
+  }
+  return r->input[r->pos];
+}
+
+// Skips the input until newline is found. Newline is one of \r, \r\n or \n.
+static void reader_skip_line(Reader *r) {
+  for (;;) {
+    int c = reader_next(r);
+    if (c == EOF || c == '\n') {
+      return;
+    }
+    if (c == '\r') {
+      if (reader_peek(r) == '\n') {
+        reader_next(r);
+      }
+      return;
+    }
+  }
+}
+
+// Reads a list. Note that '(' has already been read.
+static Val *reader_list(Reader *r, void *root) {
+  DEFINE3(root, obj, head, last);
+  *head = Nil;
+  *last = Nil;
+  for (;;) {
+    *obj = reader_expr(r, root);
+    if (!*obj)
+      error("Unclosed parenthesis");
+    if (*obj == Cparen)
+      return list_from_reversed(root, head, last);
+    if (*obj == Dot) {
+      *last = reader_expr(r, root);
+      if (reader_expr(r, root) != Cparen)
+        error("Closed parenthesis expected after dot");
+      return list_from_reversed(root, head, last);
+    }
+    *head = cons(root, obj, head);
+  }
+}
+
+// Reads an alist. Note that '{' has already been read.
+static Val *reader_alist(Reader *r, void *root) {
+  DEFINE6(root, obj, head, ahead, pair, list_sym, cons_sym);
+  *head = Nil;
+
+  for (;;) {
+    *obj = reader_expr(r, root);
+    if (!*obj)
+      error("Unclosed curly brace");
+    if (*obj == Dot)
+      error("Stray dot in alist");
+    if (*obj == Cparen)
+      error("Stray closing parent in alist");
+    if (*obj == Ccurly) {
+      if (length(*head) % 2 != 0) {
+        error("Alist contains un-even number of elements");
+      }
+      if (*head == Nil) {
+        return Nil;
+      }
+
+      *ahead = Nil;
+      *list_sym = intern(root, "list");
+      *cons_sym = intern(root, "cons");
+      do {
+        // Pop the two last items (value first as they are reversed)
+        *obj = (*head)->car;
+        *pair = cons(root, obj, &Nil);
+        *obj = (*head)->cdr->car;
+        *pair = cons(root, obj, pair);
+        *pair = cons(root, cons_sym, pair);
+        *head = (*head)->cdr->cdr;
+
+        *ahead = cons(root, pair, ahead);
+      } while (*head != Nil);
+      *ahead = reverse(*ahead);
+      return cons(root, list_sym, ahead);
+    }
+
+    *head = cons(root, obj, head);
+  }
+}
+
+// Reads a vector literal, [a b] -> (vec a b). Note that '[' has already been
+// read.
+static Val *reader_vector(Reader *r, void *root) {
+  DEFINE3(root, obj, head, tail);
+  *head = Nil;
+  for (;;) {
+    *obj = reader_expr(r, root);
+    if (!*obj)
+      error("Unclosed square bracket");
+    if (*obj == Dot || *obj == Cparen || *obj == Ccurly)
+      error("Stray token in vector");
+    if (*obj == Cbracket) {
+      *tail = intern(root, "vec");
+      *tail = cons(root, tail, &Nil);
+      *head = reverse(*head);
+      (*tail)->cdr = *head;
+      return *tail;
+    }
+    *head = cons(root, obj, head);
+  }
+}
+
+// 'def -> (quote def)
+// `(list a) -> (quasiquote (list a))
+// @b -> (unbox b)
+static Val *read_special(Reader *r, void *root, char *name) {
+  DEFINE2(root, sym, tmp);
+  *sym = intern(root, name);
+  *tmp = reader_expr(r, root);
+  *tmp = cons(root, tmp, &Nil);
+  *tmp = cons(root, sym, tmp);
+  return *tmp;
+}
+
+static Val *read_unquote(Reader *r, void *root) {
+  DEFINE2(root, sym, tmp);
+  if (reader_peek(r) == '@') {
+    reader_next(r);
+    *sym = intern(root, "unquote-splicing");
+  } else {
+    *sym = intern(root, "unquote");
+  }
+  *tmp = reader_expr(r, root);
+  *tmp = cons(root, tmp, &Nil);
+  *tmp = cons(root, sym, tmp);
+  return *tmp;
+}
+
+static void read_digits(Reader *r, char *buf, size_t *len) {
+  while (isdigit(reader_peek(r))) {
+    if (STRING_MAX_LEN <= *len)
+      error("Number too long");
+    buf[(*len)++] = reader_next(r);
+  }
+}
+
+// Reads a number literal starting with the digit c. Integers beyond the
+// int64_t range become bignums, and a fraction or exponent makes a float.
+static Val *read_number(Reader *r, void *root, int c, bool negative) {
+  char buf[STRING_MAX_LEN + 4];
+  size_t len = 0;
+  buf[len++] = c;
+  read_digits(r, buf, &len);
+
+  bool is_float = false;
+  if (reader_peek(r) == '.' && isdigit(reader_peek_at(r, 2))) {
+    is_float = true;
+    buf[len++] = reader_next(r);
+    read_digits(r, buf, &len);
+  }
+  int e = reader_peek(r), sign = reader_peek_at(r, 2);
+  if ((e == 'e' || e == 'E') &&
+      (isdigit(sign) ||
+       ((sign == '-' || sign == '+') && isdigit(reader_peek_at(r, 3))))) {
+    is_float = true;
+    buf[len++] = reader_next(r);
+    if (!isdigit(sign))
+      buf[len++] = reader_next(r);
+    read_digits(r, buf, &len);
+  }
+  if (is_float) {
+    buf[len] = '\0';
+    double d = strtod(buf, NULL);
+    return make_float(root, negative ? -d : d);
+  }
+
+  // 18 digits always fit
+  if (len <= 18) {
+    int64_t val = 0;
+    for (size_t i = 0; i < len; i++)
+      val = val * 10 + (buf[i] - '0');
+    return make_int(root, negative ? -val : val);
+  }
+  Big b = big_from_digits(buf, len, negative);
+  return make_big(root, &b);
+}
+
+static Val *read_string(Reader *r, void *root) {
+  char buf[STRING_MAX_LEN + 1];
+  int len = 0;
+  // A quote only ends the string if the backslashes before it are paired up
+  bool escaped = false;
+  while (reader_peek(r) != '"' || escaped) {
+    if (reader_peek(r) == EOF)
+      error("Unclosed string");
+    if (STRING_MAX_LEN <= len) {
+      error("String too long");
+    }
+    buf[len++] = reader_next(r);
+    escaped = !escaped && buf[len - 1] == '\\';
+  }
+  buf[len] = '\0';
+
+  // \x0 escapes unescape to NUL bytes, so keep the unescaped length
+  int buf_len = strlen(buf) + 1;
+  char unescaped_buf[buf_len];
+  int unescaped_len = u8_unescape(unescaped_buf, buf_len, buf);
+
+  // consume closing "
+  reader_next(r);
+
+  // create str
+  DEFINE1(root, tmp);
+  *tmp = make_str_len(root, unescaped_buf, unescaped_len);
+  return *tmp;
+}
+
+static Val *read_symbol(Reader *r, void *root, char c) {
+  char buf1[SYMBOL_MAX_LEN + 1];
+  char buf2[SYMBOL_MAX_LEN + 1];
+  bool found_colon = false;
+  int len = 1;
+  buf1[0] = c;
+
+  while (valid_symbol_char(reader_peek(r))) {
+    if (SYMBOL_MAX_LEN <= len) {
+      error("Symbol name too long");
+    }
+    if (!found_colon) {
+      // Normal case
+      buf1[len++] = reader_next(r);
+
+      // Found colon syntax, split up
+      if (buf1[len - 1] == ':') {
+        buf1[len - 1] = '\0';
+        len = 0;
+        found_colon = true;
+      }
+    } else {
+      // Building second part of object get syntax
+      buf2[len++] = reader_next(r);
+    }
+  }
+
+  if (found_colon && len > 0) {
+    buf2[len] = '\0';
+    DEFINE5(root, expr, quote_sym, colon_sym, obj_sym, prop_sym);
+    *quote_sym = intern(root, "quote");
+    *colon_sym = intern(root, ":");
+    *obj_sym = intern(root, buf1);
+    *prop_sym = intern(root, buf2);
+    *expr = cons(root, prop_sym, &Nil);
+    *expr = cons(root, quote_sym, expr);
+    *expr = cons(root, expr, &Nil);
+    *expr = cons(root, obj_sym, expr);
+    *expr = cons(root, colon_sym, expr);
+    return *expr;
+  }
+
+  buf1[len] = '\0';
+  return intern(root, buf1);
+}
+
+static Val *reader_expr(Reader *r, void *root) {
+  for (;;) {
+    int c = reader_next(r);
+    if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+      continue;
+    if (c == EOF)
+      return NULL;
+    if (c == ';' || (r->pos == 0 && c == '#')) {
+      reader_skip_line(r);
+      continue;
+    }
+    if (c == '(')
+      return reader_list(r, root);
+    if (c == ')')
+      return Cparen;
+    if (c == '{')
+      return reader_alist(r, root);
+    if (c == '}')
+      return Ccurly;
+    if (c == '[')
+      return reader_vector(r, root);
+    if (c == ']')
+      return Cbracket;
+    if (c == '.')
+      return Dot;
+    if (c == '@')
+      return read_special(r, root, "unbox");
+    if (c == '\'')
+      return read_special(r, root, "quote");
+    if (c == '`')
+      return read_special(r, root, "quasiquote");
+    if (c == ',') // handle ,@ too
+      return read_unquote(r, root);
+    if (c == '"')
+      return read_string(r, root);
+    if (isdigit(c))
+      return read_number(r, root, c, false);
+    if (c == '-' && isdigit(reader_peek(r)))
+      return read_number(r, root, reader_next(r), true);
+    if (valid_symbol_start_char(c))
+      return read_symbol(r, root, c);
+
+    // TODO cleanup
+    char *err_text = "Don't know how to handle ";
+    int err_text_len = strlen(err_text);
+    char err_buf[err_text_len + 2];
+    strncpy(err_buf, err_text, err_text_len);
+    err_buf[err_text_len] = c;
+    err_buf[err_text_len + 1] = '\0';
+    error(err_buf);
+  }
+}
+
+// Reads the next expression, attributing its objects to the reader site.
+static Val *read_expr(Reader *r, void *root) {
+  int saved_site = alloc_site;
+  alloc_site = SITE_READER;
+  Val *expr = reader_expr(r, root);
+  alloc_site = saved_site;
+  return expr;
+}
+
+// }}}
+
+// {{{ eval
+
+static Val *eval(void *root, Val **env, Val **obj);
+
+// Adds a variable to the current env level
+static void env_set(void *root, Val **env, Val **sym, Val **val) {
+  obj_set(root, env, sym, val);
+}
+
+// Searches for a variable by symbol. Returns null if not found.
+static Val *env_get(Val **env, Val *sym) {
+  return obj_find(*env, sym);
+}
+
+// Returns a newly created environment frame.
+static Val *push_env(void *root, Val **env, Val **vars, Val **vals) {
+  DEFINE3(root, map, sym, val);
+  int saved_site = alloc_site;
+  alloc_site = SITE_ENV;
+  *map = Nil;
+  if ((*vars)->type == TSYM) {
+    // (fn xs body ...)
+    *map = acons(root, vars, vals, map);
+  } else {
+    // (fn (x y) body ...)
+    for (; (*vars)->type == TCELL; *vars = (*vars)->cdr, *vals = (*vals)->cdr) {
+      if ((*vals)->type != TCELL)
+        error("Cannot apply function: number of argument does not match");
+      *sym = (*vars)->car;
+      *val = (*vals)->car;
+      *map = acons(root, sym, val, map);
+    }
+    if (*vars != Nil)
+      *map = acons(root, vars, vals, map);
+  }
+  Val *frame = make_obj_alist(root, env, map);
+  alloc_site = saved_site;
+  return frame;
+}
+
+// Evaluates the list elements from head and returns the last return value.
+static Val *progn(void *root, Val **env, Val **list) {
+  DEFINE2(root, lp, r);
+  *r = Nil;
+  for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+    *r = (*lp)->car;
+    *r = eval(root, env, r);
+  }
+  return *r;
+}
+
+// Longest argument list whose values eval_list() keeps on the C stack
+#define EVAL_LIST_MAX_ROOTS 256
+
+// Evaluates all the list elements and returns their return values as a new
+// contiguous list.
+static Val *eval_list(void *root, Val **env, Val **list) {
+  int n = length(*list);
+  if (n < 0)
+    error("Malformed argument list");
+  if (n == 0)
+    return Nil;
+
+  if (n > EVAL_LIST_MAX_ROOTS) {
+    DEFINE4(root, head, lp, expr, tail);
+    *head = Nil;
+    *tail = Nil;
+    for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+      *expr = (*lp)->car;
+      *expr = eval(root, env, expr);
+      *head = cons(root, expr, head);
+    }
+    return list_from_reversed(root, head, tail);
+  }
+
+  // Keep the values in the root frame until all of them are known, then
+  // allocate the cells in one go.
+  ADD_ROOT(root, n + 1);
+  Val **lp = (Val **)(root_ADD_ROOT_ + 1);
+  Val **vals = (Val **)(root_ADD_ROOT_ + 2);
+  *lp = *list;
+  for (int i = 0; i < n; i++, *lp = (*lp)->cdr) {
+    vals[i] = (*lp)->car;
+    vals[i] = eval(root, env, &vals[i]);
+  }
+  Val *ret = alloc_list(root, n);
+  Val *cell = ret;
+  for (int i = 0; i < n; i++, cell = cell->cdr)
+    cell->car = vals[i];
+  return ret;
+}
+
+#undef EVAL_LIST_MAX_ROOTS
+
+static bool is_list(Val *obj) { return obj == Nil || obj->type == TCELL; }
+
+static Val *apply_func(void *root, Val **env, Val **fn, Val **args) {
+  (void)env;
+  bool profiled = profiling;
+  if (profiled)
+    prof_enter(prof_entry(*fn));
+  DEFINE3(root, params, newenv, body);
+  *params = (*fn)->params;
+  *newenv = (*fn)->env;
+  *newenv = push_env(root, newenv, params, args);
+  *body = (*fn)->body;
+  *body = progn(root, newenv, body);
+  if (profiled && profiling)
+    prof_leave();
+  return *body;
+}
+
+// Apply fn with args.
+// Primitives evaluate their arguments themselves, so the values that
+// (apply prim list) hands them are replaced in *args by quoted forms, unless
+// they evaluate to themselves.
+static void quote_args(void *root, Val **args) {
+  Val *a = *args;
+  while (a != Nil && a->car->type != TSYM && a->car->type != TCELL)
+    a = a->cdr;
+  if (a == Nil)
+    return;
+
+  DEFINE4(root, quoted, rest, quote, x);
+  *quote = intern(root, "quote");
+  *quoted = Nil;
+  for (*rest = *args; *rest != Nil; *rest = (*rest)->cdr) {
+    *x = (*rest)->car;
+    if ((*x)->type == TSYM || (*x)->type == TCELL) {
+      *x = cons(root, x, &Nil);
+      *x = cons(root, quote, x);
+    }
+    *quoted = cons(root, x, quoted);
+  }
+  *args = reverse(*quoted);
+}
+
+static Val *apply(void *root, Val **env, Val **fn, Val **args, bool do_eval) {
+  if (!is_list(*args)) {
+    error("apply: argument must be a list");
+  }
+  if ((*fn)->type == TPRI) {
+    if (!do_eval)
+      quote_args(root, args);
+    if (!profiling)
+      return (*fn)->priv(root, env, args);
+    prof_enter(prof_entry(*fn));
+    Val *r = (*fn)->priv(root, env, args);
+    if (profiling)
+      prof_leave();
+    return r;
+  }
+  if ((*fn)->type == TFUN) {
+    // Register the entry under the caller's name before the arguments are
+    // evaluated, as that overwrites prof_call_name.
+    if (profiling)
+      prof_entry(*fn);
+    DEFINE1(root, eargs);
+    if (do_eval) {
+      *eargs = eval_list(root, env, args);
+    } else {
+      *eargs = *args;
+    }
+    return apply_func(root, env, fn, eargs);
+  }
+  error("apply: not supported");
+}
+
+// Expands the given macro application form.
+static Val *macroexpand(void *root, Val **env, Val **val) {
+  if ((*val)->type != TCELL ||
+      ((*val)->car->type != TSYM && (*val)->car->type != TMAC)) {
+    return *val;
+  }
+  DEFINE3(root, bind, macro, args);
+  if ((*val)->car->type == TMAC) {
+    *macro = (*val)->car;
+  } else {
+    *bind = env_get(env, (*val)->car);
+    if (!*bind || (*bind)->cdr->type != TMAC)
+      return *val;
+    *macro = (*bind)->cdr;
+    prof_call_name = (*val)->car;
+  }
+  *args = (*val)->cdr;
+  return apply_func(root, env, macro, args);
+}
+
+// Evaluates the S expression.
+static Val *eval(void *root, Val **env, Val **obj) {
+  switch ((*obj)->type) {
+  case TINT:
+  case TBIG:
+  case TFLOAT:
+  case TSTR:
+  case TSLICE:
+  case TOBJ:
+  case TPRI:
+  case TFUN:
+  case TMAC:
+  case TWEAK:
+  case TWTABLE:
+  case TRES:
+  case TVEC:
+  case TARRAY:
+  case TBYTES:
+  case TSB:
+  case TREGEX:
+  case TJSON:
+  case TTRUE:
+  case TNIL:
+    // Self-evaluating objects
+    return *obj;
+  case TSYM: {
+    // Variable
+    if (*obj == intern(root, "*env*")) {
+      return *env;
+    }
+    Val *bind = env_get(env, *obj);
+    if (bind == NULL) {
+      // TODO clean up string messing
+      char *err_text = "eval: undefined symbol: ";
+      char *err_val = (*obj)->symv;
+      int err_text_len = strlen(err_text);
+      int err_val_len = strlen(err_val);
+      char err_buf[err_text_len + err_val_len + 1];
+      strncpy(err_buf, err_text, err_text_len);
+      strncpy(&err_buf[err_text_len], err_val, err_val_len);
+      err_buf[err_text_len + err_val_len] = '\0';
+      error(err_buf);
+    }
+    return bind->cdr;
+  }
+  case TCELL: {
+    // Function application form
+    DEFINE3(root, fn, expanded, args);
+    *expanded = macroexpand(root, env, obj);
+    if (*expanded != *obj)
+      return eval(root, env, expanded);
+    *fn = (*obj)->car;
+    *fn = eval(root, env, fn);
+    *args = (*obj)->cdr;
+    if ((*fn)->type != TPRI && (*fn)->type != TFUN) {
+      error("The head of a list must be a function");
+    }
+    prof_call_name = (*obj)->car->type == TSYM ? (*obj)->car : NULL;
+    return apply(root, env, fn, args, true);
+  }
+  default:
+    // TODO append (*obj)->type
+    error("Bug: eval: Unknown tag type");
+  }
+}
+
+// }}}
+
+// {{{ array kernels
+
+// Bulk operations over the elements of typed arrays. Each kernel has a plain
+// C loop, and on x86-64 an AVX2 version picked at runtime when the CPU has
+// it. Integer element-wise results wrap around like machine integers, while
+// integer sums and dot products are exact.
+
+// Cleared when the CPU lacks AVX2 or by SHI_NO_SIMD
+static bool cpu_avx2 = false;
+
+#ifdef X86_SIMD
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static double f64_hsum_avx2(__m256d v) {
+  double t[4];
+  _mm256_storeu_pd(t, v);
+  return (t[0] + t[1]) + (t[2] + t[3]);
+}
+
+AVX2 static int64_t i64_hsum_avx2(__m256i v) {
+  int64_t t[4];
+  _mm256_storeu_si256((__m256i *)t, v);
+  return t[0] + t[1] + t[2] + t[3];
+}
+
+AVX2 static double f64_sum_avx2(const double *a, size_t n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+  }
+  double s = f64_hsum_avx2(_mm256_add_pd(s0, s1));
+  for (; i < n; i++)
+    s += a[i];
+  return s;
+}
+
+AVX2 static double f64_dot_avx2(const double *a, const double *b, size_t n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(
+        s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                         _mm256_loadu_pd(b + i + 4)));
+  }
+  double s = f64_hsum_avx2(_mm256_add_pd(s0, s1));
+  for (; i < n; i++)
+    s += a[i] * b[i];
+  return s;
+}
+
+AVX2 static void f64_minmax_avx2(const double *a, size_t n, double *min,
+                                 double *max) {
+  __m256d lo = _mm256_set1_pd(a[0]), hi = lo;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d v = _mm256_loadu_pd(a + i);
+    lo = _mm256_min_pd(lo, v);
+    hi = _mm256_max_pd(hi, v);
+  }
+  double l[4], h[4];
+  _mm256_storeu_pd(l, lo);
+  _mm256_storeu_pd(h, hi);
+  for (int k = 1; k < 4; k++) {
+    l[0] = l[k] < l[0] ? l[k] : l[0];
+    h[0] = h[k] > h[0] ? h[k] : h[0];
+  }
+  for (; i < n; i++) {
+    l[0] = a[i] < l[0] ? a[i] : l[0];
+    h[0] = a[i] > h[0] ? a[i] : h[0];
+  }
+  *min = l[0];
+  *max = h[0];
+}
+
+// r = a + b, or a * b when mul is set
+AVX2 static void f64_map2_avx2(double *r, const double *a, const double *b,
+                               size_t n, bool mul) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(a + i), y = _mm256_loadu_pd(b + i);
+    _mm256_storeu_pd(r + i, mul ? _mm256_mul_pd(x, y) : _mm256_add_pd(x, y));
+  }
+  for (; i < n; i++)
+    r[i] = mul ? a[i] * b[i] : a[i] + b[i];
+}
+
+AVX2 static int64_t i32_sum_avx2(const int32_t *a, size_t n) {
+  // Widened to 64-bit lanes, which can't overflow below 2^32 elements
+  __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_epi64(
+        s0, _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(a + i))));
+    s1 = _mm256_add_epi64(s1, _mm256_cvtepi32_epi64(_mm_loadu_si128(
+                                  (const __m128i *)(a + i + 4))));
+  }
+  int64_t s = i64_hsum_avx2(_mm256_add_epi64(s0, s1));
+  for (; i < n; i++)
+    s += a[i];
+  return s;
+}
+
+AVX2 static void i32_minmax_avx2(const int32_t *a, size_t n, int64_t *min,
+                                 int64_t *max) {
+  __m256i lo = _mm256_set1_epi32(a[0]), hi = lo;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+    lo = _mm256_min_epi32(lo, v);
+    hi = _mm256_max_epi32(hi, v);
+  }
+  int32_t l[8], h[8];
+  _mm256_storeu_si256((__m256i *)l, lo);
+  _mm256_storeu_si256((__m256i *)h, hi);
+  for (int k = 1; k < 8; k++) {
+    l[0] = l[k] < l[0] ? l[k] : l[0];
+    h[0] = h[k] > h[0] ? h[k] : h[0];
+  }
+  for (; i < n; i++) {
+    l[0] = a[i] < l[0] ? a[i] : l[0];
+    h[0] = a[i] > h[0] ? a[i] : h[0];
+  }
+  *min = l[0];
+  *max = h[0];
+}
+
+AVX2 static void i32_map2_avx2(int32_t *r, const int32_t *a, const int32_t *b,
+                               size_t n, bool mul) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(r + i), mul ? _mm256_mullo_epi32(x, y)
+                                                : _mm256_add_epi32(x, y));
+  }
+  for (; i < n; i++)
+    r[i] = mul ? (int32_t)((uint32_t)a[i] * (uint32_t)b[i])
+               : (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+}
+
+AVX2 static void i64_minmax_avx2(const int64_t *a, size_t n, int64_t *min,
+                                 int64_t *max) {
+  __m256i lo = _mm256_set1_epi64x(a[0]), hi = lo;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+    lo = _mm256_blendv_epi8(lo, v, _mm256_cmpgt_epi64(lo, v));
+    hi = _mm256_blendv_epi8(hi, v, _mm256_cmpgt_epi64(v, hi));
+  }
+  int64_t l[4], h[4];
+  _mm256_storeu_si256((__m256i *)l, lo);
+  _mm256_storeu_si256((__m256i *)h, hi);
+  for (int k = 1; k < 4; k++) {
+    l[0] = l[k] < l[0] ? l[k] : l[0];
+    h[0] = h[k] > h[0] ? h[k] : h[0];
+  }
+  for (; i < n; i++) {
+    l[0] = a[i] < l[0] ? a[i] : l[0];
+    h[0] = a[i] > h[0] ? a[i] : h[0];
+  }
+  *min = l[0];
+  *max = h[0];
+}
+
+AVX2 static void i64_add_avx2(int64_t *r, const int64_t *a, const int64_t *b,
+                              size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_si256(
+        (__m256i *)(r + i),
+        _mm256_add_epi64(_mm256_loadu_si256((const __m256i *)(a + i)),
+                         _mm256_loadu_si256((const __m256i *)(b + i))));
+  for (; i < n; i++)
+    r[i] = (int64_t)((uint64_t)a[i] + (uint64_t)b[i]);
+}
+#endif
+
+static double f64_sum(const double *a, size_t n) {
+#ifdef X86_SIMD
+  if (cpu_avx2)
+    return f64_sum_avx2(a, n);
+#endif
+  double s = 0;
+  for (size_t i = 0; i < n; i++)
+    s += a[i];
+  return s;
+}
+
+static double f64_dot(const double *a, const double *b, size_t n) {
+#ifdef X86_SIMD
+  if (cpu_avx2)
+    return f64_dot_avx2(a, b, n);
+#endif
+  double s = 0;
+  for (size_t i = 0; i < n; i++)
+    s += a[i] * b[i];
+  return s;
+}
+
+// n must not be 0
+static void f64_minmax(const double *a, size_t n, double *min, double *max) {
+#ifdef X86_SIMD
+  if (cpu_avx2) {
+    f64_minmax_avx2(a, n, min, max);
+    return;
+  }
+#endif
+  *min = *max = a[0];
+  for (size_t i = 1; i < n; i++) {
+    *min = a[i] < *min ? a[i] : *min;
+    *max = a[i] > *max ? a[i] : *max;
+  }
+}
+
+static void f64_map2(double *r, const double *a, const double *b, size_t n,
+                     bool mul) {
+#ifdef X86_SIMD
+  if (cpu_avx2) {
+    f64_map2_avx2(r, a, b, n, mul);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++)
+    r[i] = mul ? a[i] * b[i] : a[i] + b[i];
+}
+
+static int64_t i32_sum(const int32_t *a, size_t n) {
+#ifdef X86_SIMD
+  if (cpu_avx2)
+    return i32_sum_avx2(a, n);
+#endif
+  int64_t s = 0;
+  for (size_t i = 0; i < n; i++)
+    s += a[i];
+  return s;
+}
+
+static void i32_minmax(const int32_t *a, size_t n, int64_t *min,
+                       int64_t *max) {
+#ifdef X86_SIMD
+  if (cpu_avx2) {
+    i32_minmax_avx2(a, n, min, max);
+    return;
+  }
+#endif
+  *min = *max = a[0];
+  for (size_t i = 1; i < n; i++) {
+    *min = a[i] < *min ? a[i] : *min;
+    *max = a[i] > *max ? a[i] : *max;
+  }
+}
+
+static void i32_map2(int32_t *r, const int32_t *a, const int32_t *b, size_t n,
+                     bool mul) {
+#ifdef X86_SIMD
+  if (cpu_avx2) {
+    i32_map2_avx2(r, a, b, n, mul);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++)
+    r[i] = mul ? (int32_t)((uint32_t)a[i] * (uint32_t)b[i])
+               : (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+}
+
+static void i64_minmax(const int64_t *a, size_t n, int64_t *min,
+                       int64_t *max) {
+#ifdef X86_SIMD
+  if (cpu_avx2) {
+    i64_minmax_avx2(a, n, min, max);
+    return;
+  }
+#endif
+  *min = *max = a[0];
+  for (size_t i = 1; i < n; i++) {
+    *min = a[i] < *min ? a[i] : *min;
+    *max = a[i] > *max ? a[i] : *max;
+  }
+}
+
+static void i64_map2(int64_t *r, const int64_t *a, const int64_t *b, size_t n,
+                     bool mul) {
+#ifdef X86_SIMD
+  // AVX2 has no 64-bit multiply
+  if (cpu_avx2 && !mul) {
+    i64_add_avx2(r, a, b, n);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++)
+    r[i] = mul ? (int64_t)((uint64_t)a[i] * (uint64_t)b[i])
+               : (int64_t)((uint64_t)a[i] + (uint64_t)b[i]);
+}
+
+// }}}
+
+// {{{ string kernels
+
+// Substring search over string bytes. Single bytes go to memchr. Longer
+// needles are found by comparing the first and last needle bytes against 16
+// (SSE2) or 32 (AVX2) candidate positions at once and only checking the rest
+// of the needle where both match, with a plain memchr loop as the fallback.
+
+// Cleared by SHI_NO_SIMD. SSE2 is always there on x86-64.
+static bool cpu_sse2 = false;
+
+static ptrdiff_t find_scalar(const char *h, size_t hn, const char *n,
+                             size_t nn) {
+  const char *p = h, *end = h + hn;
+  while ((size_t)(end - p) >= nn) {
+    p = memchr(p, n[0], end - p - nn + 1);
+    if (p == NULL)
+      break;
+    if (memcmp(p, n, nn) == 0)
+      return p - h;
+    p++;
+  }
+  return -1;
+}
+
+#ifdef X86_SIMD
+// Checks the candidates in mask, which start at h + i, against the needle.
+static ptrdiff_t find_check(const char *h, size_t i, uint32_t mask,
+                            const char *n, size_t nn) {
+  while (mask) {
+    size_t at = i + __builtin_ctz(mask);
+    if (memcmp(h + at + 1, n + 1, nn - 2) == 0)
+      return at;
+    mask &= mask - 1;
+  }
+  return -1;
+}
+
+static ptrdiff_t find_sse2(const char *h, size_t hn, const char *n,
+                           size_t nn) {
+  __m128i first = _mm_set1_epi8(n[0]), last = _mm_set1_epi8(n[nn - 1]);
+  size_t i = 0;
+  for (; i + nn - 1 + 16 <= hn; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(h + i + nn - 1));
+    uint32_t mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    ptrdiff_t at = find_check(h, i, mask, n, nn);
+    if (at >= 0)
+      return at;
+  }
+  ptrdiff_t at = find_scalar(h + i, hn - i, n, nn);
+  return at < 0 ? -1 : (ptrdiff_t)i + at;
+}
+
+AVX2 static ptrdiff_t find_avx2(const char *h, size_t hn, const char *n,
+                                size_t nn) {
+  __m256i first = _mm256_set1_epi8(n[0]), last = _mm256_set1_epi8(n[nn - 1]);
+  size_t i = 0;
+  for (; i + nn - 1 + 32 <= hn; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(h + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(h + i + nn - 1));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    ptrdiff_t at = find_check(h, i, mask, n, nn);
+    if (at >= 0)
+      return at;
+  }
+  ptrdiff_t at = find_scalar(h + i, hn - i, n, nn);
+  return at < 0 ? -1 : (ptrdiff_t)i + at;
+}
+#endif
+
+// Returns the offset of the first occurrence of needle in hay, or -1.
+static ptrdiff_t str_find(const char *hay, size_t hlen, const char *needle,
+                          size_t nlen) {
+  if (nlen == 0)
+    return 0;
+  if (nlen > hlen)
+    return -1;
+  if (nlen == 1) {
+    const char *p = memchr(hay, needle[0], hlen);
+    return p ? p - hay : -1;
+  }
+#ifdef X86_SIMD
+  if (cpu_avx2)
+    return find_avx2(hay, hlen, needle, nlen);
+  if (cpu_sse2)
+    return find_sse2(hay, hlen, needle, nlen);
+#endif
+  return find_scalar(hay, hlen, needle, nlen);
+}
+
+// UTF-8. Strings are bytes, and the character primitives read them as UTF-8,
+// where a character is a valid sequence or, in invalid text, the longest
+// prefix of one that utf8_decode replaces. Runs of ASCII are skipped 16 or
+// 32 bytes at a time.
+
+static size_t ascii_len_scalar(const char *p, size_t n) {
+  size_t i = 0;
+  while (i < n && (unsigned char)p[i] < 0x80)
+    i++;
+  return i;
+}
+
+#ifdef X86_SIMD
+static size_t ascii_len_sse2(const char *p, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    int m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  return i + ascii_len_scalar(p + i, n - i);
+}
+
+AVX2 static size_t ascii_len_avx2(const char *p, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    uint32_t m = _mm256_movemask_epi8(
+        _mm256_loadu_si256((const __m256i *)(p + i)));
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  return i + ascii_len_scalar(p + i, n - i);
+}
+#endif
+
+// Returns the number of leading bytes below 0x80 in the n bytes at p.
+static size_t ascii_len(const char *p, size_t n) {
+#ifdef X86_SIMD
+  if (cpu_avx2)
+    return ascii_len_avx2(p, n);
+  if (cpu_sse2)
+    return ascii_len_sse2(p, n);
+#endif
+  return ascii_len_scalar(p, n);
+}
+
+// Decodes the character at s, which has n > 0 bytes left, into *cp and
+// returns its length. When s does not start a valid shortest form sequence
+// of a scalar value, returns minus the length of the longest prefix of one
+// (at least 1), which counts as a single replaced character like in most
+// decoders.
+static int utf8_decode(const char *s, size_t n, uint32_t *cp) {
+  const unsigned char *p = (const unsigned char *)s;
+  uint32_t c = p[0];
+  // Allowed range of the second byte
+  unsigned char lo = 0x80, hi = 0xBF;
+  int len;
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  } else if (c >= 0xC2 && c <= 0xDF) {
+    len = 2;
+    c &= 0x1F;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    // No overlong forms, no surrogates
+    len = 3;
+    c &= 0x0F;
+    lo = c == 0x0 ? 0xA0 : 0x80;
+    hi = c == 0xD ? 0x9F : 0xBF;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    // No overlong forms, nothing above U+10FFFF
+    len = 4;
+    c &= 0x07;
+    lo = c == 0 ? 0x90 : 0x80;
+    hi = c == 4 ? 0x8F : 0xBF;
+  } else {
+    return -1;
+  }
+  for (int i = 1; i < len; i++) {
+    if ((size_t)i >= n || p[i] < (i == 1 ? lo : 0x80) ||
+        p[i] > (i == 1 ? hi : 0xBF))
+      return -i;
+    c = (c << 6) | (p[i] & 0x3F);
+  }
+  *cp = c;
+  return len;
+}
+
+static bool utf8_valid(const char *p, size_t n) {
+  uint32_t cp;
+  for (size_t i = 0; i < n;) {
+    i += ascii_len(p + i, n - i);
+    if (i == n)
+      break;
+    int len = utf8_decode(p + i, n - i, &cp);
+    if (len < 0)
+      return false;
+    i += len;
+  }
+  return true;
+}
+
+// Returns the length of the character at p, which has n > 0 bytes left.
+static size_t utf8_char_len(const char *p, size_t n) {
+  uint32_t cp;
+  int len = utf8_decode(p, n, &cp);
+  return len < 0 ? -len : len;
+}
+
+// Returns the number of characters in the n bytes at p.
+static size_t utf8_count(const char *p, size_t n) {
+  size_t c = 0;
+  for (size_t i = 0; i < n; c++) {
+    size_t a = ascii_len(p + i, n - i);
+    i += a;
+    c += a;
+    if (i == n)
+      break;
+    i += utf8_char_len(p + i, n - i);
+  }
+  return c;
+}
+
+// Long strings get an index of the byte offset of every CHAR_INDEX_STEP-th
+// character, so that indexing them by character scans at most that many
+// characters instead of the whole string. Indexes are cached by object
+// address in a few slots and dropped whenever objects move or region memory
+// is reused.
+#define CHAR_INDEX_MIN 256
+#define CHAR_INDEX_STEP 64
+#define CHAR_INDEX_SLOTS 16
+
+typedef struct CharIndex {
+  Val *str;
+  size_t nchars;
+  uint32_t *offsets;
+} CharIndex;
+
+static CharIndex char_indexes[CHAR_INDEX_SLOTS];
+
+static void char_index_clear(void) {
+  for (size_t i = 0; i < CHAR_INDEX_SLOTS; i++) {
+    free(char_indexes[i].offsets);
+    char_indexes[i] = (CharIndex){NULL, 0, NULL};
+  }
+}
+
+static CharIndex *char_index(Val *str) {
+  CharIndex *ix = &char_indexes[((uintptr_t)str >> 3) % CHAR_INDEX_SLOTS];
+  if (ix->str == str)
+    return ix;
+  const char *p = str_ptr(str);
+  size_t n = str->slen, c = 0;
+  free(ix->offsets);
+  ix->str = str;
+  ix->offsets = malloc(sizeof(uint32_t) * (n / CHAR_INDEX_STEP + 1));
+  for (size_t i = 0; i < n; i += utf8_char_len(p + i, n - i)) {
+    if (c % CHAR_INDEX_STEP == 0)
+      ix->offsets[c / CHAR_INDEX_STEP] = i;
+    c++;
+  }
+  ix->nchars = c;
+  return ix;
+}
+
+// Returns the number of characters of a string or slice.
+static size_t str_char_len(Val *str) {
+  if (str->slen >= CHAR_INDEX_MIN)
+    return char_index(str)->nchars;
+  return utf8_count(str_ptr(str), str->slen);
+}
+
+// Returns the byte offset of character i of str, the length of str when i is
+// its number of characters, or -1 past that.
+static ptrdiff_t str_char_offset(Val *str, size_t i) {
+  const char *p = str_ptr(str);
+  size_t n = str->slen, at, c;
+  if (n >= CHAR_INDEX_MIN) {
+    CharIndex *ix = char_index(str);
+    if (i > ix->nchars)
+      return -1;
+    if (i == ix->nchars)
+      return n;
+    if (ix->nchars == n)
+      return i;
+    at = ix->offsets[i / CHAR_INDEX_STEP];
+    c = i / CHAR_INDEX_STEP * CHAR_INDEX_STEP;
+  } else {
+    at = c = ascii_len(p, n);
+    if (i <= at)
+      return i;
+  }
+  for (; at < n; at += utf8_char_len(p + at, n - at)) {
+    if (c == i)
+      return at;
+    c++;
+  }
+  return c == i ? (ptrdiff_t)n : -1;
+}
+
+// Simple case mappings for ASCII, Latin-1, Latin Extended-A, Greek and
+// Cyrillic. Other characters map to themselves.
+static uint32_t char_upcase(uint32_t c) {
+  if (c < 0x80)
+    return c >= 'a' && c <= 'z' ? c - 32 : c;
+  if (c >= 0xE0 && c <= 0xFE && c != 0xF7)
+    return c - 32;
+  if (c == 0xFF)
+    return 0x178;
+  if (c == 0x131)
+    return 'I';
+  if (c == 0x17F)
+    return 'S';
+  if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+    return c % 2 == 0 ? c - 1 : c;
+  if ((c >= 0x100 && c <= 0x137) || (c >= 0x14A && c <= 0x177))
+    return c % 2 == 1 ? c - 1 : c;
+  if (c >= 0x3B1 && c <= 0x3C9)
+    return c == 0x3C2 ? 0x3A3 : c - 32;
+  if (c >= 0x430 && c <= 0x44F)
+    return c - 32;
+  if (c >= 0x450 && c <= 0x45F)
+    return c - 80;
+  return c;
+}
+
+static uint32_t char_downcase(uint32_t c) {
+  if (c < 0x80)
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+  if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+    return c + 32;
+  if (c == 0x178)
+    return 0xFF;
+  if (c == 0x130)
+    return 'i';
+  if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+    return c % 2 == 1 ? c + 1 : c;
+  if ((c >= 0x100 && c <= 0x137) || (c >= 0x14A && c <= 0x177))
+    return c % 2 == 0 ? c + 1 : c;
+  if (c >= 0x391 && c <= 0x3A9 && c != 0x3A2)
+    return c + 32;
+  if (c >= 0x410 && c <= 0x42F)
+    return c + 32;
+  if (c >= 0x400 && c <= 0x40F)
+    return c + 80;
+  return c;
+}
+
+// }}}
+
+// {{{ regex
+
+// Regular expressions are parsed into a tree, compiled to a Thompson NFA
+// program and run as a DFA built lazily from it, so matching takes linear
+// time whatever the pattern. The forward DFA finds where the leftmost match
+// ends, a DFA of the reversed program run back from there finds where it
+// starts, and the groups are only placed, by simulating the NFA over the
+// match, when they are asked for. Programs match bytes: UTF-8 characters in
+// literals and classes are compiled to byte sequences.
+//
+// Supported: literals, ., [...] and [^...] with ranges, \d \w \s \D \W \S,
+// ^ and $ (start and end of the string), (...), (?:...), | and the greedy
+// and lazy quantifiers * + ? {n} {n,} {n,m}. As in other automaton based
+// engines, a loop never takes an iteration that matches nothing, which can
+// leave a group in it unset where backtracking engines set it to "".
+
+#define RE_MAX_INSTS 20000
+#define RE_MAX_GROUPS 100
+#define RE_MAX_DEPTH 200
+#define RE_MAX_REPEAT 1000
+// Memory the DFA states of a program may take before they are all dropped
+#define RE_DFA_MEM (1 << 20)
+#define RE_DFA_BUCKETS 1024
+#define RE_PREFIX_MAX 64
+// Compiled programs kept, by pattern
+#define RE_CACHE_SLOTS 64
+
+// instructions
+enum { RE_BYTES, RE_SPLIT, RE_JMP, RE_SAVE, RE_BEGIN, RE_END, RE_MATCH };
+
+typedef struct {
+  int op;
+  // RE_SPLIT: preferred target x, other target y. RE_JMP: target x.
+  // RE_SAVE: capture slot x.
+  int x, y;
+  // RE_BYTES: the bytes matched
+  uint64_t set[4];
+} ReInst;
+
+// DFA state flags: at the start of the input, and still starting new matches
+#define RS_BEGIN 1
+#define RS_RESTART 2
+
+typedef struct ReState {
+  struct ReState *chain;
+  uint32_t hash;
+  int flags;
+  // Whether a match ends here, a match ends here if this is the end of the
+  // input, and no match can be reached anymore
+  bool match, end_match, dead;
+  // Threads as program counters of RE_BYTES, RE_END and RE_MATCH, by priority
+  int n;
+  int *pcs;
+  // Next state by byte class, NULL until computed
+  struct ReState *next[];
+} ReState;
+
+typedef struct {
+  ReInst *insts;
+  int n, cap;
+  // The reversed program is run anchored for the longest match, the forward
+  // one unanchored for the leftmost-first match
+  bool reverse;
+  // Bytes that no instruction tells apart share a class
+  uint8_t classes[256];
+  int nclasses;
+  ReState *buckets[RE_DFA_BUCKETS];
+  ReState *starts[2];
+  size_t mem;
+  unsigned flushes;
+  // Scratch space: visited marks, stack and threads of the state being built
+  int *seen, gen, *stack, *pcs;
+} ReProg;
+
+typedef struct {
+  char *src;
+  size_t srclen;
+  int ngroups;
+  ReProg fwd, rev;
+  // Literal every match starts with
+  char prefix[RE_PREFIX_MAX];
+  size_t prefixlen;
+  // Scratch space of re_captures, allocated on first use
+  ptrdiff_t *pike;
+} Regex;
+
+enum {
+  RN_EMPTY,
+  RN_BYTES,
+  RN_CAT,
+  RN_ALT,
+  RN_REP,
+  RN_GROUP,
+  RN_BEGIN,
+  RN_END
+};
+
+typedef struct ReNode {
+  int kind;
+  // RN_REP: bounds, max -1 for none, and whether more repetitions are
+  // preferred
+  int min, max;
+  bool greedy;
+  // RN_GROUP: capture index
+  int group;
+  uint64_t set[4];
+  // Children linked by next, and all the nodes linked by all
+  struct ReNode *kids, *next, *all;
+} ReNode;
+
+typedef struct {
+  const unsigned char *p, *end;
+  int ngroups, depth;
+  ReNode *nodes;
+  // Code point ranges of the class being parsed, as lo, hi pairs
+  uint32_t *ranges;
+  int nranges, rcap;
+  Regex *re;
+  ReProg *prog;
+  const char *err;
+  jmp_buf jmp;
+} ReCompiler;
+
+static __attribute((noreturn)) void re_fail(ReCompiler *c, const char *msg) {
+  c->err = msg;
+  longjmp(c->jmp, 1);
+}
+
+static void *re_alloc(ReCompiler *c, size_t size) {
+  void *p = calloc(1, size);
+  if (p == NULL)
+    re_fail(c, "out of memory");
+  return p;
+}
+
+static ReNode *re_node(ReCompiler *c, int kind, ReNode *kids) {
+  ReNode *n = re_alloc(c, sizeof(ReNode));
+  n->kind = kind;
+  n->kids = kids;
+  n->all = c->nodes;
+  c->nodes = n;
+  return n;
+}
+
+static ReNode *re_range_node(ReCompiler *c, int lo, int hi) {
+  ReNode *n = re_node(c, RN_BYTES, NULL);
+  for (int b = lo; b <= hi; b++)
+    n->set[b >> 6] |= 1ULL << (b & 63);
+  return n;
+}
+
+// Makes the sequence of the UTF-8 bytes of code point cp.
+static ReNode *re_char_node(ReCompiler *c, uint32_t cp) {
+  char buf[4];
+  int n = u8_wc_toutf8(buf, cp);
+  if (n == 1)
+    return re_range_node(c, (unsigned char)buf[0], (unsigned char)buf[0]);
+  ReNode *kids = NULL, **tail = &kids;
+  for (int i = 0; i < n; i++) {
+    *tail = re_range_node(c, (unsigned char)buf[i], (unsigned char)buf[i]);
+    tail = &(*tail)->next;
+  }
+  return re_node(c, RN_CAT, kids);
+}
+
+static void re_add_range(ReCompiler *c, uint32_t lo, uint32_t hi) {
+  if (c->nranges * 2 == c->rcap) {
+    c->rcap = c->rcap ? c->rcap * 2 : 16;
+    uint32_t *r = realloc(c->ranges, c->rcap * sizeof(uint32_t));
+    if (r == NULL)
+      re_fail(c, "out of memory");
+    c->ranges = r;
+  }
+  c->ranges[c->nranges * 2] = lo;
+  c->ranges[c->nranges * 2 + 1] = hi;
+  c->nranges++;
+}
+
+// Adds the ranges in r, or all the code points outside them.
+static void re_add_ranges(ReCompiler *c, const uint32_t *r, int n,
+                          bool negate) {
+  uint32_t next = 0;
+  for (int i = 0; i < n; i++) {
+    if (!negate)
+      re_add_range(c, r[i * 2], r[i * 2 + 1]);
+    else if (r[i * 2] > next)
+      re_add_range(c, next, r[i * 2] - 1);
+    next = r[i * 2 + 1] + 1;
+  }
+  if (negate)
+    re_add_range(c, next, 0x10FFFF);
+}
+
+static int re_range_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Adds the alternatives matching the UTF-8 encodings of the code points in
+// [lo, hi], which are all at least 0x80, splitting the range until each
+// byte of the encodings is a range of its own.
+static void re_utf8_range(ReCompiler *c, uint32_t lo, uint32_t hi,
+                          ReNode ***tail) {
+  static const uint32_t len_max[] = {0x7FF, 0xFFFF};
+  for (int i = 0; i < 2; i++) {
+    if (lo <= len_max[i] && hi > len_max[i]) {
+      re_utf8_range(c, lo, len_max[i], tail);
+      re_utf8_range(c, len_max[i] + 1, hi, tail);
+      return;
+    }
+  }
+  for (int i = 1; i < 4; i++) {
+    uint32_t m = (1u << (6 * i)) - 1;
+    if ((lo & ~m) == (hi & ~m))
+      continue;
+    if ((lo & m) != 0) {
+      re_utf8_range(c, lo, lo | m, tail);
+      re_utf8_range(c, (lo | m) + 1, hi, tail);
+      return;
+    }
+    if ((hi & m) != m) {
+      re_utf8_range(c, lo, (hi & ~m) - 1, tail);
+      re_utf8_range(c, hi & ~m, hi, tail);
+      return;
+    }
+  }
+  char a[4], b[4];
+  int n = u8_wc_toutf8(a, lo);
+  u8_wc_toutf8(b, hi);
+  ReNode *kids = NULL, **t = &kids;
+  for (int i = 0; i < n; i++) {
+    *t = re_range_node(c, (unsigned char)a[i], (unsigned char)b[i]);
+    t = &(*t)->next;
+  }
+  **tail = re_node(c, RN_CAT, kids);
+  *tail = &(**tail)->next;
+}
+
+// Makes the node matching a character in the ranges collected in c, or
+// outside them when negate is set.
+static ReNode *re_class_node(ReCompiler *c, bool negate) {
+  // Sort and merge, then take the complement if needed
+  qsort(c->ranges, c->nranges, 2 * sizeof(uint32_t), re_range_cmp);
+  int n = 0;
+  for (int i = 0; i < c->nranges; i++) {
+    uint32_t lo = c->ranges[i * 2], hi = c->ranges[i * 2 + 1];
+    if (n > 0 && lo <= c->ranges[n * 2 - 1] + 1) {
+      if (hi > c->ranges[n * 2 - 1])
+        c->ranges[n * 2 - 1] = hi;
+    } else {
+      c->ranges[n * 2] = lo;
+      c->ranges[n * 2 + 1] = hi;
+      n++;
+    }
+  }
+  c->nranges = 0;
+  if (negate) {
+    uint32_t r[n * 2 + 1];
+    memcpy(r, c->ranges, n * 2 * sizeof(uint32_t));
+    re_add_ranges(c, r, n, true);
+  } else {
+    c->nranges = n;
+  }
+
+  ReNode *ascii = re_node(c, RN_BYTES, NULL), **tail = &ascii->next;
+  static const uint32_t surrogates[] = {0xD800, 0xDFFF};
+  for (int i = 0; i < c->nranges; i++) {
+    uint32_t lo = c->ranges[i * 2], hi = c->ranges[i * 2 + 1];
+    for (; lo <= hi && lo < 0x80; lo++)
+      ascii->set[lo >> 6] |= 1ULL << (lo & 63);
+    if (lo > hi)
+      continue;
+    if (lo < surrogates[0] && hi > surrogates[1]) {
+      re_utf8_range(c, lo, surrogates[0] - 1, &tail);
+      re_utf8_range(c, surrogates[1] + 1, hi, &tail);
+    } else if (lo >= surrogates[0] && hi <= surrogates[1]) {
+      continue;
+    } else if (lo >= surrogates[0] && lo <= surrogates[1]) {
+      re_utf8_range(c, surrogates[1] + 1, hi, &tail);
+    } else if (hi >= surrogates[0] && hi <= surrogates[1]) {
+      re_utf8_range(c, lo, surrogates[0] - 1, &tail);
+    } else {
+      re_utf8_range(c, lo, hi, &tail);
+    }
+  }
+  return ascii->next == NULL ? ascii : re_node(c, RN_ALT, ascii);
+}
+
+// Reads a character of the pattern, which has to be valid UTF-8 in classes.
+static uint32_t re_char(ReCompiler *c, bool strict) {
+  uint32_t cp;
+  int n = utf8_decode((const char *)c->p, c->end - c->p, &cp);
+  if (n < 0) {
+    if (strict)
+      re_fail(c, "invalid UTF-8 in class");
+    cp = *c->p;
+    n = 1;
+  }
+  c->p += n;
+  return cp;
+}
+
+// Reads the escape after a backslash. Class escapes add their ranges to the
+// class being built and return true, others are stored in *cp.
+static bool re_parse_escape(ReCompiler *c, uint32_t *cp) {
+  static const uint32_t digit[] = {'0', '9'};
+  static const uint32_t word[] = {'0', '9', 'A', 'Z', '_', '_', 'a', 'z'};
+  static const uint32_t space[] = {'\t', '\r', ' ', ' '};
+  if (c->p == c->end)
+    re_fail(c, "trailing \\");
+  unsigned char ch = *c->p;
+  switch (ch) {
+  case 'd':
+  case 'D':
+    c->p++;
+    re_add_ranges(c, digit, 1, ch == 'D');
+    return true;
+  case 'w':
+  case 'W':
+    c->p++;
+    re_add_ranges(c, word, 4, ch == 'W');
+    return true;
+  case 's':
+  case 'S':
+    c->p++;
+    re_add_ranges(c, space, 2, ch == 'S');
+    return true;
+  case 'n':
+    *cp = '\n';
+    break;
+  case 't':
+    *cp = '\t';
+    break;
+  case 'r':
+    *cp = '\r';
+    break;
+  case 'f':
+    *cp = '\f';
+    break;
+  case 'v':
+    *cp = '\v';
+    break;
+  case '0':
+    *cp = 0;
+    break;
+  case 'x':
+    if (c->end - c->p < 3 || !isxdigit(c->p[1]) || !isxdigit(c->p[2]))
+      re_fail(c, "bad \\x escape");
+    *cp = strtol((char[]){c->p[1], c->p[2], 0}, NULL, 16);
+    c->p += 3;
+    return false;
+  default:
+    if (isalnum(ch))
+      re_fail(c, "unsupported escape");
+    *cp = re_char(c, false);
+    return false;
+  }
+  c->p++;
+  return false;
+}
+
+// [...] after the opening bracket
+static ReNode *re_parse_class(ReCompiler *c) {
+  c->nranges = 0;
+  bool negate = c->p < c->end && *c->p == '^';
+  if (negate)
+    c->p++;
+  for (bool first = true;; first = false) {
+    if (c->p == c->end)
+      re_fail(c, "missing ]");
+    if (*c->p == ']' && !first) {
+      c->p++;
+      break;
+    }
+    uint32_t lo, hi;
+    if (*c->p == '\\') {
+      c->p++;
+      if (re_parse_escape(c, &lo))
+        continue;
+    } else {
+      lo = re_char(c, true);
+    }
+    hi = lo;
+    if (c->end - c->p >= 2 && c->p[0] == '-' && c->p[1] != ']') {
+      c->p++;
+      if (*c->p == '\\') {
+        c->p++;
+        if (re_parse_escape(c, &hi))
+          re_fail(c, "bad class range");
+      } else {
+        hi = re_char(c, true);
+      }
+      if (hi < lo)
+        re_fail(c, "bad class range");
+    }
+    re_add_range(c, lo, hi);
+  }
+  return re_class_node(c, negate);
+}
+
+// Reads {n}, {n,} or {n,m}, or leaves the pattern as it is and returns false
+// if there is no such thing.
+static bool re_parse_bounds(ReCompiler *c, int *min, int *max) {
+  const unsigned char *p = c->p + 1;
+  long n = 0, m;
+  if (p == c->end || !isdigit(*p))
+    return false;
+  while (p < c->end && isdigit(*p) && n <= RE_MAX_REPEAT)
+    n = n * 10 + (*p++ - '0');
+  m = n;
+  if (p < c->end && *p == ',') {
+    p++;
+    m = -1;
+    if (p < c->end && isdigit(*p)) {
+      m = 0;
+      while (p < c->end && isdigit(*p) && m <= RE_MAX_REPEAT)
+        m = m * 10 + (*p++ - '0');
+    }
+  }
+  if (p == c->end || *p != '}')
+    return false;
+  if (n > RE_MAX_REPEAT || m > RE_MAX_REPEAT || (m >= 0 && m < n))
+    re_fail(c, "bad repetition count");
+  c->p = p + 1;
+  *min = n;
+  *max = m;
+  return true;
+}
+
+static ReNode *re_parse_alt(ReCompiler *c);
+
+static ReNode *re_parse_atom(ReCompiler *c) {
+  static const uint32_t any[] = {'\n', '\n'};
+  int min, max;
+  uint32_t cp;
+  ReNode *n;
+  switch (*c->p) {
+  case '(': {
+    int group = 0;
+    c->p++;
+    if (c->end - c->p >= 2 && c->p[0] == '?' && c->p[1] == ':')
+      c->p += 2;
+    else if (c->p < c->end && *c->p == '?')
+      re_fail(c, "unsupported group");
+    else if ((group = ++c->ngroups) > RE_MAX_GROUPS)
+      re_fail(c, "too many groups");
+    n = re_parse_alt(c);
+    if (c->p == c->end)
+      re_fail(c, "missing )");
+    c->p++;
+    if (group == 0)
+      return n;
+    n = re_node(c, RN_GROUP, n);
+    n->group = group;
+    return n;
+  }
+  case '*':
+  case '+':
+  case '?':
+    re_fail(c, "nothing to repeat");
+  case '{':
+    if (re_parse_bounds(c, &min, &max))
+      re_fail(c, "nothing to repeat");
+    c->p++;
+    return re_char_node(c, '{');
+  case '.':
+    c->p++;
+    c->nranges = 0;
+    re_add_ranges(c, any, 1, true);
+    return re_class_node(c, false);
+  case '[':
+    c->p++;
+    return re_parse_class(c);
+  case '^':
+    c->p++;
+    return re_node(c, RN_BEGIN, NULL);
+  case '$':
+    c->p++;
+    return re_node(c, RN_END, NULL);
+  case '\\':
+    c->p++;
+    c->nranges = 0;
+    if (re_parse_escape(c, &cp))
+      return re_class_node(c, false);
+    return re_char_node(c, cp);
+  default:
+    // Literal bytes that are not valid UTF-8 match themselves
+    if (utf8_decode((const char *)c->p, c->end - c->p, &cp) < 0) {
+      unsigned char b = *c->p++;
+      return re_range_node(c, b, b);
+    }
+    return re_char_node(c, re_char(c, false));
+  }
+}
+
+// An atom and its quantifier
+static ReNode *re_parse_repeat(ReCompiler *c) {
+  ReNode *atom = re_parse_atom(c);
+  int min, max;
+  if (c->p == c->end)
+    return atom;
+  unsigned char ch = *c->p;
+  if (ch == '*' || ch == '+' || ch == '?') {
+    min = ch == '+';
+    max = ch == '?' ? 1 : -1;
+    c->p++;
+  } else if (ch != '{' || !re_parse_bounds(c, &min, &max)) {
+    return atom;
+  }
+  ReNode *n = re_node(c, RN_REP, atom);
+  n->min = min;
+  n->max = max;
+  n->greedy = true;
+  if (c->p < c->end && *c->p == '?') {
+    n->greedy = false;
+    c->p++;
+  }
+  return n;
+}
+
+static ReNode *re_parse_cat(ReCompiler *c) {
+  ReNode *kids = NULL, **tail = &kids;
+  while (c->p < c->end && *c->p != '|' && *c->p != ')') {
+    *tail = re_parse_repeat(c);
+    tail = &(*tail)->next;
+  }
+  if (kids == NULL)
+    return re_node(c, RN_EMPTY, NULL);
+  return kids->next == NULL ? kids : re_node(c, RN_CAT, kids);
+}
+
+static ReNode *re_parse_alt(ReCompiler *c) {
+  if (++c->depth > RE_MAX_DEPTH)
+    re_fail(c, "nested too deeply");
+  ReNode *first = re_parse_cat(c), *last = first;
+  if (c->p < c->end && *c->p == '|') {
+    while (c->p < c->end && *c->p == '|') {
+      c->p++;
+      last = last->next = re_parse_cat(c);
+    }
+    first = re_node(c, RN_ALT, first);
+  }
+  c->depth--;
+  return first;
+}
+
+static int re_emit(ReCompiler *c, int op) {
+  ReProg *p = c->prog;
+  if (p->n == RE_MAX_INSTS)
+    re_fail(c, "pattern too large");
+  if (p->n == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 64;
+    ReInst *insts = realloc(p->insts, p->cap * sizeof(ReInst));
+    if (insts == NULL)
+      re_fail(c, "out of memory");
+    p->insts = insts;
+  }
+  memset(&p->insts[p->n], 0, sizeof(ReInst));
+  p->insts[p->n].op = op;
+  return p->n++;
+}
+
+// Points the split at s to a, and b when a fails or is not preferred.
+static void re_split(ReCompiler *c, int s, int a, int b, bool greedy) {
+  c->prog->insts[s].x = greedy ? a : b;
+  c->prog->insts[s].y = greedy ? b : a;
+}
+
+static void re_compile_node(ReCompiler *c, ReNode *n, bool rev) {
+  ReInst *insts;
+  int i, s, patch;
+  switch (n->kind) {
+  case RN_EMPTY:
+    break;
+  case RN_BYTES:
+    i = re_emit(c, RE_BYTES);
+    memcpy(c->prog->insts[i].set, n->set, sizeof(n->set));
+    break;
+  case RN_BEGIN:
+    re_emit(c, rev ? RE_END : RE_BEGIN);
+    break;
+  case RN_END:
+    re_emit(c, rev ? RE_BEGIN : RE_END);
+    break;
+  case RN_GROUP:
+    // Only the forward program places groups
+    if (!rev) {
+      i = re_emit(c, RE_SAVE);
+      c->prog->insts[i].x = n->group * 2;
+    }
+    re_compile_node(c, n->kids, rev);
+    if (!rev) {
+      i = re_emit(c, RE_SAVE);
+      c->prog->insts[i].x = n->group * 2 + 1;
+    }
+    break;
+  case RN_CAT: {
+    if (!rev) {
+      for (ReNode *k = n->kids; k; k = k->next)
+        re_compile_node(c, k, rev);
+      break;
+    }
+    int count = 0;
+    for (ReNode *k = n->kids; k; k = k->next)
+      count++;
+    ReNode *kids[count];
+    count = 0;
+    for (ReNode *k = n->kids; k; k = k->next)
+      kids[count++] = k;
+    while (count > 0)
+      re_compile_node(c, kids[--count], rev);
+    break;
+  }
+  case RN_ALT:
+    // split L1, L2; L1: a; jmp end; L2: split ... ; b; end:
+    patch = -1;
+    for (ReNode *k = n->kids; k; k = k->next) {
+      if (k->next == NULL) {
+        re_compile_node(c, k, rev);
+        break;
+      }
+      s = re_emit(c, RE_SPLIT);
+      re_compile_node(c, k, rev);
+      i = re_emit(c, RE_JMP);
+      c->prog->insts[i].x = patch;
+      patch = i;
+      re_split(c, s, s + 1, c->prog->n, true);
+    }
+    for (insts = c->prog->insts; patch >= 0;) {
+      i = insts[patch].x;
+      insts[patch].x = c->prog->n;
+      patch = i;
+    }
+    break;
+  case RN_REP:
+    for (i = 0; i < n->min - (n->max < 0 && n->min > 0); i++)
+      re_compile_node(c, n->kids, rev);
+    if (n->max < 0 && n->min > 0) {
+      // L: x; split L, out
+      int l = c->prog->n;
+      re_compile_node(c, n->kids, rev);
+      s = re_emit(c, RE_SPLIT);
+      re_split(c, s, l, s + 1, n->greedy);
+    } else if (n->max < 0) {
+      // L: split L1, out; L1: x; jmp L
+      s = re_emit(c, RE_SPLIT);
+      re_compile_node(c, n->kids, rev);
+      i = re_emit(c, RE_JMP);
+      c->prog->insts[i].x = s;
+      re_split(c, s, s + 1, c->prog->n, n->greedy);
+    } else {
+      // Up to max - min more: split L1, out; L1: x; split L2, out; ...
+      patch = -1;
+      for (; i < n->max; i++) {
+        s = re_emit(c, RE_SPLIT);
+        c->prog->insts[s].x = patch;
+        patch = s;
+        re_compile_node(c, n->kids, rev);
+      }
+      for (insts = c->prog->insts; patch >= 0;) {
+        i = insts[patch].x;
+        re_split(c, patch, patch + 1, c->prog->n, n->greedy);
+        patch = i;
+      }
+    }
+    break;
+  }
+}
+
+// Appends the literal bytes every match of n starts with to the prefix, and
+// returns whether all of n is such a literal.
+static bool re_prefix(Regex *re, ReNode *n) {
+  int bits = 0, b = 0;
+  switch (n->kind) {
+  case RN_EMPTY:
+    return true;
+  case RN_BYTES:
+    for (int i = 0; i < 4; i++) {
+      bits += __builtin_popcountll(n->set[i]);
+      if (n->set[i])
+        b = i * 64 + __builtin_ctzll(n->set[i]);
+    }
+    if (bits != 1 || re->prefixlen == RE_PREFIX_MAX)
+      return false;
+    re->prefix[re->prefixlen++] = b;
+    return true;
+  case RN_GROUP:
+    return re_prefix(re, n->kids);
+  case RN_CAT:
+    for (ReNode *k = n->kids; k; k = k->next)
+      if (!re_prefix(re, k))
+        return false;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void re_prog_init(ReCompiler *c, ReProg *p) {
+  // A new class starts at each byte where some instruction's set changes
+  bool cut[256] = {false};
+  for (int i = 0; i < p->n; i++) {
+    if (p->insts[i].op != RE_BYTES)
+      continue;
+    uint64_t *set = p->insts[i].set;
+    for (int b = 1; b < 256; b++)
+      if (((set[b >> 6] >> (b & 63)) & 1) !=
+          ((set[(b - 1) >> 6] >> ((b - 1) & 63)) & 1))
+        cut[b] = true;
+  }
+  for (int b = 1; b < 256; b++)
+    p->classes[b] = p->classes[b - 1] + cut[b];
+  p->nclasses = p->classes[255] + 1;
+  p->seen = re_alloc(c, p->n * sizeof(int));
+  p->stack = re_alloc(c, (2 * p->n + 1) * sizeof(int));
+  p->pcs = re_alloc(c, p->n * sizeof(int));
+}
+
+static void re_flush(ReProg *p) {
+  for (int i = 0; i < RE_DFA_BUCKETS; i++) {
+    while (p->buckets[i]) {
+      ReState *s = p->buckets[i];
+      p->buckets[i] = s->chain;
+      free(s);
+    }
+  }
+  p->starts[0] = p->starts[1] = NULL;
+  p->mem = 0;
+  p->flushes++;
+}
+
+static void re_free(Regex *re) {
+  if (re == NULL)
+    return;
+  ReProg *progs[] = {&re->fwd, &re->rev};
+  for (int i = 0; i < 2; i++) {
+    re_flush(progs[i]);
+    free(progs[i]->insts);
+    free(progs[i]->seen);
+    free(progs[i]->stack);
+    free(progs[i]->pcs);
+  }
+  free(re->src);
+  free(re->pike);
+  free(re);
+}
+
+static void re_compiler_free(ReCompiler *c) {
+  while (c->nodes) {
+    ReNode *n = c->nodes;
+    c->nodes = n->all;
+    free(n);
+  }
+  free(c->ranges);
+}
+
+static void re_build(ReCompiler *c, const char *src, size_t len) {
+  c->p = (const unsigned char *)src;
+  c->end = c->p + len;
+  c->re = re_alloc(c, sizeof(Regex));
+  c->re->src = re_alloc(c, len + 1);
+  memcpy(c->re->src, src, len);
+  c->re->srclen = len;
+
+  ReNode *tree = re_parse_alt(c);
+  if (c->p != c->end)
+    re_fail(c, "unmatched )");
+  c->re->ngroups = c->ngroups;
+  re_prefix(c->re, tree);
+
+  // save 0; x; save 1; match
+  c->prog = &c->re->fwd;
+  re_emit(c, RE_SAVE);
+  re_compile_node(c, tree, false);
+  int save = re_emit(c, RE_SAVE);
+  c->prog->insts[save].x = 1;
+  re_emit(c, RE_MATCH);
+  re_prog_init(c, c->prog);
+  c->prog = &c->re->rev;
+  c->prog->reverse = true;
+  re_compile_node(c, tree, true);
+  re_emit(c, RE_MATCH);
+  re_prog_init(c, c->prog);
+}
+
+// Compiles the pattern, or fails with an error saying what is wrong with it.
+static Regex *re_compile(const char *src, size_t len) {
+  ReCompiler c;
+  memset(&c, 0, sizeof(c));
+  if (setjmp(c.jmp) != 0) {
+    char msg[strlen(c.err) + 13];
+    sprintf(msg, "re-compile: %s", c.err);
+    re_compiler_free(&c);
+    re_free(c.re);
+    error(msg);
+  }
+  re_build(&c, src, len);
+  re_compiler_free(&c);
+  return c.re;
+}
+
+static void re_new_gen(ReProg *p) {
+  if (++p->gen == INT_MAX) {
+    memset(p->seen, 0, p->n * sizeof(int));
+    p->gen = 1;
+  }
+}
+
+// Adds the threads reachable from pc without reading a byte to p->pcs, which
+// holds n of them. Returns false when the forward program reaches a match,
+// as the threads after it have a lower priority and are cut.
+static bool re_closure(ReProg *p, int pc, bool begin, bool end, int *n) {
+  int sp = 0;
+  p->stack[sp++] = pc;
+  while (sp > 0) {
+    pc = p->stack[--sp];
+    if (p->seen[pc] == p->gen)
+      continue;
+    p->seen[pc] = p->gen;
+    ReInst *in = &p->insts[pc];
+    switch (in->op) {
+    case RE_JMP:
+      p->stack[sp++] = in->x;
+      break;
+    case RE_SPLIT:
+      p->stack[sp++] = in->y;
+      p->stack[sp++] = in->x;
+      break;
+    case RE_SAVE:
+      p->stack[sp++] = pc + 1;
+      break;
+    case RE_BEGIN:
+      if (begin)
+        p->stack[sp++] = pc + 1;
+      break;
+    case RE_END:
+      // Kept to be followed if the input ends here
+      if (end)
+        p->stack[sp++] = pc + 1;
+      else
+        p->pcs[(*n)++] = pc;
+      break;
+    case RE_BYTES:
+      p->pcs[(*n)++] = pc;
+      break;
+    case RE_MATCH:
+      p->pcs[(*n)++] = pc;
+      if (!p->reverse)
+        return false;
+      break;
+    }
+  }
+  return true;
+}
+
+static bool re_has_match(ReProg *p, int *pcs, int n) {
+  for (int i = 0; i < n; i++)
+    if (p->insts[pcs[i]].op == RE_MATCH)
+      return true;
+  return false;
+}
+
+// Returns the state of the n threads in p->pcs, making it if needed.
+static ReState *re_state(ReProg *p, int n, int flags) {
+  uint32_t hash = jenkins_hash((const char *)p->pcs, n * sizeof(int)) ^ flags;
+  ReState **bucket = &p->buckets[hash % RE_DFA_BUCKETS];
+  for (ReState *s = *bucket; s; s = s->chain)
+    if (s->hash == hash && s->flags == flags && s->n == n &&
+        memcmp(s->pcs, p->pcs, n * sizeof(int)) == 0)
+      return s;
+
+  size_t size = sizeof(ReState) + p->nclasses * sizeof(ReState *) +
+                n * sizeof(int);
+  if (p->mem + size > RE_DFA_MEM)
+    re_flush(p);
+  ReState *s = calloc(1, size);
+  if (s == NULL)
+    error("regex: out of memory");
+  s->pcs = (int *)&s->next[p->nclasses];
+  memcpy(s->pcs, p->pcs, n * sizeof(int));
+  s->n = n;
+  s->flags = flags;
+  s->hash = hash;
+  s->match = re_has_match(p, s->pcs, n);
+  s->dead = n == 0 && !(flags & RS_RESTART);
+  s->end_match = s->match;
+  re_new_gen(p);
+  for (int i = 0; i < n && !s->end_match; i++) {
+    if (p->insts[s->pcs[i]].op != RE_END)
+      continue;
+    int m = 0;
+    re_closure(p, s->pcs[i] + 1, flags & RS_BEGIN, true, &m);
+    s->end_match = re_has_match(p, p->pcs, m);
+  }
+  s->chain = p->buckets[hash % RE_DFA_BUCKETS];
+  p->buckets[hash % RE_DFA_BUCKETS] = s;
+  p->mem += size;
+  return s;
+}
+
+// Returns the state before reading the input, at its start if begin is set.
+static ReState *re_start(ReProg *p, bool begin) {
+  if (p->starts[begin])
+    return p->starts[begin];
+  re_new_gen(p);
+  int n = 0;
+  re_closure(p, 0, begin, false, &n);
+  int flags = begin ? RS_BEGIN : 0;
+  if (!p->reverse && !re_has_match(p, p->pcs, n))
+    flags |= RS_RESTART;
+  ReState *s = re_state(p, n, flags);
+  p->starts[begin] = s;
+  return s;
+}
+
+// Returns the state after reading b in state s, which may be freed.
+static ReState *re_step(ReProg *p, ReState *s, unsigned char b) {
+  re_new_gen(p);
+  int n = 0;
+  bool more = true;
+  for (int i = 0; i < s->n && more; i++) {
+    ReInst *in = &p->insts[s->pcs[i]];
+    if (in->op == RE_MATCH && !p->reverse)
+      break;
+    if (in->op == RE_BYTES && ((in->set[b >> 6] >> (b & 63)) & 1))
+      more = re_closure(p, s->pcs[i] + 1, false, false, &n);
+  }
+  // Unanchored: a match may also start after b, with the lowest priority
+  if (more && (s->flags & RS_RESTART))
+    re_closure(p, 0, false, false, &n);
+  int flags = (s->flags & RS_RESTART) && !re_has_match(p, p->pcs, n)
+                  ? RS_RESTART
+                  : 0;
+  unsigned flushes = p->flushes;
+  ReState *next = re_state(p, n, flags);
+  if (p->flushes == flushes)
+    s->next[p->classes[b]] = next;
+  return next;
+}
+
+// Returns the end of the leftmost match starting at or after start, or -1.
+static ptrdiff_t re_match_end(Regex *re, const unsigned char *s, size_t len,
+                              size_t start) {
+  ReProg *p = &re->fwd;
+  // Where no thread is running, the prefix is searched for instead
+  if (re->prefixlen > 0)
+    re_start(p, false);
+  ReState *st = re_start(p, start == 0);
+  ptrdiff_t last = -1;
+  for (size_t i = start;; i++) {
+    if (st->match)
+      last = i;
+    if (i == len) {
+      if (st->end_match)
+        last = i;
+      break;
+    }
+    if (st->dead)
+      break;
+    if (st == p->starts[0] && re->prefixlen > 0) {
+      ptrdiff_t at = str_find((const char *)s + i, len - i, re->prefix,
+                              re->prefixlen);
+      if (at < 0)
+        break;
+      i += at;
+    }
+    ReState *next = st->next[p->classes[s[i]]];
+    st = next ? next : re_step(p, st, s[i]);
+  }
+  return last;
+}
+
+// Returns the start of the match ending at end found by re_match_end, which
+// is the longest match ending there that starts at or after start.
+static size_t re_match_start(Regex *re, const unsigned char *s, size_t len,
+                             size_t start, size_t end) {
+  ReProg *p = &re->rev;
+  ReState *st = re_start(p, end == len);
+  size_t last = end;
+  for (size_t i = end;; i--) {
+    if (st->match)
+      last = i;
+    if (i == start) {
+      if (start == 0 && st->end_match)
+        last = i;
+      break;
+    }
+    if (st->dead)
+      break;
+    ReState *next = st->next[p->classes[s[i - 1]]];
+    st = next ? next : re_step(p, st, s[i - 1]);
+  }
+  return last;
+}
+
+// Threads of the NFA simulation: program counters by priority, indexed by
+// sparse, and the capture slots of each
+typedef struct {
+  int n, *dense, *sparse;
+  ptrdiff_t *slots;
+} ReThreads;
+
+// Adds the threads reachable from pc at pos, with the capture slots in
+// caps, to l.
+static void re_pike_add(ReProg *p, ReThreads *l, int pc, size_t pos,
+                        size_t len, ptrdiff_t *caps, int nslots,
+                        ptrdiff_t *stack) {
+  // Entries are a pc to follow, or a slot and the value to restore in it
+  // once the threads after a save are added, as -1 - slot
+  int sp = 0;
+  stack[sp++] = pc;
+  while (sp > 0) {
+    ptrdiff_t e = stack[--sp];
+    if (e < 0) {
+      caps[-1 - e] = stack[--sp];
+      continue;
+    }
+    pc = e;
+    if (l->sparse[pc] < l->n && l->dense[l->sparse[pc]] == pc)
+      continue;
+    l->sparse[pc] = l->n;
+    l->dense[l->n++] = pc;
+    ReInst *in = &p->insts[pc];
+    switch (in->op) {
+    case RE_JMP:
+      stack[sp++] = in->x;
+      break;
+    case RE_SPLIT:
+      stack[sp++] = in->y;
+      stack[sp++] = in->x;
+      break;
+    case RE_SAVE:
+      stack[sp++] = caps[in->x];
+      stack[sp++] = -1 - in->x;
+      caps[in->x] = pos;
+      stack[sp++] = pc + 1;
+      break;
+    case RE_BEGIN:
+      if (pos == 0)
+        stack[sp++] = pc + 1;
+      break;
+    case RE_END:
+      if (pos == len)
+        stack[sp++] = pc + 1;
+      break;
+    default:
+      memcpy(&l->slots[pc * nslots], caps, nslots * sizeof(ptrdiff_t));
+    }
+  }
+}
+
+// Places the groups of the match in [start, end) in caps, by running the
+// forward program over it with the capture slots of each thread.
+static void re_captures(Regex *re, const unsigned char *s, size_t len,
+                        size_t start, size_t end, ptrdiff_t *caps) {
+  ReProg *p = &re->fwd;
+  int nslots = 2 * (re->ngroups + 1);
+  size_t n = p->n;
+  // Two lists of n threads, then a stack of up to 3 entries per instruction
+  if (re->pike == NULL) {
+    size_t list = n * (nslots * sizeof(ptrdiff_t) + 2 * sizeof(int));
+    re->pike = calloc(1, 2 * list + (3 * n + 1) * sizeof(ptrdiff_t));
+    if (re->pike == NULL)
+      error("regex: out of memory");
+  }
+  ReThreads lists[2];
+  ptrdiff_t *slots = re->pike, *stack = slots + 2 * n * nslots, tmp[nslots];
+  int *ints = (int *)(stack + 3 * n + 1);
+  for (int i = 0; i < 2; i++) {
+    lists[i].n = 0;
+    lists[i].dense = ints + 2 * n * i;
+    lists[i].sparse = ints + 2 * n * i + n;
+    lists[i].slots = slots + n * nslots * i;
+  }
+  ReThreads *cur = &lists[0], *next = &lists[1];
+
+  for (int i = 0; i < nslots; i++)
+    tmp[i] = -1;
+  re_pike_add(p, cur, 0, start, len, tmp, nslots, stack);
+  for (size_t pos = start; cur->n > 0; pos++) {
+    next->n = 0;
+    for (int i = 0; i < cur->n; i++) {
+      int pc = cur->dense[i];
+      ReInst *in = &p->insts[pc];
+      if (in->op == RE_MATCH) {
+        memcpy(caps, &cur->slots[pc * nslots], nslots * sizeof(ptrdiff_t));
+        break;
+      }
+      if (in->op == RE_BYTES && pos < end &&
+          ((in->set[s[pos] >> 6] >> (s[pos] & 63)) & 1)) {
+        memcpy(tmp, &cur->slots[pc * nslots], nslots * sizeof(ptrdiff_t));
+        re_pike_add(p, next, pc + 1, pos + 1, len, tmp, nslots, stack);
+      }
+    }
+    if (pos == end)
+      break;
+    ReThreads *t = cur;
+    cur = next;
+    next = t;
+  }
+}
+
+// Finds the leftmost match at or after start. Stores its bounds in caps[0]
+// and caps[1] and, when ncaps is over 2, those of the groups too, -1 for the
+// groups that took no part.
+static bool re_exec(Regex *re, const char *str, size_t len, size_t start,
+                    ptrdiff_t *caps, int ncaps) {
+  const unsigned char *s = (const unsigned char *)str;
+  ptrdiff_t end = re_match_end(re, s, len, start);
+  if (end < 0)
+    return false;
+  size_t from = re_match_start(re, s, len, start, end);
+  if (ncaps > 2) {
+    re_captures(re, s, len, from, end, caps);
+  } else {
+    caps[0] = from;
+    caps[1] = end;
+  }
+  return true;
+}
+
+static Regex *re_cache[RE_CACHE_SLOTS];
+
+// Returns the compiled program of the pattern, from the cache if it is there.
+static Regex *re_get(Val *pattern) {
+  Regex **slot = &re_cache[str_hash(pattern) % RE_CACHE_SLOTS];
+  if (*slot && (*slot)->srclen == pattern->slen &&
+      memcmp((*slot)->src, str_ptr(pattern), pattern->slen) == 0)
+    return *slot;
+  Regex *re = re_compile(str_ptr(pattern), pattern->slen);
+  re_free(*slot);
+  *slot = re;
+  return re;
+}
+
+// }}}
+
+// {{{ primitives
+
+// {{{ primitives: language
+
+// (do body ...)
+static Val *prim_do(void *root, Val **env, Val **list) {
+  return progn(root, env, list);
+}
+
+// (while cond expr ...)
+static Val *prim_while(void *root, Val **env, Val **list) {
+  if (length(*list) < 2)
+    error("Malformed while");
+  DEFINE2(root, cond, exprs);
+  *cond = (*list)->car;
+  while (eval(root, env, cond) != Nil) {
+    *exprs = (*list)->cdr;
+    eval_list(root, env, exprs);
+  }
+  return Nil;
+}
+
+static Val *handle_function(void *root, Val **env, Val **list, int type) {
+  if ((*list)->type != TCELL ||
+      !(is_list((*list)->car) || (*list)->car->type == TSYM) ||
+      (*list)->cdr->type != TCELL) {
+    // TODO append pr_str(root, *list)
+    error("Malformed fn or macro");
+  }
+
+  DEFINE2(root, params, body);
+  *params = (*list)->car;
+  *body = (*list)->cdr;
+  Val *p = *params;
+
+  // validate (arg0 arg1) or (arg0 . argN) forms
+  if (p->type != TSYM) { // but allow a single symbol to be params
+    for (; p->type == TCELL; p = p->cdr)
+      if (p->car->type != TSYM)
+        error("fn|macro: arg list must contain only symbols");
+    if (p != Nil && p->type != TSYM)
+      error("fn|macro: arg list must contain only symbols");
+  }
+
+  return make_function(root, env, type, params, body);
+}
+
+// (fn (<symbol> ...) expr ...)
+static Val *prim_fn(void *root, Val **env, Val **list) {
+  return handle_function(root, env, list, TFUN);
+}
+
+// (macro (<symbol> ...) expr ...)
+static Val *prim_macro(void *root, Val **env, Val **list) {
+  return handle_function(root, env, list, TMAC);
+}
+
+// (def <symbol> expr)
+static Val *prim_def(void *root, Val **env, Val **list) {
+  if (length(*list) != 2 || (*list)->car->type != TSYM)
+    error("Malformed def");
+  DEFINE2(root, sym, value);
+  *sym = (*list)->car;
+  *value = (*list)->cdr->car;
+  *value = eval(root, env, value);
+  env_set(root, env, sym, value);
+  return *value;
+}
+
+static Val *prim_def_global(void *root, Val **env, Val **list) {
+  if (length(*list) != 2 || (*list)->car->type != TSYM)
+    error("Malformed def-global");
+  DEFINE2(root, sym, value);
+  *sym = (*list)->car;
+  *value = (*list)->cdr->car;
+  *value = eval(root, env, value);
+  while ((*env)->proto != Nil) {
+    *env = (*env)->proto;
+  }
+  env_set(root, env, sym, value);
+  return *value;
+}
+
+// (set <symbol> expr) or (set (: obj key) val)
+static Val *prim_set(void *root, Val **env, Val **list) {
+  DEFINE3(root, key, val, obj);
+  if (length(*list) != 2)
+    error("Malformed set");
+
+  // Check for obj-set syntax (set (: obj key) val)
+  if ((*list)->car->type == TCELL && length((*list)->car) == 3 &&
+      (*list)->car->car->type == TSYM && (*list)->car->car->symv[0] == ':') {
+    *obj = (*list)->car->cdr->car;
+    *obj = eval(root, env, obj);
+    *key = (*list)->car->cdr->cdr->car;
+    *key = eval(root, env, key);
+    *val = (*list)->cdr->car;
+    *val = eval(root, env, val);
+
+    if ((*obj)->type != TOBJ)
+      error("set: (:) 1st arg is not an object");
+    if ((*key)->type != TSYM)
+      error("set: (:) 2nd arg is not a symbol");
+
+    obj_set(root, obj, key, val);
+    return *obj;
+  }
+
+  if ((*list)->car->type != TSYM)
+    error("Malformed set");
+  *key = env_get(env, (*list)->car);
+  if (!*key) {
+    // TODO append (*list)->car->symv
+    error("Unbound variable");
+  }
+  *val = (*list)->cdr->car;
+  *val = eval(root, env, val);
+  (*key)->cdr = *val;
+  write_barrier(&(*key)->cdr);
+  return *val;
+}
+
+// (pr-str expr)
+static Val *prim_pr_str(void *root, Val **env, Val **list) {
+  DEFINE2(root, tmp, s);
+  *tmp = (*list)->car;
+  char *str = pr_str(root, eval(root, env, tmp));
+  *s = make_str(root, str);
+  free(str);
+  return *s;
+}
+
+// (if expr expr expr ...)
+static Val *prim_if(void *root, Val **env, Val **list) {
+  if (length(*list) < 2)
+    error("Malformed if");
+  DEFINE3(root, cond, then, els);
+  *cond = (*list)->car;
+  *cond = eval(root, env, cond);
+  if (*cond != Nil) {
+    // Test succeded, return then branch and skip evaluatin else
+    *then = (*list)->cdr->car;
+    return eval(root, env, then);
+  }
+  *els = (*list)->cdr->cdr;
+  if (*els == Nil) {
+    // Return nil when else is missing
+    return Nil;
+  }
+  if ((*els)->cdr == Nil) {
+    // Return else value if it's last in args (if test then else)
+    *then = (*els)->car;
+    return eval(root, env, then);
+  }
+  // Re-enter if with else branch as start (if a ar b br ...)
+  return prim_if(root, env, els);
+}
+
+// (eq? expr expr)
+static Val *prim_eq(void *root, Val **env, Val **list) {
+  if (length(*list) != 2)
+    error("eq?: needs exactly 2 arguments");
+  Val *values = eval_list(root, env, list);
+  if (obj_key_eq(values->car, values->cdr->car)) {
+    return True;
+  }
+  return values->car == values->cdr->car ? True : Nil;
+}
+
+// (type expr)
+static Val *prim_type(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("type: not given exactly 1 argument");
+  Val *values = eval_list(root, env, list);
+
+  char *name;
+
+  switch (values->car->type) {
+  case TTRUE:
+    name = "true";
+    break;
+  case TNIL:
+    name = "nil";
+    break;
+  case TINT:
+  case TBIG:
+    name = "int";
+    break;
+  case TFLOAT:
+    name = "float";
+    break;
+  case TSTR:
+  case TSLICE:
+    name = "str";
+    break;
+  case TSYM:
+    name = "sym";
+    break;
+  case TOBJ:
+    name = "obj";
+    break;
+  case TPRI:
+    name = "prim";
+    break;
+  case TFUN:
+    name = "fn";
+    break;
+  case TMAC:
+    name = "macro";
+    break;
+  case TWEAK:
+    name = "weak-ref";
+    break;
+  case TWTABLE:
+    name = "weak-table";
+    break;
+  case TVEC:
+    name = "vec";
+    break;
+  case TARRAY:
+    name = "array";
+    break;
+  case TBYTES:
+    name = "bytes";
+    break;
+  case TSB:
+    name = "sb";
+    break;
+  case TREGEX:
+    name = "regex";
+    break;
+  case TJSON:
+    name = "json-parser";
+    break;
+  case TRES:
+    name = "handle";
+    break;
+  case TCELL:
+    if (values->car->cdr != Nil && values->car->cdr->type != TCELL) {
+      name = "cons";
+    } else {
+      name = "list";
+    }
+    break;
+  default:
+    // TODO append values->car->type
+    error("type: unknown object type");
+  }
+
+  DEFINE1(root, k);
+  *k = intern(root, name);
+  return *k;
+}
+
+// (apply fn args)
+static Val *prim_apply(void *root, Val **env, Val **list) {
+  if (length(*list) != 2)
+    error("apply: not given exactly 2 args");
+  DEFINE2(root, fn, args);
+  *fn = (*list)->car;
+  *fn = eval(root, env, fn);
+
+  *args = (*list)->cdr->car;
+  *args = eval(root, env, args);
+  if ((*args)->type != TCELL && *args != Nil)
+    error("apply: 2nd argument is not a list");
+
+  return apply(root, env, fn, args, false);
+}
+
+// (eval expr)
+static Val *prim_eval(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("Malformed eval");
+  DEFINE1(root, arg);
+  *arg = (*list)->car;
+  *arg = eval(root, env, arg); // arg to ast
+  return eval(root, env, arg); // ast to value
+}
+
+// (read-sexp str)
+static Val *prim_read_sexp(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("read-sexp: exactly 1 param required");
+  DEFINE4(root, str, expr, exprs, do_sym);
+  *str = (*list)->car;
+  *str = eval(root, env, str);
+  if (!is_str(*str))
+    error("read-sexp: 1st arg is not a string");
+
+  Reader *r = reader_new(str_ptr(*str), (*str)->slen);
+  *exprs = Nil;
+
+  for (;;) {
+    *expr = read_expr(r, root);
+    if (!*expr) {
+      reader_destroy(r);
+
+      // Finalize.
+      // For single expressions simply return it
+      // Wrap multiple expressions in a (do ...)
+      if (length(*exprs) == 1) {
+        return (*exprs)->car;
+      } else {
+        *do_sym = intern(root, "do");
+        *exprs = reverse(*exprs);
+        return cons(root, do_sym, exprs);
+      }
+    } else if (*expr == Cparen) {
+      reader_destroy(r);
+      error("Stray close parenthesis");
+    } else if (*expr == Ccurly) {
+      reader_destroy(r);
+      error("Stray close curly bracket");
+    } else if (*expr == Cbracket) {
+      reader_destroy(r);
+      error("Stray close square bracket");
+    } else if (*expr == Dot) {
+      reader_destroy(r);
+      error("Stray dot");
+    }
+    *exprs = cons(root, expr, exprs);
+  }
+}
+
+// (sym str)
+static Val *prim_sym(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("sym: exactly 1 param required");
+  DEFINE1(root, str);
+  *str = (*list)->car;
+  *str = eval(root, env, str);
+  if (!is_str(*str))
+    error("sym: 1st arg is not a string");
+
+  char name[(*str)->slen + 1];
+  return intern(root,
+                str_to_c(*str, name, "sym: string contains a NUL byte"));
+}
+
+// }}}
+
+// {{{ primitives: marco
+
+// (quote expr)
+static Val *prim_quote(void *root, Val **env, Val **list) {
+  (void)root;
+  (void)env;
+  if (length(*list) != 1)
+    error("Malformed quote");
+  return (*list)->car;
+}
+
+// (macro-expand expr)
+static Val *prim_macro_expand(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("Malformed macro-expand");
+  DEFINE1(root, body);
+  *body = (*list)->car;
+  *body = eval(root, env, body);
+  return macroexpand(root, env, body);
+}
+
+// Number of symbols created by gensym so far
+static int gensym_count = 0;
+
+// (gensym)
+static Val *prim_gensym(void *root, Val **env, Val **list) {
+  (void)env;
+  (void)list;
+  char buf[16];
+  snprintf(buf, sizeof(buf), "G__%d", gensym_count++);
+  return make_symbol(root, buf);
+}
+
+// }}}
+
+// {{{ primitives: object
+
+// (obj proto props) ; nil|obj -> alist -> obj
+static Val *prim_obj(void *root, Val **env, Val **list) {
+  // We have 2 args?
+  if (length(*list) != 2) {
+    error("obj: expected exactly 2 args");
+  }
+
+  // 1st arg is nil or an object?
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TOBJ && args->car != Nil) {
+    error("obj: given non object or nil as prototype");
+  }
+
+  // 2nd arg is a list?
+  if (args->cdr->car->type != TCELL && args->cdr->car != Nil) {
+    error("obj: given non alist as properties");
+  }
+
+  // 2nd arg is an association list
+  for (Val *i = args->cdr->car; i != Nil; i = i->cdr) {
+    if (i->type != TCELL || i->car->cdr == Nil) {
+      error("obj: given non alist as properties");
+    } else if (i->car->car->type != TSYM) {
+      error("obj: given non symbol as property key");
+    }
+  }
+
+  DEFINE3(root, obj, proto, props);
+  *proto = args->car;
+  *props = args->cdr->car;
+
+  *obj = make_obj_alist(root, proto, props);
+  return *obj;
+}
+
+static Val *prim_obj_get(void *root, Val **env, Val **list) {
+  if (length(*list) != 2)
+    error("obj-get: expected exactly 2 args");
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TOBJ)
+    error("obj-get: expected 1st argument to be object");
+  if (!obj_valid_key(args->cdr->car))
+    error("obj-get: expected 2nd argument to be valid object key");
+
+  DEFINE3(root, o, k, value);
+  *o = args->car;
+  *k = args->cdr->car;
+  *value = obj_find(*o, *k);
+  if (*value == NULL) {
+    // TODO append args->cdr->car->symv
+    error("obj-get: unbound symbol");
+  }
+
+  return (*value)->cdr;
+}
+
+static Val *prim_obj_set(void *root, Val **env, Val **list) {
+  if (length(*list) != 3)
+    error("obj-set: expected exactly 3 args");
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TOBJ)
+    error("obj-set: expected 1st argument to be object");
+  if (!obj_valid_key(args->cdr->car))
+    error("obj-set: expected 2nd argument to be valid object key");
+
+  DEFINE3(root, obj, key, val);
+  *obj = args->car;
+  *key = args->cdr->car;
+  *val = args->cdr->cdr->car;
+  obj_set(root, obj, key, val);
+
+  return *obj;
+}
+
+static Val *prim_obj_del(void *root, Val **env, Val **list) {
+  if (length(*list) != 2)
+    error("obj-del: expected exactly 2 args");
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TOBJ)
+    error("obj-del: expected 1st argument to be object");
+  if (!obj_valid_key(args->cdr->car))
+    error("obj-del: expected 2nd argument to be valid object key");
+
+  Val *obj = args->car;
+  Val *key = args->cdr->car;
+  obj_del(obj, key);
+
+  return obj;
+}
+
+static Val *prim_obj_proto(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("obj-proto: expected exactly 1 args");
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TOBJ)
+    error("obj-proto: expected 1st argument to be object");
+
+  return args->car->proto;
+}
+
+static Val *prim_obj_proto_set(void *root, Val **env, Val **list) {
+  if (length(*list) != 2)
+    error("obj-proto-set!: expected exactly 2 args");
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TOBJ)
+    error("obj-proto-set!: expected 1st argument to be object");
+
+  args->car->proto = args->cdr->car;
+  write_barrier(&args->car->proto);
+  return args->car;
+}
+
+static Val *prim_obj_to_alist(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("obj->alist: expected exactly 1 arg");
+  DEFINE4(root, obj, alist, pair, l);
+  *obj = eval_list(root, env, list)->car;
+  if ((*obj)->type != TOBJ)
+    error("obj->alist: expected 1st argument to be object");
+
+  *alist = Nil;
+
+  for (size_t i = 0; i < OBJ_HM_SIZE; i++) {
+    for (*l = (*obj)->props[i]; *l != Nil; *l = (*l)->cdr) {
+      *pair = (*l)->car;
+      *alist = cons(root, pair, alist);
+    }
+  }
+
+  return *alist;
+}
+
+// }}}
+
+// {{{ primitives: list
+
+// (cons expr expr)
+static Val *prim_cons(void *root, Val **env, Val **list) {
+  if (length(*list) != 2)
+    error("Malformed cons");
+  Val *cell = eval_list(root, env, list);
+  cell->cdr = cell->cdr->car;
+  return cell;
+}
+
+// (list expr ...)
+static Val *prim_list(void *root, Val **env, Val **list) {
+  return eval_list(root, env, list);
+}
+
+// (car <cell>)
+static Val *prim_car(void *root, Val **env, Val **list) {
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TCELL || args->cdr != Nil)
+    error("Malformed car");
+  return args->car->car;
+}
+
+// (cdr <cell>)
+static Val *prim_cdr(void *root, Val **env, Val **list) {
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TCELL || args->cdr != Nil)
+    error("Malformed cdr");
+  return args->car->cdr;
+}
+
+// (set-car! <cell> expr)
+static Val *prim_set_car(void *root, Val **env, Val **list) {
+  DEFINE1(root, args);
+  *args = eval_list(root, env, list);
+  if (length(*args) != 2 || (*args)->car->type != TCELL)
+    error("set_car!: invalid arguments");
+  (*args)->car->car = (*args)->cdr->car;
+  write_barrier(&(*args)->car->car);
+  return (*args)->car;
+}
 
-      *ahead = Nil;
-      *list_sym = intern(root, "list");
-      *cons_sym = intern(root, "cons");
-      do {
-        // Pop the two last items (value first as they are reversed)
-        *obj = (*head)->car;
-        *pair = cons(root, obj, &Nil);
-        *obj = (*head)->cdr->car;
-        *pair = cons(root, obj, pair);
-        *pair = cons(root, cons_sym, pair);
-        *head = (*head)->cdr->cdr;
+// }}}
 
-        *ahead = cons(root, pair, ahead);
-      } while (*head != Nil);
-      *ahead = reverse(*ahead);
-      return cons(root, list_sym, ahead);
-    }
+// {{{ primitives: vector
 
-    *head = cons(root, obj, head);
-  }
+static Val *vec_args(void *root, Val **env, Val **list, int n, char *msg) {
+  if (length(*list) != n)
+    error(msg);
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TVEC)
+    error(msg);
+  return args;
 }
 
-// 'def -> (quote def)
-// `(list a) -> (quasiquote (list a))
-// @b -> (unbox b)
-static Val *read_special(Reader *r, void *root, char *name) {
-  DEFINE2(root, sym, tmp);
-  *sym = intern(root, name);
-  *tmp = reader_expr(r, root);
-  *tmp = cons(root, tmp, &Nil);
-  *tmp = cons(root, sym, tmp);
-  return *tmp;
+// Returns the index argument i of vec, which must be below limit.
+static size_t vec_index(Val *i, size_t limit, char *msg) {
+  if (i->type != TINT || i->intv < 0 || (uint64_t)i->intv >= limit)
+    error(msg);
+  return (size_t)i->intv;
 }
 
-static Val *read_unquote(Reader *r, void *root) {
-  DEFINE2(root, sym, tmp);
-  if (reader_peek(r) == '@') {
-    reader_next(r);
-    *sym = intern(root, "unquote-splicing");
-  } else {
-    *sym = intern(root, "unquote");
+// Appends *x to the vector *v, doubling its backing store when it is full.
+static void vec_push(void *root, Val **v, Val **x) {
+  Val *buf = (*v)->buf;
+  if ((*v)->len == buf->cap) {
+    buf = make_vbuf(root, buf->cap * 2);
+    memcpy(buf->slots, (*v)->buf->slots, sizeof(Val *) * (*v)->len);
+    (*v)->buf = buf;
+    write_barrier(&(*v)->buf);
   }
-  *tmp = reader_expr(r, root);
-  *tmp = cons(root, tmp, &Nil);
-  *tmp = cons(root, sym, tmp);
-  return *tmp;
+  buf->slots[(*v)->len] = *x;
+  write_barrier(&buf->slots[(*v)->len]);
+  (*v)->len++;
 }
 
-static int read_number(Reader *r, int val) {
-  while (isdigit(reader_peek(r))) {
-    val = val * 10 + (reader_next(r) - '0');
+// (vec expr ...)
+static Val *prim_vec(void *root, Val **env, Val **list) {
+  DEFINE3(root, args, v, x);
+  *args = eval_list(root, env, list);
+  *v = make_vec(root, length(*args));
+  for (; *args != Nil; *args = (*args)->cdr) {
+    *x = (*args)->car;
+    vec_push(root, v, x);
   }
-  return val;
+  return *v;
 }
 
-static Val *read_string(Reader *r, void *root) {
-  char buf[STRING_MAX_LEN + 1];
-  int len = 0;
-  while (reader_peek(r) != '"' || buf[len - 1] == '\\') {
-    if (STRING_MAX_LEN <= len) {
-      error("String too long");
-    }
-    buf[len++] = reader_next(r);
-  }
-  buf[len] = '\0';
+// (vec-len vec)
+static Val *prim_vec_len(void *root, Val **env, Val **list) {
+  Val *args = vec_args(root, env, list, 1, "vec-len: expected a vec");
+  return make_int(root, args->car->len);
+}
 
-  int buf_len = strlen(buf) + 1;
-  char unescaped_buf[buf_len];
-  u8_unescape(unescaped_buf, buf_len, buf);
+// (vec-ref vec index)
+static Val *prim_vec_ref(void *root, Val **env, Val **list) {
+  Val *args = vec_args(root, env, list, 2, "vec-ref: expected vec and index");
+  Val *v = args->car;
+  return v->buf->slots[vec_index(args->cdr->car, v->len,
+                                 "vec-ref: index out of range")];
+}
 
-  // consume closing "
-  reader_next(r);
+// (vec-set! vec index expr) -> expr
+static Val *prim_vec_set(void *root, Val **env, Val **list) {
+  Val *args =
+      vec_args(root, env, list, 3, "vec-set!: expected vec, index and value");
+  Val *v = args->car;
+  size_t i =
+      vec_index(args->cdr->car, v->len, "vec-set!: index out of range");
+  v->buf->slots[i] = args->cdr->cdr->car;
+  write_barrier(&v->buf->slots[i]);
+  return v->buf->slots[i];
+}
 
-  // create str
-  DEFINE1(root, tmp);
-  *tmp = make_str(root, unescaped_buf);
-  return *tmp;
+// (vec-push! vec expr) -> vec
+static Val *prim_vec_push(void *root, Val **env, Val **list) {
+  DEFINE3(root, args, v, x);
+  *args = vec_args(root, env, list, 2, "vec-push!: expected vec and value");
+  *v = (*args)->car;
+  *x = (*args)->cdr->car;
+  vec_push(root, v, x);
+  return *v;
 }
 
-static Val *read_symbol(Reader *r, void *root, char c) {
-  char buf1[SYMBOL_MAX_LEN + 1];
-  char buf2[SYMBOL_MAX_LEN + 1];
-  bool found_colon = false;
-  int len = 1;
-  buf1[0] = c;
+// (vec->list vec)
+static Val *prim_vec_to_list(void *root, Val **env, Val **list) {
+  DEFINE2(root, v, ret);
+  *v = vec_args(root, env, list, 1, "vec->list: expected a vec")->car;
+  if ((*v)->len == 0)
+    return Nil;
+  *ret = alloc_list(root, (*v)->len);
+  Val *p = *ret;
+  for (size_t i = 0; i < (*v)->len; i++, p = p->cdr)
+    p->car = (*v)->buf->slots[i];
+  return *ret;
+}
 
-  while (valid_symbol_char(reader_peek(r))) {
-    if (SYMBOL_MAX_LEN <= len) {
-      error("Symbol name too long");
-    }
-    if (!found_colon) {
-      // Normal case
-      buf1[len++] = reader_next(r);
+// (list->vec list)
+static Val *prim_list_to_vec(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("list->vec: expected a list");
+  DEFINE3(root, l, v, x);
+  *l = eval_list(root, env, list)->car;
+  int n = length(*l);
+  if (n < 0)
+    error("list->vec: expected a list");
+  *v = make_vec(root, n);
+  for (; *l != Nil; *l = (*l)->cdr) {
+    *x = (*l)->car;
+    vec_push(root, v, x);
+  }
+  return *v;
+}
 
-      // Found colon syntax, split up
-      if (buf1[len - 1] == ':') {
-        buf1[len - 1] = '\0';
-        len = 0;
-        found_colon = true;
-      }
-    } else {
-      // Building second part of object get syntax
-      buf2[len++] = reader_next(r);
-    }
+// }}}
+
+// {{{ primitives: string
+
+// (str str0 str1 str3)
+static Val *prim_str(void *root, Val **env, Val **list) {
+  // Ensure we are only dealing with strings and compute final length
+  DEFINE1(root, args);
+  *args = eval_list(root, env, list);
+  size_t len = 0;
+  for (Val *a = *args; a != Nil; a = a->cdr) {
+    if (!is_str(a->car))
+      error("str: argument not a string");
+    len += a->car->slen;
   }
 
-  if (found_colon && len > 0) {
-    buf2[len] = '\0';
-    DEFINE5(root, expr, quote_sym, colon_sym, obj_sym, prop_sym);
-    *quote_sym = intern(root, "quote");
-    *colon_sym = intern(root, ":");
-    *obj_sym = intern(root, buf1);
-    *prop_sym = intern(root, buf2);
-    *expr = cons(root, prop_sym, &Nil);
-    *expr = cons(root, quote_sym, expr);
-    *expr = cons(root, expr, &Nil);
-    *expr = cons(root, obj_sym, expr);
-    *expr = cons(root, colon_sym, expr);
-    return *expr;
+  // Append strings to return value
+  Val *r = make_str_len(root, NULL, len);
+  char *last = r->strv;
+  for (Val *a = *args; a != Nil; a = a->cdr) {
+    memcpy(last, str_ptr(a->car), a->car->slen);
+    last += a->car->slen;
   }
+  return r;
+}
 
-  buf1[len] = '\0';
-  return intern(root, buf1);
+// (str-len str)
+static Val *prim_str_len(void *root, Val **env, Val **list) {
+  DEFINE1(root, args);
+  *args = eval_list(root, env, list);
+  if (length(*args) != 1 || !is_str((*args)->car)) {
+    error("str-len: 1st arg is not a string");
+  }
+
+  return make_int(root, (*args)->car->slen);
 }
 
-static Val *reader_expr(Reader *r, void *root) {
-  for (;;) {
-    int c = reader_next(r);
-    if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
-      continue;
-    if (c == EOF)
-      return NULL;
-    if (c == ';' || (r->pos == 0 && c == '#')) {
-      reader_skip_line(r);
-      continue;
-    }
-    if (c == '(')
-      return reader_list(r, root);
-    if (c == ')')
-      return Cparen;
-    if (c == '{')
-      return reader_alist(r, root);
-    if (c == '}')
-      return Ccurly;
-    if (c == '.')
-      return Dot;
-    if (c == '@')
-      return read_special(r, root, "unbox");
-    if (c == '\'')
-      return read_special(r, root, "quote");
-    if (c == '`')
-      return read_special(r, root, "quasiquote");
-    if (c == ',') // handle ,@ too
-      return read_unquote(r, root);
-    if (c == '"')
-      return read_string(r, root);
-    if (isdigit(c))
-      return make_int(root, read_number(r, c - '0'));
-    if (c == '-' && isdigit(reader_peek(r)))
-      return make_int(root, -read_number(r, 0));
-    if (valid_symbol_start_char(c))
-      return read_symbol(r, root, c);
+// (str-sub str start [end]) -> the bytes in [start, end), sharing the storage
+// of str
+static Val *prim_str_sub(void *root, Val **env, Val **list) {
+  char *msg = "str-sub: expected a string, start and optional end in range";
+  DEFINE1(root, s);
+  Val *args = eval_list(root, env, list);
+  int n = length(args);
+  if (n < 2 || n > 3 || !is_str(args->car))
+    error(msg);
+  *s = args->car;
+  size_t start = vec_index(args->cdr->car, (*s)->slen + 1, msg);
+  size_t end = (*s)->slen;
+  if (n == 3)
+    end = vec_index(args->cdr->cdr->car, (*s)->slen + 1, msg);
+  if (end < start)
+    error(msg);
+  return make_slice(root, s, start, end - start);
+}
 
-    // TODO cleanup
-    char *err_text = "Don't know how to handle ";
-    int err_text_len = strlen(err_text);
-    char err_buf[err_text_len + 2];
-    strncpy(err_buf, err_text, err_text_len);
-    err_buf[err_text_len] = c;
-    err_buf[err_text_len + 1] = '\0';
-    error(err_buf);
+// (str-split str sep) -> the list of the parts of str between occurrences of
+// sep, sharing the storage of str
+static Val *prim_str_split(void *root, Val **env, Val **list) {
+  DEFINE4(root, args, s, part, parts);
+  *args = eval_list(root, env, list);
+  if (length(*args) != 2 || !is_str((*args)->car) ||
+      !is_str((*args)->cdr->car))
+    error("str-split: expected a string and a separator");
+  *s = (*args)->car;
+  size_t seplen = (*args)->cdr->car->slen;
+  if (seplen == 0)
+    error("str-split: empty separator");
+
+  *parts = Nil;
+  size_t start = 0;
+  for (;;) {
+    ptrdiff_t i = str_find(str_ptr(*s) + start, (*s)->slen - start,
+                           str_ptr((*args)->cdr->car), seplen);
+    size_t end = i < 0 ? (*s)->slen : start + i;
+    *part = make_slice(root, s, start, end - start);
+    *parts = cons(root, part, parts);
+    if (i < 0)
+      return reverse(*parts);
+    start = end + seplen;
   }
 }
 
-// }}}
+// Evaluates the arguments of a primitive taking a string and a second string
+// to look for in it, with optional extra arguments up to max.
+static Val *str_needle_args(void *root, Val **env, Val **list, int max,
+                            char *msg) {
+  Val *args = eval_list(root, env, list);
+  int n = length(args);
+  if (n < 2 || n > max || !is_str(args->car) || !is_str(args->cdr->car))
+    error(msg);
+  return args;
+}
 
-// {{{ eval
+// (str-index str needle [start]) -> the offset of the first occurrence of
+// needle at or after start, or nil
+static Val *prim_str_index(void *root, Val **env, Val **list) {
+  char *msg = "str-index: expected a string, a needle and optional start";
+  Val *args = str_needle_args(root, env, list, 3, msg);
+  Val *s = args->car, *needle = args->cdr->car;
+  size_t start = 0;
+  if (args->cdr->cdr != Nil)
+    start = vec_index(args->cdr->cdr->car, s->slen + 1, msg);
+  ptrdiff_t i = str_find(str_ptr(s) + start, s->slen - start,
+                         str_ptr(needle), needle->slen);
+  return i < 0 ? Nil : make_int(root, start + i);
+}
 
-static Val *eval(void *root, Val **env, Val **obj);
+// (str-contains? str needle)
+static Val *prim_str_contains(void *root, Val **env, Val **list) {
+  Val *args = str_needle_args(root, env, list, 2,
+                              "str-contains?: expected 2 strings");
+  Val *s = args->car, *needle = args->cdr->car;
+  return str_find(str_ptr(s), s->slen, str_ptr(needle), needle->slen) < 0
+             ? Nil
+             : True;
+}
 
-// Adds a variable to the current env level
-static void env_set(void *root, Val **env, Val **sym, Val **val) {
-  obj_set(root, env, sym, val);
+// (str-starts-with? str prefix)
+static Val *prim_str_starts_with(void *root, Val **env, Val **list) {
+  Val *args = str_needle_args(root, env, list, 2,
+                              "str-starts-with?: expected 2 strings");
+  Val *s = args->car, *prefix = args->cdr->car;
+  return prefix->slen <= s->slen &&
+                 memcmp(str_ptr(s), str_ptr(prefix), prefix->slen) == 0
+             ? True
+             : Nil;
 }
 
-// Searches for a variable by symbol. Returns null if not found.
-static Val *env_get(Val **env, Val *sym) {
-  return obj_find(*env, sym);
+// (str-replace str old new) -> str with every occurrence of old replaced by
+// new
+static Val *prim_str_replace(void *root, Val **env, Val **list) {
+  DEFINE1(root, args);
+  *args = eval_list(root, env, list);
+  if (length(*args) != 3 || !is_str((*args)->car) ||
+      !is_str((*args)->cdr->car) || !is_str((*args)->cdr->cdr->car))
+    error("str-replace: expected 3 strings");
+  Val *s = (*args)->car, *old = (*args)->cdr->car;
+  if (old->slen == 0)
+    error("str-replace: empty string to replace");
+
+  // Count the occurrences to allocate the result once
+  size_t count = 0;
+  for (size_t i = 0;;) {
+    ptrdiff_t at =
+        str_find(str_ptr(s) + i, s->slen - i, str_ptr(old), old->slen);
+    if (at < 0)
+      break;
+    count++;
+    i += at + old->slen;
+  }
+  if (count == 0)
+    return s;
+
+  size_t newlen = (*args)->cdr->cdr->car->slen;
+  Val *r = make_str_len(root, NULL, s->slen - count * old->slen +
+                                        count * newlen);
+  s = (*args)->car;
+  old = (*args)->cdr->car;
+  char *new = str_ptr((*args)->cdr->cdr->car), *out = r->strv;
+  size_t i = 0;
+  for (; count > 0; count--) {
+    size_t at =
+        str_find(str_ptr(s) + i, s->slen - i, str_ptr(old), old->slen);
+    memcpy(out, str_ptr(s) + i, at);
+    memcpy(out + at, new, newlen);
+    out += at + newlen;
+    i += at + old->slen;
+  }
+  memcpy(out, str_ptr(s) + i, s->slen - i);
+  return r;
 }
 
-// Returns a newly created environment frame.
-static Val *push_env(void *root, Val **env, Val **vars, Val **vals) {
-  DEFINE3(root, map, sym, val);
-  *map = Nil;
-  if ((*vars)->type == TSYM) {
-    // (fn xs body ...)
-    *map = acons(root, vars, vals, map);
-  } else {
-    // (fn (x y) body ...)
-    for (; (*vars)->type == TCELL; *vars = (*vars)->cdr, *vals = (*vals)->cdr) {
-      if ((*vals)->type != TCELL)
-        error("Cannot apply function: number of argument does not match");
-      *sym = (*vars)->car;
-      *val = (*vals)->car;
-      *map = acons(root, sym, val, map);
+// (str-join sep list) -> the strings of list separated by sep
+static Val *prim_str_join(void *root, Val **env, Val **list) {
+  char *msg = "str-join: expected a separator and a list of strings";
+  DEFINE1(root, args);
+  *args = eval_list(root, env, list);
+  if (length(*args) != 2 || !is_str((*args)->car))
+    error(msg);
+  size_t len = 0, n = 0;
+  for (Val *p = (*args)->cdr->car; p != Nil; p = p->cdr) {
+    if (p->type != TCELL || !is_str(p->car))
+      error(msg);
+    len += p->car->slen;
+    n++;
+  }
+  if (n > 1)
+    len += (n - 1) * (*args)->car->slen;
+
+  Val *r = make_str_len(root, NULL, len);
+  Val *sep = (*args)->car;
+  char *out = r->strv;
+  for (Val *p = (*args)->cdr->car; p != Nil; p = p->cdr) {
+    if (p != (*args)->cdr->car) {
+      memcpy(out, str_ptr(sep), sep->slen);
+      out += sep->slen;
     }
-    if (*vars != Nil)
-      *map = acons(root, vars, vals, map);
+    memcpy(out, str_ptr(p->car), p->car->slen);
+    out += p->car->slen;
   }
-  return make_obj_alist(root, env, map);
+  return r;
 }
 
-// Evaluates the list elements from head and returns the last return value.
-static Val *progn(void *root, Val **env, Val **list) {
-  DEFINE2(root, lp, r);
-  *r = Nil;
-  for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
-    *r = (*lp)->car;
-    *r = eval(root, env, r);
-  }
-  return *r;
+// (str-trim str) -> str without leading and trailing whitespace
+static Val *prim_str_trim(void *root, Val **env, Val **list) {
+  DEFINE1(root, s);
+  Val *args = eval_list(root, env, list);
+  if (length(args) != 1 || !is_str(args->car))
+    error("str-trim: 1st arg is not a string");
+  *s = args->car;
+  const char *p = str_ptr(*s);
+  size_t start = 0, end = (*s)->slen;
+  while (start < end && isspace((unsigned char)p[start]))
+    start++;
+  while (end > start && isspace((unsigned char)p[end - 1]))
+    end--;
+  return make_slice(root, s, start, end - start);
 }
 
-// Evaluates all the list elements and returns their return values as a new
-// list.
-static Val *eval_list(void *root, Val **env, Val **list) {
-  DEFINE4(root, head, lp, expr, result);
-  *head = Nil;
-  for (lp = list; *lp != Nil; *lp = (*lp)->cdr) {
-    *expr = (*lp)->car;
-    *result = eval(root, env, expr);
-    *head = cons(root, result, head);
-  }
-  return reverse(*head);
+// Evaluates the single string argument of a character primitive.
+static Val *str_arg(void *root, Val **env, Val **list, char *msg) {
+  Val *args = eval_list(root, env, list);
+  if (length(args) != 1 || !is_str(args->car))
+    error(msg);
+  return args->car;
 }
 
-static bool is_list(Val *obj) { return obj == Nil || obj->type == TCELL; }
+// (str-valid-utf8? str)
+static Val *prim_str_valid_utf8(void *root, Val **env, Val **list) {
+  Val *s = str_arg(root, env, list, "str-valid-utf8?: expected a string");
+  return utf8_valid(str_ptr(s), s->slen) ? True : Nil;
+}
 
-static Val *apply_func(void *root, Val **env, Val **fn, Val **args) {
-  (void)env;
-  DEFINE3(root, params, newenv, body);
-  *params = (*fn)->params;
-  *newenv = (*fn)->env;
-  *newenv = push_env(root, newenv, params, args);
-  *body = (*fn)->body;
-  return progn(root, newenv, body);
+// (str-char-len str) -> the number of UTF-8 characters in str
+static Val *prim_str_char_len(void *root, Val **env, Val **list) {
+  Val *s = str_arg(root, env, list, "str-char-len: expected a string");
+  return make_int(root, str_char_len(s));
 }
 
-// Apply fn with args.
-static Val *apply(void *root, Val **env, Val **fn, Val **args, bool do_eval) {
-  if (!is_list(*args)) {
-    error("apply: argument must be a list");
-  }
-  if ((*fn)->type == TPRI)
-    return (*fn)->priv(root, env, args);
-  if ((*fn)->type == TFUN) {
-    DEFINE1(root, eargs);
-    if (do_eval) {
-      *eargs = eval_list(root, env, args);
-    } else {
-      *eargs = *args;
+// Evaluates a string and a character index, and returns the byte offset of
+// the character.
+static size_t str_char_args(void *root, Val **env, Val **list, Val **s,
+                            bool end_ok, char *msg) {
+  Val *args = eval_list(root, env, list);
+  if (length(args) != 2 || !is_str(args->car) ||
+      args->cdr->car->type != TINT || args->cdr->car->intv < 0)
+    error(msg);
+  *s = args->car;
+  ptrdiff_t at = str_char_offset(*s, args->cdr->car->intv);
+  if (at < 0 || (!end_ok && (size_t)at == (*s)->slen))
+    error(msg);
+  return at;
+}
+
+// (str-char-offset str i) -> the byte offset of character i, for str-sub
+static Val *prim_str_char_offset(void *root, Val **env, Val **list) {
+  DEFINE1(root, s);
+  size_t at = str_char_args(root, env, list, s, true,
+                            "str-char-offset: index out of range");
+  return make_int(root, at);
+}
+
+// (str-char-at str i) -> character i of str as a string
+static Val *prim_str_char_at(void *root, Val **env, Val **list) {
+  DEFINE1(root, s);
+  size_t at = str_char_args(root, env, list, s, false,
+                            "str-char-at: index out of range");
+  const char *p = str_ptr(*s);
+  return make_slice(root, s, at, utf8_char_len(p + at, (*s)->slen - at));
+}
+
+// (str->codepoints str) -> the list of the code points of str, with 0xFFFD
+// for each invalid UTF-8 sequence
+static Val *prim_str_to_codepoints(void *root, Val **env, Val **list) {
+  DEFINE3(root, s, cp, cps);
+  *s = str_arg(root, env, list, "str->codepoints: expected a string");
+  *cps = Nil;
+  for (size_t i = 0; i < (*s)->slen;) {
+    uint32_t c;
+    int len = utf8_decode(str_ptr(*s) + i, (*s)->slen - i, &c);
+    if (len < 0) {
+      c = 0xFFFD;
+      len = -len;
     }
-    return apply_func(root, env, fn, eargs);
+    i += len;
+    *cp = make_int(root, c);
+    *cps = cons(root, cp, cps);
   }
-  error("apply: not supported");
+  return reverse(*cps);
 }
 
-// Expands the given macro application form.
-static Val *macroexpand(void *root, Val **env, Val **val) {
-  if ((*val)->type != TCELL ||
-      ((*val)->car->type != TSYM && (*val)->car->type != TMAC)) {
-    return *val;
-  }
-  DEFINE3(root, bind, macro, args);
-  if ((*val)->car->type == TMAC) {
-    *macro = (*val)->car;
-  } else {
-    *bind = env_get(env, (*val)->car);
-    if (!*bind || (*bind)->cdr->type != TMAC)
-      return *val;
-    *macro = (*bind)->cdr;
+// (codepoints->str list) -> the UTF-8 string of the code points in list
+static Val *prim_codepoints_to_str(void *root, Val **env, Val **list) {
+  char *msg = "codepoints->str: expected a list of code points";
+  DEFINE1(root, cps);
+  Val *args = eval_list(root, env, list);
+  if (length(args) != 1)
+    error(msg);
+  *cps = args->car;
+  char buf[4];
+  size_t len = 0;
+  for (Val *p = *cps; p != Nil; p = p->cdr) {
+    if (p->type != TCELL || p->car->type != TINT || p->car->intv < 0 ||
+        p->car->intv > 0x10FFFF ||
+        (p->car->intv >= 0xD800 && p->car->intv <= 0xDFFF))
+      error(msg);
+    len += u8_wc_toutf8(buf, p->car->intv);
   }
-  *args = (*val)->cdr;
-  return apply_func(root, env, macro, args);
+  Val *r = make_str_len(root, NULL, len);
+  char *out = r->strv;
+  for (Val *p = *cps; p != Nil; p = p->cdr)
+    out += u8_wc_toutf8(out, p->car->intv);
+  return r;
 }
 
-// Evaluates the S expression.
-static Val *eval(void *root, Val **env, Val **obj) {
-  switch ((*obj)->type) {
-  case TINT:
-  case TSTR:
-  case TOBJ:
-  case TPRI:
-  case TFUN:
-  case TMAC:
-  case TTRUE:
-  case TNIL:
-    // Self-evaluating objects
-    return *obj;
-  case TSYM: {
-    // Variable
-    if (*obj == intern(root, "*env*")) {
-      return *env;
-    }
-    Val *bind = env_get(env, *obj);
-    if (bind == NULL) {
-      // TODO clean up string messing
-      char *err_text = "eval: undefined symbol: ";
-      char *err_val = (*obj)->symv;
-      int err_text_len = strlen(err_text);
-      int err_val_len = strlen(err_val);
-      char err_buf[err_text_len + err_val_len + 1];
-      strncpy(err_buf, err_text, err_text_len);
-      strncpy(&err_buf[err_text_len], err_val, err_val_len);
-      err_buf[err_text_len + err_val_len] = '\0';
-      error(err_buf);
+// Maps the characters of str with f, leaving invalid bytes as they are.
+static Val *str_map_case(void *root, Val **s, uint32_t (*f)(uint32_t)) {
+  const char *p = str_ptr(*s);
+  size_t n = (*s)->slen, len = 0;
+  char buf[4];
+  uint32_t c;
+  if (ascii_len(p, n) == n) {
+    len = n;
+  } else {
+    for (size_t i = 0; i < n;) {
+      int l = utf8_decode(p + i, n - i, &c);
+      len += l < 0 ? -l : u8_wc_toutf8(buf, f(c));
+      i += l < 0 ? -l : l;
     }
-    return bind->cdr;
   }
-  case TCELL: {
-    // Function application form
-    DEFINE3(root, fn, expanded, args);
-    *expanded = macroexpand(root, env, obj);
-    if (*expanded != *obj)
-      return eval(root, env, expanded);
-    *fn = (*obj)->car;
-    *fn = eval(root, env, fn);
-    *args = (*obj)->cdr;
-    if ((*fn)->type != TPRI && (*fn)->type != TFUN) {
-      error("The head of a list must be a function");
+
+  Val *r = make_str_len(root, NULL, len);
+  p = str_ptr(*s);
+  char *out = r->strv;
+  for (size_t i = 0; i < n;) {
+    int l = utf8_decode(p + i, n - i, &c);
+    if (l < 0) {
+      memcpy(out, p + i, -l);
+      out += -l;
+      i += -l;
+    } else {
+      out += u8_wc_toutf8(out, f(c));
+      i += l;
     }
-    return apply(root, env, fn, args, true);
-  }
-  default:
-    // TODO append (*obj)->type
-    error("Bug: eval: Unknown tag type");
   }
+  return r;
+}
+
+// (str-upcase str)
+static Val *prim_str_upcase(void *root, Val **env, Val **list) {
+  DEFINE1(root, s);
+  *s = str_arg(root, env, list, "str-upcase: expected a string");
+  return str_map_case(root, s, char_upcase);
+}
+
+// (str-downcase str)
+static Val *prim_str_downcase(void *root, Val **env, Val **list) {
+  DEFINE1(root, s);
+  *s = str_arg(root, env, list, "str-downcase: expected a string");
+  return str_map_case(root, s, char_downcase);
 }
 
 // }}}
 
-// {{{ primitives
+// {{{ primitives: math
 
-// {{{ primitives: language
+static inline bool is_num(Val *v) { return is_int(v) || v->type == TFLOAT; }
 
-// (do body ...)
-static Val *prim_do(void *root, Val **env, Val **list) {
-  return progn(root, env, list);
+static double num_to_double(Val *v) {
+  if (v->type == TFLOAT)
+    return v->floatv;
+  if (v->type == TINT)
+    return (double)v->intv;
+  return mag_to_double(v->limbs, v->nlimbs, v->sign);
 }
 
-// (while cond expr ...)
-static Val *prim_while(void *root, Val **env, Val **list) {
-  if (length(*list) < 2)
-    error("Malformed while");
-  DEFINE2(root, cond, exprs);
-  *cond = (*list)->car;
-  while (eval(root, env, cond) != Nil) {
-    *exprs = (*list)->cdr;
-    eval_list(root, env, exprs);
+// Arithmetic stays on int64_t until an operation overflows or meets a bignum
+// or a float, then finishes on bignums, or on doubles once any float shows
+// up. The folds below apply op, one of '+', '-', '*' or '/', to acc and each
+// number in args in turn. Integer divisors must have been checked for 0.
+static Val *float_fold(void *root, double acc, Val *args, int op, char *err) {
+  for (; args != Nil; args = args->cdr) {
+    if (!is_num(args->car))
+      error(err);
+    double x = num_to_double(args->car);
+    if (op == '+')
+      acc += x;
+    else if (op == '-')
+      acc -= x;
+    else if (op == '*')
+      acc *= x;
+    else
+      acc /= x;
   }
-  return Nil;
+  return make_float(root, acc);
 }
 
-static Val *handle_function(void *root, Val **env, Val **list, int type) {
-  if ((*list)->type != TCELL ||
-      !(is_list((*list)->car) || (*list)->car->type == TSYM) ||
-      (*list)->cdr->type != TCELL) {
-    // TODO append pr_str(root, *list)
-    error("Malformed fn or macro");
+static Val *big_fold(void *root, Big acc, Val *args, int op, char *err) {
+  for (; args != Nil; args = args->cdr) {
+    if (args->car->type == TFLOAT) {
+      double d = mag_to_double(acc.d, acc.n, acc.sign);
+      big_free(&acc);
+      return float_fold(root, d, args, op, err);
+    }
+    if (!is_int(args->car)) {
+      big_free(&acc);
+      error(err);
+    }
+    Big x = big_from_val(args->car), r;
+    if (op == '*') {
+      r = big_mul(&acc, &x);
+    } else if (op == '/') {
+      Big rem;
+      big_divmod(&acc, &x, &r, &rem);
+      big_free(&rem);
+    } else {
+      r = big_add(&acc, &x, op == '-');
+    }
+    big_free(&acc);
+    big_free(&x);
+    acc = r;
   }
+  return make_big(root, &acc);
+}
 
-  DEFINE2(root, params, body);
-  *params = (*list)->car;
-  *body = (*list)->cdr;
-  Val *p = *params;
+// Continues a fold that left the int64_t fast path.
+static Val *num_fold(void *root, int64_t acc, Val *args, int op, char *err) {
+  if (args->car->type == TFLOAT)
+    return float_fold(root, (double)acc, args, op, err);
+  return big_fold(root, big_from_int(acc), args, op, err);
+}
 
-  // validate (arg0 arg1) or (arg0 . argN) forms
-  if (p->type != TSYM) { // but allow a single symbol to be params
-    for (; p->type == TCELL; p = p->cdr)
-      if (p->car->type != TSYM)
-        error("fn|macro: arg list must contain only symbols");
-    if (p != Nil && p->type != TSYM)
-      error("fn|macro: arg list must contain only symbols");
+// Compares the numbers x and y like strcmp(). Returns 2 if either is NaN.
+static int num_cmp(Val *x, Val *y) {
+  if (x->type == TINT && y->type == TINT)
+    return (x->intv > y->intv) - (x->intv < y->intv);
+  if (x->type == TFLOAT || y->type == TFLOAT) {
+    double a = num_to_double(x), b = num_to_double(y);
+    return a < b ? -1 : a > b ? 1 : a == b ? 0 : 2;
   }
+  Big a = big_from_val(x), b = big_from_val(y);
+  int c = big_cmp(&a, &b);
+  big_free(&a);
+  big_free(&b);
+  return c;
+}
 
-  return make_function(root, env, type, params, body);
+// (+ <number> ...)
+static Val *prim_plus(void *root, Val **env, Val **list) {
+  int64_t sum = 0, t;
+  for (Val *args = eval_list(root, env, list); args != Nil; args = args->cdr) {
+    Val *x = args->car;
+    if (x->type != TINT || __builtin_add_overflow(sum, x->intv, &t))
+      return num_fold(root, sum, args, '+', "+ takes only numbers");
+    sum = t;
+  }
+  return make_int(root, sum);
 }
 
-// (fn (<symbol> ...) expr ...)
-static Val *prim_fn(void *root, Val **env, Val **list) {
-  return handle_function(root, env, list, TFUN);
+// (- <number> ...)
+static Val *prim_minus(void *root, Val **env, Val **list) {
+  Val *args = eval_list(root, env, list);
+  if (args == Nil)
+    error("Malformed -");
+  Val *x = args->car;
+  if (!is_num(x))
+    error("- takes only numbers");
+  if (args->cdr == Nil) {
+    if (x->type == TFLOAT)
+      return make_float(root, -x->floatv);
+    if (x->type == TINT && x->intv != INT64_MIN)
+      return make_int(root, -x->intv);
+    return num_fold(root, 0, args, '-', "- takes only numbers");
+  }
+  if (x->type == TFLOAT)
+    return float_fold(root, x->floatv, args->cdr, '-', "- takes only numbers");
+  if (x->type == TBIG)
+    return big_fold(root, big_from_val(x), args->cdr, '-',
+                    "- takes only numbers");
+  int64_t r = x->intv, t;
+  for (Val *p = args->cdr; p != Nil; p = p->cdr) {
+    if (p->car->type != TINT || __builtin_sub_overflow(r, p->car->intv, &t))
+      return num_fold(root, r, p, '-', "- takes only numbers");
+    r = t;
+  }
+  return make_int(root, r);
 }
 
-// (macro (<symbol> ...) expr ...)
-static Val *prim_macro(void *root, Val **env, Val **list) {
-  return handle_function(root, env, list, TMAC);
+// (* <number> ...)
+static Val *prim_mul(void *root, Val **env, Val **list) {
+  int64_t prod = 1, t;
+  for (Val *args = eval_list(root, env, list); args != Nil; args = args->cdr) {
+    Val *x = args->car;
+    if (x->type != TINT || __builtin_mul_overflow(prod, x->intv, &t))
+      return num_fold(root, prod, args, '*', "* takes only numbers");
+    prod = t;
+  }
+  return make_int(root, prod);
 }
 
-// (def <symbol> expr)
-static Val *prim_def(void *root, Val **env, Val **list) {
-  if (length(*list) != 2 || (*list)->car->type != TSYM)
-    error("Malformed def");
-  DEFINE2(root, sym, value);
-  *sym = (*list)->car;
-  *value = (*list)->cdr->car;
-  *value = eval(root, env, value);
-  env_set(root, env, sym, value);
-  return *value;
+// (/ <number> <number> ...), integer division rounds towards zero
+static Val *prim_div(void *root, Val **env, Val **list) {
+  Val *args = eval_list(root, env, list);
+  if (length(args) < 2)
+    error("Malformed /");
+  for (Val *p = args; p != Nil; p = p->cdr) {
+    if (!is_num(p->car))
+      error("/ takes only numbers");
+    if (p != args && p->car->type == TINT && p->car->intv == 0)
+      error("/: division by zero");
+  }
+  Val *x = args->car;
+  if (x->type == TFLOAT)
+    return float_fold(root, x->floatv, args->cdr, '/', "");
+  if (x->type == TBIG)
+    return big_fold(root, big_from_val(x), args->cdr, '/', "");
+  int64_t q = x->intv;
+  for (Val *p = args->cdr; p != Nil; p = p->cdr) {
+    // INT64_MIN / -1 is the one quotient that overflows
+    if (p->car->type != TINT || (q == INT64_MIN && p->car->intv == -1))
+      return num_fold(root, q, p, '/', "");
+    q /= p->car->intv;
+  }
+  return make_int(root, q);
 }
 
-static Val *prim_def_global(void *root, Val **env, Val **list) {
-  if (length(*list) != 2 || (*list)->car->type != TSYM)
-    error("Malformed def-global");
-  DEFINE2(root, sym, value);
-  *sym = (*list)->car;
-  *value = (*list)->cdr->car;
-  *value = eval(root, env, value);
-  while ((*env)->proto != Nil) {
-    *env = (*env)->proto;
+// (mod <number> <number>), the result has the sign of the divisor
+static Val *prim_mod(void *root, Val **env, Val **list) {
+  Val *args = eval_list(root, env, list);
+  if (length(args) != 2)
+    error("Malformed mod");
+  Val *x = args->car;
+  Val *y = args->cdr->car;
+  if (!is_num(x) || !is_num(y))
+    error("mod takes only numbers");
+  if (y->type == TINT && y->intv == 0)
+    error("mod: division by zero");
+  if (x->type == TFLOAT || y->type == TFLOAT) {
+    double b = num_to_double(y), r = fmod(num_to_double(x), b);
+    if (r != 0 && (r < 0) != (b < 0))
+      r += b;
+    return make_float(root, r);
   }
-  env_set(root, env, sym, value);
-  return *value;
+  if (x->type == TINT && y->type == TINT) {
+    if (y->intv == -1)
+      return make_int(root, 0);
+    int64_t r = x->intv % y->intv;
+    if (r != 0 && (r < 0) != (y->intv < 0))
+      r += y->intv;
+    return make_int(root, r);
+  }
+  Big a = big_from_val(x), b = big_from_val(y), q, r;
+  big_divmod(&a, &b, &q, &r);
+  if (r.sign && r.sign != b.sign) {
+    Big t = big_add(&r, &b, false);
+    big_free(&r);
+    r = t;
+  }
+  big_free(&a);
+  big_free(&b);
+  big_free(&q);
+  return make_big(root, &r);
 }
 
-// (set <symbol> expr) or (set (: obj key) val)
-static Val *prim_set(void *root, Val **env, Val **list) {
-  DEFINE3(root, key, val, obj);
+// (< <number> <number>)
+static Val *prim_lt(void *root, Val **env, Val **list) {
+  Val *args = eval_list(root, env, list);
+  if (length(args) != 2)
+    error("malformed <");
+  Val *x = args->car;
+  Val *y = args->cdr->car;
+  if (!is_num(x) || !is_num(y))
+    error("< takes only numbers");
+  return num_cmp(x, y) < 0 ? True : Nil;
+}
+
+// (= <number> <number>)
+static Val *prim_num_eq(void *root, Val **env, Val **list) {
   if (length(*list) != 2)
-    error("Malformed set");
+    error("Malformed =");
+  Val *values = eval_list(root, env, list);
+  Val *x = values->car;
+  Val *y = values->cdr->car;
+  if (!is_num(x) || !is_num(y))
+    error("= only takes numbers");
+  return num_cmp(x, y) == 0 ? True : Nil;
+}
 
-  // Check for obj-set syntax (set (: obj key) val)
-  if ((*list)->car->type == TCELL && length((*list)->car) == 3 &&
-      (*list)->car->car->type == TSYM && (*list)->car->car->symv[0] == ':') {
-    *obj = (*list)->car->cdr->car;
-    *obj = eval(root, env, obj);
-    *key = (*list)->car->cdr->cdr->car;
-    *key = eval(root, env, key);
-    *val = (*list)->cdr->car;
-    *val = eval(root, env, val);
+// Evaluates the single argument of the math function name as a double.
+static double float_arg(void *root, Val **env, Val **list, char *err) {
+  if (length(*list) != 1)
+    error(err);
+  Val *x = eval_list(root, env, list)->car;
+  if (!is_num(x))
+    error(err);
+  return num_to_double(x);
+}
 
-    if ((*obj)->type != TOBJ)
-      error("set: (:) 1st arg is not an object");
-    if ((*key)->type != TSYM)
-      error("set: (:) 2nd arg is not a symbol");
+// (sqrt <number>)
+static Val *prim_sqrt(void *root, Val **env, Val **list) {
+  return make_float(root,
+                    sqrt(float_arg(root, env, list, "sqrt takes 1 number")));
+}
 
-    obj_set(root, obj, key, val);
-    return *obj;
-  }
+// (exp <number>)
+static Val *prim_exp(void *root, Val **env, Val **list) {
+  return make_float(root,
+                    exp(float_arg(root, env, list, "exp takes 1 number")));
+}
 
-  if ((*list)->car->type != TSYM)
-    error("Malformed set");
-  *key = env_get(env, (*list)->car);
-  if (!*key) {
-    // TODO append (*list)->car->symv
-    error("Unbound variable");
-  }
-  *val = (*list)->cdr->car;
-  *val = eval(root, env, val);
-  (*key)->cdr = *val;
-  return *val;
+// (log <number>)
+static Val *prim_log(void *root, Val **env, Val **list) {
+  return make_float(root,
+                    log(float_arg(root, env, list, "log takes 1 number")));
 }
 
-// (pr-str expr)
-static Val *prim_pr_str(void *root, Val **env, Val **list) {
-  DEFINE2(root, tmp, s);
-  *tmp = (*list)->car;
-  char *str = pr_str(root, eval(root, env, tmp));
-  *s = make_str(root, str);
-  return *s;
+// Rounds the single number argument to an integer with fn.
+static Val *round_arg(void *root, Val **env, Val **list, double (*fn)(double),
+                      char *err) {
+  if (length(*list) != 1)
+    error(err);
+  Val *x = eval_list(root, env, list)->car;
+  if (is_int(x))
+    return x;
+  if (x->type != TFLOAT)
+    error(err);
+  double d = fn(x->floatv);
+  if (!isfinite(d))
+    error("Can't round an infinite or NaN float to an integer");
+  if (d >= -9223372036854775808.0 && d < 9223372036854775808.0)
+    return make_int(root, (int64_t)d);
+  Big b = big_from_double(d);
+  return make_big(root, &b);
 }
 
-// (if expr expr expr ...)
-static Val *prim_if(void *root, Val **env, Val **list) {
-  if (length(*list) < 2)
-    error("Malformed if");
-  DEFINE3(root, cond, then, els);
-  *cond = (*list)->car;
-  *cond = eval(root, env, cond);
-  if (*cond != Nil) {
-    // Test succeded, return then branch and skip evaluatin else
-    *then = (*list)->cdr->car;
-    return eval(root, env, then);
-  }
-  *els = (*list)->cdr->cdr;
-  if (*els == Nil) {
-    // Return nil when else is missing
-    return Nil;
-  }
-  if ((*els)->cdr == Nil) {
-    // Return else value if it's last in args (if test then else)
-    *then = (*els)->car;
-    return eval(root, env, then);
-  }
-  // Re-enter if with else branch as start (if a ar b br ...)
-  return prim_if(root, env, els);
+// (floor <number>)
+static Val *prim_floor(void *root, Val **env, Val **list) {
+  return round_arg(root, env, list, floor, "floor takes 1 number");
+}
+
+// (ceil <number>)
+static Val *prim_ceil(void *root, Val **env, Val **list) {
+  return round_arg(root, env, list, ceil, "ceil takes 1 number");
 }
 
-// (eq? expr expr)
-static Val *prim_eq(void *root, Val **env, Val **list) {
-  if (length(*list) != 2)
-    error("eq?: needs exactly 2 arguments");
-  Val *values = eval_list(root, env, list);
-  if (obj_key_eq(values->car, values->cdr->car)) {
-    return True;
-  }
-  return values->car == values->cdr->car ? True : Nil;
+// (round <number>), halfway cases round away from zero
+static Val *prim_round(void *root, Val **env, Val **list) {
+  return round_arg(root, env, list, round, "round takes 1 number");
 }
 
-// (type expr)
-static Val *prim_type(void *root, Val **env, Val **list) {
+// (rand <integer>)
+static Val *prim_rand(void *root, Val **env, Val **list) {
   if (length(*list) != 1)
-    error("type: not given exactly 1 argument");
+    error("rand: takes exactly 1 argument");
   Val *values = eval_list(root, env, list);
+  Val *x = values->car;
+  if (x->type != TINT)
+    error("rand: 1st arg is not an int");
+  if (x->intv < 1 || x->intv > UINT32_MAX)
+    error("rand: 1st arg is out of range");
 
-  char *name;
+  return make_int(root, pcg32_boundedrand(values->car->intv));
+}
 
-  switch (values->car->type) {
-  case TTRUE:
-    name = "true";
-    break;
-  case TNIL:
-    name = "nil";
-    break;
-  case TINT:
-    name = "int";
-    break;
-  case TSTR:
-    name = "str";
-    break;
-  case TSYM:
-    name = "sym";
-    break;
-  case TOBJ:
-    name = "obj";
-    break;
-  case TPRI:
-    name = "prim";
-    break;
-  case TFUN:
-    name = "fn";
-    break;
-  case TMAC:
-    name = "macro";
-    break;
-  case TCELL:
-    if (values->car->cdr != Nil && values->car->cdr->type != TCELL) {
-      name = "cons";
-    } else {
-      name = "list";
-    }
-    break;
+// }}}
+
+// {{{ primitives: array
+
+static Val *make_array(void *root, int kind, size_t len) {
+  size_t size = offsetof(Val, adata) - offsetof(Val, car);
+  if (len > (MEMORY_SIZE - size) / array_elem_size[kind])
+    error("array: too many elements");
+  size += len * array_elem_size[kind];
+  Val *r = alloc(root, TARRAY, size);
+  r->akind = kind;
+  r->alen = len;
+  memset(r->adata, 0, len * array_elem_size[kind]);
+  return r;
+}
+
+static int array_kind(Val *sym, char *msg) {
+  if (sym->type == TSYM)
+    for (int k = ARR_I32; k <= ARR_F64; k++)
+      if (strcmp(sym->symv, array_kinds[k]) == 0)
+        return k;
+  error(msg);
+}
+
+static Val *array_args(void *root, Val **env, Val **list, int n, char *msg) {
+  if (length(*list) != n)
+    error(msg);
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TARRAY)
+    error(msg);
+  return args;
+}
+
+// Checks that the arrays a and b can be combined element by element.
+static void array_same_shape(Val *a, Val *b, char *msg) {
+  if (b->type != TARRAY || a->akind != b->akind || a->alen != b->alen)
+    error(msg);
+}
+
+static Val *make_int128(void *root, __int128 v) {
+  if (v >= INT64_MIN && v <= INT64_MAX)
+    return make_int(root, (int64_t)v);
+  unsigned __int128 m = v < 0 ? -(unsigned __int128)v : (unsigned __int128)v;
+  Big b = big_alloc(4);
+  for (int i = 0; i < 4; i++, m >>= 32)
+    b.d[i] = (uint32_t)m;
+  b.sign = v < 0 ? -1 : 1;
+  big_trim(&b);
+  return make_big(root, &b);
+}
+
+static Val *array_get(void *root, Val *a, size_t i) {
+  switch (a->akind) {
+  case ARR_I32:
+    return make_int(root, ((int32_t *)a->adata)[i]);
+  case ARR_I64:
+    return make_int(root, ((int64_t *)a->adata)[i]);
   default:
-    // TODO append values->car->type
-    error("type: unknown object type");
+    return make_float(root, ((double *)a->adata)[i]);
   }
+}
 
-  DEFINE1(root, k);
-  *k = intern(root, name);
-  return *k;
+static void array_put(Val *a, size_t i, Val *x, char *msg) {
+  if (a->akind == ARR_F64) {
+    if (!is_num(x))
+      error(msg);
+    ((double *)a->adata)[i] = num_to_double(x);
+  } else if (a->akind == ARR_I64) {
+    if (x->type != TINT)
+      error(msg);
+    ((int64_t *)a->adata)[i] = x->intv;
+  } else {
+    if (x->type != TINT || x->intv < INT32_MIN || x->intv > INT32_MAX)
+      error(msg);
+    ((int32_t *)a->adata)[i] = (int32_t)x->intv;
+  }
 }
 
-// (apply fn args)
-static Val *prim_apply(void *root, Val **env, Val **list) {
+// (make-array kind length), kind is one of i32, i64 or f64
+static Val *prim_make_array(void *root, Val **env, Val **list) {
   if (length(*list) != 2)
-    error("apply: not given exactly 2 args");
-  DEFINE2(root, fn, args);
-  *fn = (*list)->car;
-  *fn = eval(root, env, fn);
+    error("make-array: expected kind and length");
+  Val *args = eval_list(root, env, list);
+  int kind = array_kind(args->car, "make-array: unknown kind");
+  Val *len = args->cdr->car;
+  if (len->type != TINT || len->intv < 0)
+    error("make-array: bad length");
+  return make_array(root, kind, len->intv);
+}
 
-  *args = (*list)->cdr->car;
-  *args = eval(root, env, args);
-  if ((*args)->type != TCELL && *args != Nil)
-    error("apply: 2nd argument is not a list");
+// (list->array kind list)
+static Val *prim_list_to_array(void *root, Val **env, Val **list) {
+  if (length(*list) != 2)
+    error("list->array: expected kind and list");
+  DEFINE2(root, args, a);
+  *args = eval_list(root, env, list);
+  int kind = array_kind((*args)->car, "list->array: unknown kind");
+  int n = length((*args)->cdr->car);
+  if (n < 0)
+    error("list->array: expected a list");
+  *a = make_array(root, kind, n);
+  size_t i = 0;
+  for (Val *p = (*args)->cdr->car; p != Nil; p = p->cdr)
+    array_put(*a, i++, p->car, "list->array: element doesn't fit the kind");
+  return *a;
+}
 
-  return apply(root, env, fn, args, false);
+// (array->list array)
+static Val *prim_array_to_list(void *root, Val **env, Val **list) {
+  DEFINE3(root, a, ret, x);
+  *a = array_args(root, env, list, 1, "array->list: expected an array")->car;
+  *ret = Nil;
+  for (size_t i = (*a)->alen; i-- > 0;) {
+    *x = array_get(root, *a, i);
+    *ret = cons(root, x, ret);
+  }
+  return *ret;
 }
 
-// (eval expr)
-static Val *prim_eval(void *root, Val **env, Val **list) {
-  if (length(*list) != 1)
-    error("Malformed eval");
-  DEFINE1(root, arg);
-  *arg = (*list)->car;
-  *arg = eval(root, env, arg); // arg to ast
-  return eval(root, env, arg); // ast to value
+// (array-len array)
+static Val *prim_array_len(void *root, Val **env, Val **list) {
+  Val *args = array_args(root, env, list, 1, "array-len: expected an array");
+  return make_int(root, args->car->alen);
 }
 
-// (read-sexp str)
-static Val *prim_read_sexp(void *root, Val **env, Val **list) {
-  if (length(*list) != 1)
-    error("read-sexp: exactly 1 param required");
-  DEFINE4(root, str, expr, exprs, do_sym);
-  *str = (*list)->car;
-  *str = eval(root, env, str);
-  if ((*str)->type != TSTR)
-    error("read-sexp: 1st arg is not a string");
+// (array-ref array index)
+static Val *prim_array_ref(void *root, Val **env, Val **list) {
+  Val *args =
+      array_args(root, env, list, 2, "array-ref: expected array and index");
+  Val *a = args->car;
+  return array_get(
+      root, a,
+      vec_index(args->cdr->car, a->alen, "array-ref: index out of range"));
+}
 
-  Reader *r = reader_new((*str)->strv);
-  *exprs = Nil;
+// (array-set! array index number) -> number
+static Val *prim_array_set(void *root, Val **env, Val **list) {
+  Val *args = array_args(root, env, list, 3,
+                         "array-set!: expected array, index and number");
+  Val *a = args->car;
+  size_t i =
+      vec_index(args->cdr->car, a->alen, "array-set!: index out of range");
+  array_put(a, i, args->cdr->cdr->car,
+            "array-set!: value doesn't fit the array kind");
+  return args->cdr->cdr->car;
+}
 
-  for (;;) {
-    *expr = reader_expr(r, root);
-    if (!*expr) {
-      reader_destroy(r);
+// (array-sum array)
+static Val *prim_array_sum(void *root, Val **env, Val **list) {
+  Val *a = array_args(root, env, list, 1, "array-sum: expected an array")->car;
+  if (a->akind == ARR_F64)
+    return make_float(root, f64_sum((double *)a->adata, a->alen));
+  if (a->akind == ARR_I32)
+    return make_int(root, i32_sum((int32_t *)a->adata, a->alen));
+  __int128 s = 0;
+  for (size_t i = 0; i < a->alen; i++)
+    s += ((int64_t *)a->adata)[i];
+  return make_int128(root, s);
+}
 
-      // Finalize.
-      // For single expressions simply return it
-      // Wrap multiple expressions in a (do ...)
-      if (length(*exprs) == 1) {
-        return (*exprs)->car;
-      } else {
-        *do_sym = intern(root, "do");
-        *exprs = reverse(*exprs);
-        return cons(root, do_sym, exprs);
-      }
-    } else if (*expr == Cparen) {
-      reader_destroy(r);
-      error("Stray close parenthesis");
-    } else if (*expr == Ccurly) {
-      reader_destroy(r);
-      error("Stray close curly bracket");
-    } else if (*expr == Dot) {
-      reader_destroy(r);
-      error("Stray dot");
-    }
-    *exprs = cons(root, expr, exprs);
+static Val *array_minmax(void *root, Val **env, Val **list, bool max,
+                         char *msg) {
+  Val *a = array_args(root, env, list, 1, msg)->car;
+  if (a->alen == 0)
+    error(msg);
+  if (a->akind == ARR_F64) {
+    double lo, hi;
+    f64_minmax((double *)a->adata, a->alen, &lo, &hi);
+    return make_float(root, max ? hi : lo);
   }
+  int64_t lo, hi;
+  if (a->akind == ARR_I32)
+    i32_minmax((int32_t *)a->adata, a->alen, &lo, &hi);
+  else
+    i64_minmax((int64_t *)a->adata, a->alen, &lo, &hi);
+  return make_int(root, max ? hi : lo);
 }
 
-// (sym str)
-static Val *prim_sym(void *root, Val **env, Val **list) {
-  if (length(*list) != 1)
-    error("sym: exactly 1 param required");
-  DEFINE1(root, str);
-  *str = (*list)->car;
-  *str = eval(root, env, str);
-  if ((*str)->type != TSTR)
-    error("sym: 1st arg is not a string");
+// (array-min array)
+static Val *prim_array_min(void *root, Val **env, Val **list) {
+  return array_minmax(root, env, list, false,
+                      "array-min: expected a non-empty array");
+}
 
-  return intern(root, (*str)->strv);
+// (array-max array)
+static Val *prim_array_max(void *root, Val **env, Val **list) {
+  return array_minmax(root, env, list, true,
+                      "array-max: expected a non-empty array");
 }
 
-// }}}
+// (array-dot array array)
+static Val *prim_array_dot(void *root, Val **env, Val **list) {
+  Val *args =
+      array_args(root, env, list, 2, "array-dot: expected two arrays");
+  Val *a = args->car, *b = args->cdr->car;
+  array_same_shape(a, b, "array-dot: arrays differ in kind or length");
+  if (a->akind == ARR_F64)
+    return make_float(
+        root, f64_dot((double *)a->adata, (double *)b->adata, a->alen));
+  __int128 s = 0;
+  for (size_t i = 0; i < a->alen; i++) {
+    if (a->akind == ARR_I32)
+      s += (int64_t)((int32_t *)a->adata)[i] * ((int32_t *)b->adata)[i];
+    else
+      s += (__int128)((int64_t *)a->adata)[i] * ((int64_t *)b->adata)[i];
+  }
+  return make_int128(root, s);
+}
 
-// {{{ primitives: marco
+// Returns a new array with the element-wise sum, or product, of two arrays.
+static Val *array_map2(void *root, Val **env, Val **list, bool mul,
+                       char *msg) {
+  DEFINE2(root, a, b);
+  Val *args = array_args(root, env, list, 2, msg);
+  *a = args->car;
+  *b = args->cdr->car;
+  array_same_shape(*a, *b, msg);
+  Val *r = make_array(root, (*a)->akind, (*a)->alen);
+  size_t n = r->alen;
+  if (r->akind == ARR_F64)
+    f64_map2((double *)r->adata, (double *)(*a)->adata,
+             (double *)(*b)->adata, n, mul);
+  else if (r->akind == ARR_I32)
+    i32_map2((int32_t *)r->adata, (int32_t *)(*a)->adata,
+             (int32_t *)(*b)->adata, n, mul);
+  else
+    i64_map2((int64_t *)r->adata, (int64_t *)(*a)->adata,
+             (int64_t *)(*b)->adata, n, mul);
+  return r;
+}
 
-// (quote expr)
-static Val *prim_quote(void *root, Val **env, Val **list) {
-  (void)root;
-  (void)env;
-  if (length(*list) != 1)
-    error("Malformed quote");
-  return (*list)->car;
+// (array-add array array)
+static Val *prim_array_add(void *root, Val **env, Val **list) {
+  return array_map2(root, env, list, false,
+                    "array-add: expected two arrays of the same kind and "
+                    "length");
 }
 
-// (macro-expand expr)
-static Val *prim_macro_expand(void *root, Val **env, Val **list) {
-  if (length(*list) != 1)
-    error("Malformed macro-expand");
-  DEFINE1(root, body);
-  *body = (*list)->car;
-  *body = eval(root, env, body);
-  return macroexpand(root, env, body);
+// (array-mul array array)
+static Val *prim_array_mul(void *root, Val **env, Val **list) {
+  return array_map2(root, env, list, true,
+                    "array-mul: expected two arrays of the same kind and "
+                    "length");
 }
 
-// (gensym)
-static Val *prim_gensym(void *root, Val **env, Val **list) {
-  (void)env;
-  (void)list;
-  static int count = 0;
-  char buf[16];
-  snprintf(buf, sizeof(buf), "G__%d", count++);
-  return make_symbol(root, buf);
+// (array-prefix-sum array) -> array of the running totals
+static Val *prim_array_prefix_sum(void *root, Val **env, Val **list) {
+  DEFINE1(root, a);
+  *a = array_args(root, env, list, 1, "array-prefix-sum: expected an array")
+           ->car;
+  Val *r = make_array(root, (*a)->akind, (*a)->alen);
+  size_t n = r->alen;
+  if (r->akind == ARR_F64) {
+    double s = 0, *src = (double *)(*a)->adata, *dst = (double *)r->adata;
+    for (size_t i = 0; i < n; i++)
+      dst[i] = s += src[i];
+  } else if (r->akind == ARR_I32) {
+    uint32_t s = 0;
+    int32_t *src = (int32_t *)(*a)->adata, *dst = (int32_t *)r->adata;
+    for (size_t i = 0; i < n; i++)
+      dst[i] = (int32_t)(s += (uint32_t)src[i]);
+  } else {
+    uint64_t s = 0;
+    int64_t *src = (int64_t *)(*a)->adata, *dst = (int64_t *)r->adata;
+    for (size_t i = 0; i < n; i++)
+      dst[i] = (int64_t)(s += (uint64_t)src[i]);
+  }
+  return r;
+}
+
+// (array-histogram array lo hi nbins) -> i64 array of counts. Bin k counts
+// the elements in [lo + k * width, lo + (k + 1) * width), elements outside
+// [lo, hi) are not counted.
+static Val *prim_array_histogram(void *root, Val **env, Val **list) {
+  char *msg = "array-histogram: expected array, lo, hi and bin count";
+  DEFINE1(root, a);
+  Val *args = array_args(root, env, list, 4, msg);
+  *a = args->car;
+  Val *lo_v = args->cdr->car, *hi_v = args->cdr->cdr->car;
+  Val *nbins_v = args->cdr->cdr->cdr->car;
+  if (!is_num(lo_v) || !is_num(hi_v) || nbins_v->type != TINT ||
+      nbins_v->intv < 1)
+    error(msg);
+  double lo = num_to_double(lo_v), hi = num_to_double(hi_v);
+  if (!(lo < hi))
+    error("array-histogram: lo must be below hi");
+  size_t nbins = nbins_v->intv;
+  double scale = nbins / (hi - lo);
+
+  Val *r = make_array(root, ARR_I64, nbins);
+  int64_t *counts = (int64_t *)r->adata;
+  for (size_t i = 0; i < (*a)->alen; i++) {
+    double x = (*a)->akind == ARR_F64   ? ((double *)(*a)->adata)[i]
+               : (*a)->akind == ARR_I32 ? ((int32_t *)(*a)->adata)[i]
+                                        : ((int64_t *)(*a)->adata)[i];
+    if (x >= lo && x < hi) {
+      size_t k = (size_t)((x - lo) * scale);
+      counts[k < nbins ? k : nbins - 1]++;
+    }
+  }
+  return r;
 }
 
 // }}}
 
-// {{{ primitives: object
+// {{{ primitives: bytes
 
-// (obj proto props) ; nil|obj -> alist -> obj
-static Val *prim_obj(void *root, Val **env, Val **list) {
-  // We have 2 args?
-  if (length(*list) != 2) {
-    error("obj: expected exactly 2 args");
-  }
+static Val *make_bytes(void *root, size_t len) {
+  size_t size = offsetof(Val, bdata) - offsetof(Val, car);
+  if (len > MEMORY_SIZE - size)
+    error("bytes: too long");
+  Val *r = alloc(root, TBYTES, size + len);
+  r->blen = len;
+  memset(r->bdata, 0, len);
+  return r;
+}
 
-  // 1st arg is nil or an object?
+static Val *bytes_args(void *root, Val **env, Val **list, int min, int max,
+                       char *msg) {
+  int n = length(*list);
+  if (n < min || n > max)
+    error(msg);
   Val *args = eval_list(root, env, list);
-  if (args->car->type != TOBJ && args->car != Nil) {
-    error("obj: given non object or nil as prototype");
+  if (args->car->type != TBYTES)
+    error(msg);
+  return args;
+}
+
+// Reads the optional [start [end]] arguments in args, which default to the
+// whole of a buffer of length len.
+static void bytes_range(Val *args, size_t len, size_t *start, size_t *end,
+                        char *msg) {
+  *start = 0;
+  *end = len;
+  if (args != Nil) {
+    *start = vec_index(args->car, len + 1, msg);
+    args = args->cdr;
   }
+  if (args != Nil)
+    *end = vec_index(args->car, len + 1, msg);
+  if (*end < *start)
+    error(msg);
+}
 
-  // 2nd arg is a list?
-  if (args->cdr->car->type != TCELL && args->cdr->car != Nil) {
-    error("obj: given non alist as properties");
+// Parses a field type such as u8, u16le or u64be into its width in bytes,
+// and whether it is big endian.
+static size_t bytes_field(Val *type, bool *big_endian, char *msg) {
+  if (type->type != TSYM || type->symv[0] != 'u')
+    error(msg);
+  char *end;
+  long bits = strtol(type->symv + 1, &end, 10);
+  if (bits == 8 && *end == '\0') {
+    *big_endian = false;
+    return 1;
   }
+  if ((bits != 16 && bits != 32 && bits != 64) ||
+      (strcmp(end, "le") != 0 && strcmp(end, "be") != 0))
+    error(msg);
+  *big_endian = end[0] == 'b';
+  return bits / 8;
+}
 
-  // 2nd arg is an association list
-  for (Val *i = args->cdr->car; i != Nil; i = i->cdr) {
-    if (i->type != TCELL || i->car->cdr == Nil) {
-      error("obj: given non alist as properties");
-    } else if (i->car->car->type != TSYM) {
-      error("obj: given non symbol as property key");
-    }
+// (make-bytes length)
+static Val *prim_make_bytes(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("make-bytes: expected a length");
+  Val *len = eval_list(root, env, list)->car;
+  if (len->type != TINT || len->intv < 0)
+    error("make-bytes: expected a length");
+  return make_bytes(root, len->intv);
+}
+
+// (bytes-len bytes)
+static Val *prim_bytes_len(void *root, Val **env, Val **list) {
+  Val *args = bytes_args(root, env, list, 1, 1, "bytes-len: expected bytes");
+  return make_int(root, args->car->blen);
+}
+
+// (bytes-slice bytes start [end]) -> a copy of the bytes in [start, end)
+static Val *prim_bytes_slice(void *root, Val **env, Val **list) {
+  char *msg = "bytes-slice: expected bytes, start and optional end in range";
+  DEFINE1(root, b);
+  Val *args = bytes_args(root, env, list, 2, 3, msg);
+  *b = args->car;
+  size_t start, end;
+  bytes_range(args->cdr, (*b)->blen, &start, &end, msg);
+  Val *r = make_bytes(root, end - start);
+  memcpy(r->bdata, (*b)->bdata + start, end - start);
+  return r;
+}
+
+// (bytes-ref bytes offset type) -> the unsigned integer of the given type,
+// one of u8, u16le, u16be, u32le, u32be, u64le or u64be, at offset
+static Val *prim_bytes_ref(void *root, Val **env, Val **list) {
+  char *msg = "bytes-ref: expected bytes, offset and field type";
+  Val *args = bytes_args(root, env, list, 3, 3, msg);
+  Val *b = args->car;
+  bool be;
+  size_t width = bytes_field(args->cdr->cdr->car, &be, msg);
+  char *range = "bytes-ref: offset out of range";
+  if (b->blen < width)
+    error(range);
+  size_t off = vec_index(args->cdr->car, b->blen - width + 1, range);
+  uint64_t v = 0;
+  for (size_t i = 0; i < width; i++)
+    v |= (uint64_t)b->bdata[off + (be ? width - 1 - i : i)] << (8 * i);
+  return make_int128(root, v);
+}
+
+// (bytes-set! bytes offset type value) -> value
+static Val *prim_bytes_set(void *root, Val **env, Val **list) {
+  char *msg = "bytes-set!: expected bytes, offset, field type and value";
+  Val *args = bytes_args(root, env, list, 4, 4, msg);
+  Val *b = args->car;
+  Val *x = args->cdr->cdr->cdr->car;
+  bool be;
+  size_t width = bytes_field(args->cdr->cdr->car, &be, msg);
+  char *range = "bytes-set!: offset out of range";
+  if (b->blen < width)
+    error(range);
+  size_t off = vec_index(args->cdr->car, b->blen - width + 1, range);
+  uint64_t v;
+  if (x->type == TINT && x->intv >= 0) {
+    v = x->intv;
+  } else if (x->type == TBIG && x->sign > 0 && x->nlimbs == 2) {
+    v = x->limbs[0] | (uint64_t)x->limbs[1] << 32;
+  } else {
+    error("bytes-set!: value out of range");
   }
+  if (width < 8 && v >> (8 * width))
+    error("bytes-set!: value out of range");
+  for (size_t i = 0; i < width; i++)
+    b->bdata[off + (be ? width - 1 - i : i)] = (uint8_t)(v >> (8 * i));
+  return x;
+}
 
-  DEFINE3(root, obj, proto, props);
-  *proto = args->car;
-  *props = args->cdr->car;
+// (str->bytes str)
+static Val *prim_str_to_bytes(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("str->bytes: expected a string");
+  DEFINE1(root, s);
+  *s = eval_list(root, env, list)->car;
+  if (!is_str(*s))
+    error("str->bytes: expected a string");
+  Val *r = make_bytes(root, (*s)->slen);
+  memcpy(r->bdata, str_ptr(*s), (*s)->slen);
+  return r;
+}
 
-  *obj = make_obj_alist(root, proto, props);
-  return *obj;
+// (bytes->str bytes [start [end]])
+static Val *prim_bytes_to_str(void *root, Val **env, Val **list) {
+  char *msg = "bytes->str: expected bytes and optional range";
+  DEFINE1(root, b);
+  Val *args = bytes_args(root, env, list, 1, 3, msg);
+  *b = args->car;
+  size_t start, end;
+  bytes_range(args->cdr, (*b)->blen, &start, &end, msg);
+  Val *r = make_str_len(root, NULL, end - start);
+  memcpy(r->strv, (*b)->bdata + start, end - start);
+  return r;
 }
 
-static Val *prim_obj_get(void *root, Val **env, Val **list) {
-  if (length(*list) != 2)
-    error("obj-get: expected exactly 2 args");
-  Val *args = eval_list(root, env, list);
-  if (args->car->type != TOBJ)
-    error("obj-get: expected 1st argument to be object");
-  if (args->cdr->car->type != TSYM)
-    error("obj-get: expected 2nd argument to be symbol");
+// }}}
 
-  DEFINE3(root, o, k, value);
-  *o = args->car;
-  *k = args->cdr->car;
-  *value = obj_find(*o, *k);
-  if (*value == NULL) {
-    // TODO append args->cdr->car->symv
-    error("obj-get: unbound symbol");
+// {{{ primitives: string builder
+
+// A string builder accumulates bytes in a TBYTES store that doubles when it
+// fills up, so building a string piece by piece takes linear time instead of
+// copying everything built so far on every (str acc piece).
+
+// Makes an empty string builder with room for cap bytes.
+static Val *make_sb(void *root, size_t cap) {
+  DEFINE1(root, buf);
+  *buf = make_bytes(root, cap > 0 ? cap : 16);
+  Val *r = alloc(root, TSB, sizeof(Val *) + sizeof(size_t));
+  r->buf = *buf;
+  r->len = 0;
+  return r;
+}
+
+// Makes room for n more bytes in the string builder.
+static void sb_reserve(void *root, Val **sb, size_t n) {
+  Val *buf = (*sb)->buf;
+  if ((*sb)->len + n <= buf->blen)
+    return;
+  size_t cap = buf->blen * 2;
+  if (cap < (*sb)->len + n)
+    cap = (*sb)->len + n;
+  buf = make_bytes(root, cap);
+  memcpy(buf->bdata, (*sb)->buf->bdata, (*sb)->len);
+  (*sb)->buf = buf;
+  write_barrier(&(*sb)->buf);
+}
+
+// Appends the n bytes at off in str to the string builder.
+static void sb_append_str(void *root, Val **sb, Val **str, size_t off,
+                          size_t n) {
+  sb_reserve(root, sb, n);
+  memcpy((*sb)->buf->bdata + (*sb)->len, str_ptr(*str) + off, n);
+  (*sb)->len += n;
+}
+
+// (sb-new [cap])
+static Val *prim_sb_new(void *root, Val **env, Val **list) {
+  Val *args = eval_list(root, env, list);
+  size_t cap = 0;
+  if (args != Nil) {
+    if (args->cdr != Nil || args->car->type != TINT || args->car->intv < 0)
+      error("sb-new: expected an optional capacity");
+    cap = args->car->intv;
+  }
+  return make_sb(root, cap);
+}
+
+// (sb-append! sb str ...) -> sb
+static Val *prim_sb_append(void *root, Val **env, Val **list) {
+  DEFINE2(root, args, sb);
+  *args = eval_list(root, env, list);
+  if (*args == Nil || (*args)->car->type != TSB)
+    error("sb-append!: 1st arg is not a string builder");
+  *sb = (*args)->car;
+  size_t n = 0;
+  for (Val *a = (*args)->cdr; a != Nil; a = a->cdr) {
+    if (!is_str(a->car))
+      error("sb-append!: argument not a string");
+    n += a->car->slen;
   }
 
-  return (*value)->cdr;
+  sb_reserve(root, sb, n);
+  for (Val *a = (*args)->cdr; a != Nil; a = a->cdr) {
+    memcpy((*sb)->buf->bdata + (*sb)->len, str_ptr(a->car), a->car->slen);
+    (*sb)->len += a->car->slen;
+  }
+  return *sb;
 }
 
-static Val *prim_obj_set(void *root, Val **env, Val **list) {
-  if (length(*list) != 3)
-    error("obj-set: expected exactly 3 args");
+// (sb-len sb)
+static Val *prim_sb_len(void *root, Val **env, Val **list) {
   Val *args = eval_list(root, env, list);
-  if (args->car->type != TOBJ)
-    error("obj-set: expected 1st argument to be object");
-  if (!obj_valid_key(args->cdr->car))
-    error("obj-set: expected 2nd argument to be valid object key");
-
-  DEFINE3(root, obj, key, val);
-  *obj = args->car;
-  *key = args->cdr->car;
-  *val = args->cdr->cdr->car;
-  obj_set(root, obj, key, val);
-
-  return *obj;
+  if (length(args) != 1 || args->car->type != TSB)
+    error("sb-len: 1st arg is not a string builder");
+  return make_int(root, args->car->len);
 }
 
-static Val *prim_obj_del(void *root, Val **env, Val **list) {
-  if (length(*list) != 2)
-    error("obj-del: expected exactly 2 args");
+// (sb->str sb)
+static Val *prim_sb_to_str(void *root, Val **env, Val **list) {
+  DEFINE1(root, sb);
   Val *args = eval_list(root, env, list);
-  if (args->car->type != TOBJ)
-    error("obj-del: expected 1st argument to be object");
-  if (obj_valid_key(args->cdr->car))
-    error("obj-del: expected 2nd argument to be valid object key");
+  if (length(args) != 1 || args->car->type != TSB)
+    error("sb->str: 1st arg is not a string builder");
+  *sb = args->car;
+  Val *r = make_str_len(root, NULL, (*sb)->len);
+  memcpy(r->strv, (*sb)->buf->bdata, (*sb)->len);
+  return r;
+}
 
-  Val *obj = args->car;
-  Val *key = args->cdr->car;
-  obj_del(obj, key);
+// }}}
 
-  return obj;
+// {{{ primitives: regex
+
+// Primitives take a compiled regex or a pattern string, which are both
+// looked up in the regex cache by pattern.
+static Val *re_pattern(Val *re, char *msg) {
+  if (re->type == TREGEX)
+    return re->pattern;
+  if (!is_str(re))
+    error(msg);
+  return re;
 }
 
-static Val *prim_obj_proto(void *root, Val **env, Val **list) {
-  if (length(*list) != 1)
-    error("obj-proto: expected exactly 1 args");
-  Val *args = eval_list(root, env, list);
-  if (args->car->type != TOBJ)
-    error("obj-proto: expected 1st argument to be object");
+// Makes the list of the match in caps and its groups, nil for those that did
+// not take part, as slices of str.
+static Val *re_groups(void *root, Val **str, ptrdiff_t *caps, int ncaps) {
+  DEFINE2(root, part, parts);
+  *parts = Nil;
+  for (int i = ncaps - 2; i >= 0; i -= 2) {
+    *part = caps[i] < 0 ? Nil
+                        : make_slice(root, str, caps[i], caps[i + 1] - caps[i]);
+    *parts = cons(root, part, parts);
+  }
+  return *parts;
+}
 
-  return args->car->proto;
+// Returns where to look for the next match after the one in caps, one
+// character further when it is empty.
+static size_t re_next(Val *str, ptrdiff_t *caps) {
+  size_t i = caps[1];
+  if (caps[0] == caps[1]) {
+    const char *p = str_ptr(str);
+    for (i++; i < str->slen && ((unsigned char)p[i] & 0xC0) == 0x80; i++)
+      ;
+  }
+  return i;
 }
 
-static Val *prim_obj_proto_set(void *root, Val **env, Val **list) {
-  if (length(*list) != 2)
-    error("obj-proto-set!: expected exactly 2 args");
+// (re-compile pattern) -> regex
+static Val *prim_re_compile(void *root, Val **env, Val **list) {
+  DEFINE1(root, pattern);
   Val *args = eval_list(root, env, list);
-  if (args->car->type != TOBJ)
-    error("obj-proto-set!: expected 1st argument to be object");
+  if (length(args) != 1 || !is_str(args->car))
+    error("re-compile: expected a pattern string");
+  *pattern = args->car;
+  re_get(*pattern);
+  Val *r = alloc(root, TREGEX, sizeof(Val *));
+  r->pattern = *pattern;
+  return r;
+}
 
-  args->car->proto = args->cdr->car;
-  return args->car;
+// (re-match re str [start]) -> the list of the leftmost match at or after
+// start and its groups, or nil
+static Val *prim_re_match(void *root, Val **env, Val **list) {
+  char *msg = "re-match: expected a regex, a string and optional start";
+  DEFINE1(root, s);
+  Val *args = eval_list(root, env, list);
+  int n = length(args);
+  if (n < 2 || n > 3 || !is_str(args->cdr->car))
+    error(msg);
+  Regex *re = re_get(re_pattern(args->car, msg));
+  *s = args->cdr->car;
+  size_t start = 0;
+  if (n == 3)
+    start = vec_index(args->cdr->cdr->car, (*s)->slen + 1, msg);
+  int ncaps = 2 * (re->ngroups + 1);
+  ptrdiff_t caps[ncaps];
+  if (!re_exec(re, str_ptr(*s), (*s)->slen, start, caps, ncaps))
+    return Nil;
+  return re_groups(root, s, caps, ncaps);
 }
 
-static Val *prim_obj_to_alist(void *root, Val **env, Val **list) {
-  if (length(*list) != 1)
-    error("obj->alist: expected exactly 1 arg");
+// (re-find-all re str) -> the list of the matches in str that do not overlap
+static Val *prim_re_find_all(void *root, Val **env, Val **list) {
+  char *msg = "re-find-all: expected a regex and a string";
+  DEFINE3(root, s, part, parts);
   Val *args = eval_list(root, env, list);
-  if (args->car->type != TOBJ)
-    error("obj->alist: expected 1st argument to be object");
+  if (length(args) != 2 || !is_str(args->cdr->car))
+    error(msg);
+  Regex *re = re_get(re_pattern(args->car, msg));
+  *s = args->cdr->car;
+  *parts = Nil;
+  ptrdiff_t caps[2];
+  for (size_t i = 0; i <= (*s)->slen; i = re_next(*s, caps)) {
+    if (!re_exec(re, str_ptr(*s), (*s)->slen, i, caps, 2))
+      break;
+    *part = make_slice(root, s, caps[0], caps[1] - caps[0]);
+    *parts = cons(root, part, parts);
+  }
+  return reverse(*parts);
+}
 
-  DEFINE2(root, alist, pair);
-  *alist = Nil;
+// Appends the replacement template to sb, with \0 to \9 standing for the
+// match and its groups in caps and \\ for a backslash.
+static void re_expand(void *root, Val **sb, Val **rep, Val **s,
+                      ptrdiff_t *caps) {
+  for (size_t i = 0; i < (*rep)->slen;) {
+    const char *r = str_ptr(*rep);
+    size_t j = i;
+    while (j < (*rep)->slen && r[j] != '\\')
+      j++;
+    sb_append_str(root, sb, rep, i, j - i);
+    if (j == (*rep)->slen)
+      break;
+    char c = str_ptr(*rep)[j + 1];
+    if (c == '\\') {
+      sb_append_str(root, sb, rep, j + 1, 1);
+    } else if (caps[(c - '0') * 2] >= 0) {
+      ptrdiff_t *g = &caps[(c - '0') * 2];
+      sb_append_str(root, sb, s, g[0], g[1] - g[0]);
+    }
+    i = j + 2;
+  }
+}
 
-  for (size_t i = 0; i < OBJ_HM_SIZE; i++) {
-    for (Val *l = args->car->props[i]; l != Nil; l = l->cdr) {
-      *pair = l->car;
-      *alist = cons(root, pair, alist);
+// (re-replace re str rep) -> str with every match replaced by rep, a template
+// where \0 to \9 are the match and its groups, or a function called with the
+// list of the match and its groups that returns the replacement
+static Val *prim_re_replace(void *root, Val **env, Val **list) {
+  char *msg = "re-replace: expected a regex, a string and a replacement";
+  DEFINE6(root, args, pattern, s, rep, sb, fnargs);
+  *args = eval_list(root, env, list);
+  if (length(*args) != 3 || !is_str((*args)->cdr->car))
+    error(msg);
+  *pattern = re_pattern((*args)->car, msg);
+  *s = (*args)->cdr->car;
+  *rep = (*args)->cdr->cdr->car;
+  Regex *re = re_get(*pattern);
+  int ncaps = 2 * (re->ngroups + 1);
+  if ((*rep)->type != TFUN) {
+    if (!is_str(*rep))
+      error(msg);
+    // Only place the groups if the template refers to them
+    int refs = 0;
+    const char *r = str_ptr(*rep);
+    for (size_t i = 0; i < (*rep)->slen; i++) {
+      if (r[i] != '\\')
+        continue;
+      if (++i == (*rep)->slen ||
+          (r[i] != '\\' && !isdigit((unsigned char)r[i])))
+        error("re-replace: bad escape in replacement");
+      if (isdigit((unsigned char)r[i]) && r[i] - '0' >= refs)
+        refs = r[i] - '0' + 1;
     }
+    if (refs > re->ngroups + 1)
+      error("re-replace: no such group");
+    if (refs <= 1)
+      ncaps = 2;
   }
 
-  return *alist;
+  ptrdiff_t caps[2 * (re->ngroups + 1)];
+  size_t copied = 0;
+  *sb = make_sb(root, (*s)->slen);
+  for (size_t i = 0; i <= (*s)->slen; i = re_next(*s, caps)) {
+    // Calls may have evicted the program from the cache
+    re = re_get(*pattern);
+    if (!re_exec(re, str_ptr(*s), (*s)->slen, i, caps, ncaps))
+      break;
+    sb_append_str(root, sb, s, copied, caps[0] - copied);
+    copied = caps[1];
+    if ((*rep)->type != TFUN) {
+      re_expand(root, sb, rep, s, caps);
+      continue;
+    }
+    *fnargs = re_groups(root, s, caps, ncaps);
+    *fnargs = cons(root, fnargs, &Nil);
+    *fnargs = apply_func(root, env, rep, fnargs);
+    if (!is_str(*fnargs))
+      error("re-replace: replacement is not a string");
+    sb_append_str(root, sb, fnargs, 0, (*fnargs)->slen);
+  }
+  if (copied == 0 && (*sb)->len == 0)
+    return *s;
+  sb_append_str(root, sb, s, copied, (*s)->slen - copied);
+  Val *r = make_str_len(root, NULL, (*sb)->len);
+  memcpy(r->strv, (*sb)->buf->bdata, (*sb)->len);
+  return r;
 }
 
 // }}}
 
-// {{{ primitives: list
+// {{{ primitives: json
 
-// (cons expr expr)
-static Val *prim_cons(void *root, Val **env, Val **list) {
-  if (length(*list) != 2)
-    error("Malformed cons");
-  Val *cell = eval_list(root, env, list);
-  cell->cdr = cell->cdr->car;
-  return cell;
+// JSON objects parse to objects keyed by strings, arrays to vectors, true to
+// t, and false and null to nil. Numbers without a fraction or exponent are
+// ints, or bignums when they do not fit, and the others floats. Written out,
+// lists and vectors are arrays, symbols strings, and nil is null, which every
+// JSON field type accepts where false would only fit booleans.
+
+#define JSON_MAX_DEPTH 512
+
+// Stream scanner states, see json_scan
+enum { JSON_IN_STR = 1, JSON_ESCAPE = 2, JSON_IN_SCALAR = 4 };
+
+// Most bytes of JSON text are in strings and need no unescaping or escaping,
+// so the parser, the stream scanner and the writer all skip them a vector at a
+// time, up to the next quote, backslash or control character.
+static size_t json_plain_len_scalar(const char *p, size_t n) {
+  size_t i = 0;
+  while (i < n && p[i] != '"' && p[i] != '\\' && (unsigned char)p[i] >= 0x20)
+    i++;
+  return i;
 }
 
-// (car <cell>)
-static Val *prim_car(void *root, Val **env, Val **list) {
-  Val *args = eval_list(root, env, list);
-  if (args->car->type != TCELL || args->cdr != Nil)
-    error("Malformed car");
-  return args->car->car;
+#ifdef X86_SIMD
+// Control characters are the bytes that an unsigned min with 0x1F leaves as
+// they are
+static size_t json_plain_len_sse2(const char *p, size_t n) {
+  __m128i quote = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\'),
+          ctl = _mm_set1_epi8(0x1F);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs)),
+        _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v));
+    int bits = _mm_movemask_epi8(m);
+    if (bits)
+      return i + __builtin_ctz(bits);
+  }
+  return i + json_plain_len_scalar(p + i, n - i);
 }
 
-// (cdr <cell>)
-static Val *prim_cdr(void *root, Val **env, Val **list) {
-  Val *args = eval_list(root, env, list);
-  if (args->car->type != TCELL || args->cdr != Nil)
-    error("Malformed cdr");
-  return args->car->cdr;
+AVX2 static size_t json_plain_len_avx2(const char *p, size_t n) {
+  __m256i quote = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\'),
+          ctl = _mm256_set1_epi8(0x1F);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                        _mm256_cmpeq_epi8(v, bs)),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v));
+    uint32_t bits = _mm256_movemask_epi8(m);
+    if (bits)
+      return i + __builtin_ctz(bits);
+  }
+  return i + json_plain_len_scalar(p + i, n - i);
+}
+#endif
+
+// Returns the number of leading bytes in the n bytes at p that are neither a
+// quote, a backslash nor a control character.
+static size_t json_plain_len(const char *p, size_t n) {
+#ifdef X86_SIMD
+  if (cpu_avx2)
+    return json_plain_len_avx2(p, n);
+  if (cpu_sse2)
+    return json_plain_len_sse2(p, n);
+#endif
+  return json_plain_len_scalar(p, n);
 }
 
-// (set-car! <cell> expr)
-static Val *prim_set_car(void *root, Val **env, Val **list) {
-  DEFINE1(root, args);
-  *args = eval_list(root, env, list);
-  if (length(*args) != 2 || (*args)->car->type != TCELL)
-    error("set_car!: invalid arguments");
-  (*args)->car->car = (*args)->cdr->car;
-  return (*args)->car;
+typedef struct {
+  // The string or bytes parsed, which may move whenever a value is allocated
+  Val **src;
+  size_t pos, end;
+  int depth;
+  // Primitive named in errors
+  char *who;
+} JsonParser;
+
+static const char *json_text(JsonParser *jp) {
+  Val *src = *jp->src;
+  return src->type == TBYTES ? (const char *)src->bdata : str_ptr(src);
 }
 
-// }}}
+static __attribute((noreturn)) void json_error(JsonParser *jp, char *what) {
+  char msg[128];
+  snprintf(msg, sizeof(msg), "%s: %s at offset %zu", jp->who, what, jp->pos);
+  error(msg);
+}
 
-// {{{ primitives: string
+static int json_peek(JsonParser *jp) {
+  return jp->pos < jp->end ? (unsigned char)json_text(jp)[jp->pos] : EOF;
+}
 
-// (str str0 str1 str3)
-static Val *prim_str(void *root, Val **env, Val **list) {
-  // Ensure we are only dealing with strings and compute final length
-  int len = 0;
-  Val *args = eval_list(root, env, list);
-  for (Val *a = args; a != Nil; a = a->cdr) {
-    if (a->car->type != TSTR)
-      error("str: argument not a string");
-    len += strlen(a->car->strv);
+static void json_skip_ws(JsonParser *jp) {
+  const char *s = json_text(jp);
+  while (jp->pos < jp->end && (s[jp->pos] == ' ' || s[jp->pos] == '\n' ||
+                               s[jp->pos] == '\r' || s[jp->pos] == '\t'))
+    jp->pos++;
+}
+
+static void json_expect(JsonParser *jp, int c, char *what) {
+  json_skip_ws(jp);
+  if (json_peek(jp) != c)
+    json_error(jp, what);
+  jp->pos++;
+}
+
+// Returns the 4 hex digits at s[at], or -1.
+static int32_t json_hex4(JsonParser *jp, const char *s, size_t at) {
+  if (at + 4 > jp->end)
+    return -1;
+  int32_t cp = 0;
+  for (size_t i = at; i < at + 4; i++) {
+    int c = (unsigned char)s[i];
+    if (!isxdigit(c))
+      return -1;
+    cp = cp * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
   }
+  return cp;
+}
 
-  char ret[len + 1];
-  char *last = &ret[0];
+// Unescapes the string body at pos up to its closing quote into out, or only
+// measures it when out is NULL, and returns its unescaped length. Escapes
+// always take more bytes than what they stand for, so the body has escapes
+// exactly when the length is shorter than it.
+static size_t json_unescape(JsonParser *jp, const char *s, char *out) {
+  static const char *escapes = "\"\\/bfnrt", *unescaped = "\"\\/\b\f\n\r\t";
+  size_t len = 0;
+  for (;;) {
+    size_t n = json_plain_len(s + jp->pos, jp->end - jp->pos);
+    if (out)
+      memcpy(out + len, s + jp->pos, n);
+    jp->pos += n;
+    len += n;
+    if (jp->pos == jp->end)
+      json_error(jp, "unclosed string");
+    if (s[jp->pos] == '"')
+      return len;
+    if (s[jp->pos] != '\\')
+      json_error(jp, "control character in string");
+    if (jp->pos + 1 == jp->end)
+      json_error(jp, "unclosed string");
+
+    char e = s[jp->pos + 1];
+    char *esc = e ? strchr(escapes, e) : NULL;
+    if (esc) {
+      if (out)
+        out[len] = unescaped[esc - escapes];
+      len++;
+      jp->pos += 2;
+      continue;
+    }
+    if (e != 'u')
+      json_error(jp, "invalid escape");
+    // Characters beyond the BMP are escaped as UTF-16 surrogate pairs
+    int32_t cp = json_hex4(jp, s, jp->pos + 2);
+    size_t n_esc = 6;
+    if (cp >= 0xD800 && cp < 0xDC00 && jp->pos + 12 <= jp->end &&
+        s[jp->pos + 6] == '\\' && s[jp->pos + 7] == 'u') {
+      int32_t lo = json_hex4(jp, s, jp->pos + 8);
+      if (lo >= 0xDC00 && lo < 0xE000) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+        n_esc = 12;
+      }
+    }
+    if (cp < 0 || (cp >= 0xD800 && cp < 0xE000))
+      json_error(jp, "invalid \\u escape");
+    char buf[4];
+    len += u8_wc_toutf8(out ? out + len : buf, cp);
+    jp->pos += n_esc;
+  }
+}
 
-  // Append strings to return value
-  for (Val *a = args; a != Nil; a = a->cdr) {
-    last = stpcpy(last, a->car->strv);
+static Val *json_string(void *root, JsonParser *jp) {
+  size_t start = ++jp->pos;
+  const char *s = json_text(jp);
+  size_t len = json_unescape(jp, s, NULL);
+  size_t end = jp->pos;
+  if (!utf8_valid(s + start, end - start)) {
+    jp->pos = start;
+    json_error(jp, "invalid UTF-8 in string");
+  }
+  Val *r = make_str_len(root, NULL, len);
+  s = json_text(jp);
+  if (len == end - start) {
+    memcpy(r->strv, s + start, len);
+  } else {
+    jp->pos = start;
+    json_unescape(jp, s, r->strv);
   }
+  jp->pos = end + 1;
+  return r;
+}
 
-  ret[len + 1] = '\0';
-  return make_str(root, &ret[0]);
+static size_t json_digits(const char *s, size_t i, size_t end) {
+  while (i < end && isdigit((unsigned char)s[i]))
+    i++;
+  return i;
 }
 
-// (str-len str)
-static Val *prim_str_len(void *root, Val **env, Val **list) {
-  DEFINE1(root, args);
-  *args = eval_list(root, env, list);
-  if (length(*args) != 1 || (*args)->car->type != TSTR) {
-    error("str-len: 1st arg is not a string");
+static Val *json_number(void *root, JsonParser *jp) {
+  const char *s = json_text(jp);
+  size_t start = jp->pos, i = start;
+  bool negative = s[i] == '-';
+  if (negative)
+    i++;
+  size_t digits = i;
+  if (i < jp->end && s[i] == '0')
+    i++;
+  else
+    i = json_digits(s, i, jp->end);
+  size_t ndigits = i - digits;
+  // The integer part, fraction and exponent all need at least one digit
+  bool valid = ndigits > 0, is_float = false;
+  if (i < jp->end && s[i] == '.') {
+    is_float = true;
+    size_t frac = ++i;
+    i = json_digits(s, i, jp->end);
+    valid = valid && i > frac;
+  }
+  if (i < jp->end && (s[i] == 'e' || s[i] == 'E')) {
+    is_float = true;
+    if (++i < jp->end && (s[i] == '+' || s[i] == '-'))
+      i++;
+    size_t exp = i;
+    i = json_digits(s, i, jp->end);
+    valid = valid && i > exp;
   }
+  jp->pos = i;
+  if (!valid)
+    json_error(jp, "invalid number");
+
+  if (is_float) {
+    // strtod needs the number NUL terminated
+    char small[64], *buf = i - start < sizeof(small) ? small
+                                                     : malloc(i - start + 1);
+    memcpy(buf, s + start, i - start);
+    buf[i - start] = '\0';
+    double d = strtod(buf, NULL);
+    if (buf != small)
+      free(buf);
+    return make_float(root, d);
+  }
+  // 18 digits always fit
+  if (ndigits <= 18) {
+    int64_t val = 0;
+    for (size_t k = digits; k < i; k++)
+      val = val * 10 + (s[k] - '0');
+    return make_int(root, negative ? -val : val);
+  }
+  Big b = big_from_digits(s + digits, ndigits, negative);
+  return make_big(root, &b);
+}
 
-  return make_int(root, strlen((*args)->car->strv));
+static void json_literal(JsonParser *jp, char *word) {
+  size_t n = strlen(word);
+  if (jp->end - jp->pos < n || memcmp(json_text(jp) + jp->pos, word, n) != 0)
+    json_error(jp, "invalid literal");
+  jp->pos += n;
 }
 
-// }}}
+static Val *json_value(void *root, JsonParser *jp);
 
-// {{{ primitives: math
+static Val *json_array(void *root, JsonParser *jp) {
+  DEFINE2(root, v, x);
+  *v = make_vec(root, 0);
+  jp->pos++;
+  json_skip_ws(jp);
+  if (json_peek(jp) == ']') {
+    jp->pos++;
+    return *v;
+  }
+  for (;;) {
+    *x = json_value(root, jp);
+    vec_push(root, v, x);
+    json_skip_ws(jp);
+    if (json_peek(jp) != ',')
+      break;
+    jp->pos++;
+  }
+  json_expect(jp, ']', "expected ',' or ']'");
+  return *v;
+}
 
-// (+ <integer> ...)
-static Val *prim_plus(void *root, Val **env, Val **list) {
-  int sum = 0;
-  for (Val *args = eval_list(root, env, list); args != Nil; args = args->cdr) {
-    if (args->car->type != TINT)
-      error("+ takes only numbers");
-    sum += args->car->intv;
+static Val *json_object(void *root, JsonParser *jp) {
+  DEFINE3(root, obj, key, val);
+  *obj = make_obj(root, &Nil);
+  jp->pos++;
+  json_skip_ws(jp);
+  if (json_peek(jp) == '}') {
+    jp->pos++;
+    return *obj;
   }
-  return make_int(root, sum);
+  for (;;) {
+    json_skip_ws(jp);
+    if (json_peek(jp) != '"')
+      json_error(jp, "expected a string key");
+    *key = json_string(root, jp);
+    json_expect(jp, ':', "expected ':'");
+    *val = json_value(root, jp);
+    obj_set(root, obj, key, val);
+    json_skip_ws(jp);
+    if (json_peek(jp) != ',')
+      break;
+    jp->pos++;
+  }
+  json_expect(jp, '}', "expected ',' or '}'");
+  return *obj;
 }
 
-// (- <integer> ...)
-static Val *prim_minus(void *root, Val **env, Val **list) {
+static Val *json_value(void *root, JsonParser *jp) {
+  json_skip_ws(jp);
+  int c = json_peek(jp);
+  switch (c) {
+  case EOF:
+    json_error(jp, "unexpected end of input");
+  case '"':
+    return json_string(root, jp);
+  case 't':
+    json_literal(jp, "true");
+    return True;
+  case 'f':
+    json_literal(jp, "false");
+    return Nil;
+  case 'n':
+    json_literal(jp, "null");
+    return Nil;
+  case '[':
+  case '{': {
+    if (++jp->depth > JSON_MAX_DEPTH)
+      json_error(jp, "nested too deeply");
+    Val *r = c == '[' ? json_array(root, jp) : json_object(root, jp);
+    jp->depth--;
+    return r;
+  }
+  default:
+    if (c == '-' || isdigit(c))
+      return json_number(root, jp);
+    json_error(jp, "unexpected character");
+  }
+}
+
+// (json-parse str) -> the value of the JSON text str
+static Val *prim_json_parse(void *root, Val **env, Val **list) {
+  DEFINE1(root, s);
   Val *args = eval_list(root, env, list);
-  for (Val *p = args; p != Nil; p = p->cdr)
-    if (p->car->type != TINT)
-      error("- takes only numbers");
-  if (args->cdr == Nil)
-    return make_int(root, -args->car->intv);
-  int r = args->car->intv;
-  for (Val *p = args->cdr; p != Nil; p = p->cdr)
-    r -= p->car->intv;
-  return make_int(root, r);
+  if (length(args) != 1 || !is_str(args->car))
+    error("json-parse: expected a string");
+  *s = args->car;
+  JsonParser jp = {s, 0, (*s)->slen, 0, "json-parse"};
+  Val *r = json_value(root, &jp);
+  json_skip_ws(&jp);
+  if (jp.pos != jp.end)
+    json_error(&jp, "trailing characters");
+  return r;
 }
 
-// (< <integer> <integer>)
-static Val *prim_lt(void *root, Val **env, Val **list) {
+// Makes a parser for a stream of JSON values fed in chunks, such as those
+// read by io watchers. A value may be split anywhere between chunks, and
+// values follow each other directly or separated by whitespace, as in
+// newline delimited JSON.
+static Val *prim_json_parser(void *root, Val **env, Val **list) {
+  (void)env;
+  if (length(*list) != 0)
+    error("json-parser: takes no args");
+  DEFINE1(root, sb);
+  *sb = make_sb(root, 0);
+  Val *r = alloc(root, TJSON, sizeof(Val *) + sizeof(size_t) + sizeof(int) * 2);
+  r->jsb = *sb;
+  r->jscan = 0;
+  r->jdepth = 0;
+  r->jstate = 0;
+  return r;
+}
+
+// Scans the bytes fed to the stream parser p since the last scan, tracking
+// strings and nesting only, and returns where the last top level value they
+// complete ends, or 0. Strings and containers end at their closing
+// character; numbers and literals at top level end at the next character
+// that cannot be part of them, or at the end of the stream.
+static size_t json_scan(Val *p, bool eof) {
+  const char *s = (const char *)p->jsb->buf->bdata;
+  size_t n = p->jsb->len, i = p->jscan, done = 0;
+  int depth = p->jdepth, st = p->jstate;
+  while (i < n) {
+    if (st & JSON_ESCAPE) {
+      st &= ~JSON_ESCAPE;
+      i++;
+      continue;
+    }
+    if (st & JSON_IN_STR) {
+      if ((i += json_plain_len(s + i, n - i)) == n)
+        break;
+      if (s[i] == '\\') {
+        st |= JSON_ESCAPE;
+      } else if (s[i] == '"') {
+        st &= ~JSON_IN_STR;
+        if (depth == 0)
+          done = i + 1;
+      }
+      i++;
+      continue;
+    }
+    char c = s[i];
+    if (st & JSON_IN_SCALAR) {
+      if (isalnum((unsigned char)c) || c == '-' || c == '+' || c == '.') {
+        i++;
+        continue;
+      }
+      st &= ~JSON_IN_SCALAR;
+      done = i;
+    }
+    switch (c) {
+    case '"':
+      st |= JSON_IN_STR;
+      break;
+    case '[':
+    case '{':
+      depth++;
+      break;
+    case ']':
+    case '}':
+      // An unmatched one is passed on for the parser to report
+      if (depth == 0 || --depth == 0)
+        done = i + 1;
+      break;
+    case ' ':
+    case '\n':
+    case '\r':
+    case '\t':
+      break;
+    default:
+      if (depth == 0)
+        st |= JSON_IN_SCALAR;
+    }
+    i++;
+  }
+  if (eof && st == JSON_IN_SCALAR) {
+    st = 0;
+    done = n;
+  }
+  p->jscan = i;
+  p->jdepth = depth;
+  p->jstate = st;
+  return done;
+}
+
+// (json-feed! parser chunk) -> the list of values that chunk, a string or
+// bytes, completes. Without a chunk, ends the stream: the value fed last is
+// complete or an error.
+static Val *prim_json_feed(void *root, Val **env, Val **list) {
+  char *msg = "json-feed!: expected a json parser and an optional chunk";
+  DEFINE6(root, p, sb, chunk, text, values, value);
   Val *args = eval_list(root, env, list);
-  if (length(args) != 2)
-    error("malformed <");
-  Val *x = args->car;
-  Val *y = args->cdr->car;
-  if (x->type != TINT || y->type != TINT)
-    error("< takes only numbers");
-  return x->intv < y->intv ? True : Nil;
+  int nargs = length(args);
+  if (nargs < 1 || nargs > 2 || args->car->type != TJSON)
+    error(msg);
+  *p = args->car;
+  *sb = (*p)->jsb;
+  bool eof = nargs == 1;
+  if (!eof) {
+    *chunk = args->cdr->car;
+    if (is_str(*chunk)) {
+      sb_append_str(root, sb, chunk, 0, (*chunk)->slen);
+    } else if ((*chunk)->type == TBYTES) {
+      sb_reserve(root, sb, (*chunk)->blen);
+      memcpy((*sb)->buf->bdata + (*sb)->len, (*chunk)->bdata,
+             (*chunk)->blen);
+      (*sb)->len += (*chunk)->blen;
+    } else {
+      error(msg);
+    }
+  }
+
+  size_t done = json_scan(*p, eof);
+  if (eof && ((*p)->jdepth || (*p)->jstate)) {
+    (*sb)->len = (*p)->jscan = 0;
+    (*p)->jdepth = (*p)->jstate = 0;
+    error("json-feed!: stream ends inside a value");
+  }
+  if (done == 0)
+    return Nil;
+  // The completed values are taken out of the stream before they are parsed,
+  // so that one that fails to parse is dropped along with its error
+  *text = make_str_len(root, NULL, done);
+  uint8_t *buf = (*sb)->buf->bdata;
+  memcpy((*text)->strv, buf, done);
+  memmove(buf, buf + done, (*sb)->len - done);
+  (*sb)->len -= done;
+  (*p)->jscan -= done;
+
+  *values = Nil;
+  JsonParser jp = {text, 0, done, 0, "json-feed!"};
+  for (json_skip_ws(&jp); jp.pos < jp.end; json_skip_ws(&jp)) {
+    *value = json_value(root, &jp);
+    *values = cons(root, value, values);
+  }
+  return reverse(*values);
 }
 
-// (= <integer> <integer>)
-static Val *prim_num_eq(void *root, Val **env, Val **list) {
-  if (length(*list) != 2)
-    error("Malformed =");
-  Val *values = eval_list(root, env, list);
-  Val *x = values->car;
-  Val *y = values->cdr->car;
-  if (x->type != TINT || y->type != TINT)
-    error("= only takes numbers");
-  return x->intv == y->intv ? True : Nil;
+// JSON text is written to a malloc'd buffer: nothing is allocated on the heap
+// while the value is walked, and the text is copied once into the string or
+// string builder it ends up in.
+typedef struct {
+  char *buf;
+  size_t len, cap;
+  int depth;
+} JsonWriter;
+
+static void json_put(JsonWriter *w, const char *s, size_t n) {
+  if (w->len + n > w->cap) {
+    w->cap = w->cap * 2 > w->len + n ? w->cap * 2 : w->len + n;
+    w->buf = realloc(w->buf, w->cap);
+  }
+  memcpy(w->buf + w->len, s, n);
+  w->len += n;
 }
 
-// (rand <integer>)
-static Val *prim_rand(void *root, Val **env, Val **list) {
-  if (length(*list) != 1)
-    error("rand: takes exactly 1 argument");
-  Val *values = eval_list(root, env, list);
-  Val *x = values->car;
-  if (x->type != TINT)
-    error("rand: 1st arg is not an int");
+static void json_put_str(JsonWriter *w, const char *s, size_t len) {
+  json_put(w, "\"", 1);
+  for (size_t i = 0;;) {
+    size_t n = json_plain_len(s + i, len - i);
+    json_put(w, s + i, n);
+    if ((i += n) == len)
+      break;
+    char buf[8], c = s[i++];
+    switch (c) {
+    case '"':
+      json_put(w, "\\\"", 2);
+      break;
+    case '\\':
+      json_put(w, "\\\\", 2);
+      break;
+    case '\n':
+      json_put(w, "\\n", 2);
+      break;
+    case '\r':
+      json_put(w, "\\r", 2);
+      break;
+    case '\t':
+      json_put(w, "\\t", 2);
+      break;
+    default:
+      json_put(w, buf, sprintf(buf, "\\u%04x", c));
+    }
+  }
+  json_put(w, "\"", 1);
+}
+
+// Writes v as JSON text, or returns an error message.
+static char *json_write(JsonWriter *w, Val *v) {
+  char buf[32];
+  char *err = NULL;
+  switch (v->type) {
+  case TNIL:
+    json_put(w, "null", 4);
+    return NULL;
+  case TTRUE:
+    json_put(w, "true", 4);
+    return NULL;
+  case TINT:
+    json_put(w, buf, sprintf(buf, "%" PRId64, v->intv));
+    return NULL;
+  case TBIG: {
+    char *s = big_to_str(v);
+    json_put(w, s, strlen(s));
+    free(s);
+    return NULL;
+  }
+  case TFLOAT:
+    if (!isfinite(v->floatv))
+      return "json-stringify: nan and inf have no JSON form";
+    json_put(w, buf, float_str(buf, v->floatv));
+    return NULL;
+  case TSTR:
+  case TSLICE:
+    json_put_str(w, str_ptr(v), v->slen);
+    return NULL;
+  case TSYM:
+    json_put_str(w, v->symv, strlen(v->symv));
+    return NULL;
+  case TVEC:
+  case TCELL:
+  case TOBJ:
+    break;
+  default:
+    return "json-stringify: value has no JSON form";
+  }
+
+  // Cycles end up here too
+  if (++w->depth > JSON_MAX_DEPTH)
+    return "json-stringify: nested too deeply";
+  if (v->type == TVEC) {
+    json_put(w, "[", 1);
+    for (size_t i = 0; i < v->len && !err; i++) {
+      if (i > 0)
+        json_put(w, ",", 1);
+      err = json_write(w, v->buf->slots[i]);
+    }
+    json_put(w, "]", 1);
+  } else if (v->type == TCELL) {
+    json_put(w, "[", 1);
+    for (Val *l = v; l != Nil && !err; l = l->cdr) {
+      if (l->type != TCELL)
+        return "json-stringify: improper list";
+      if (l != v)
+        json_put(w, ",", 1);
+      err = json_write(w, l->car);
+    }
+    json_put(w, "]", 1);
+  } else {
+    json_put(w, "{", 1);
+    bool first = true;
+    for (size_t i = 0; i < OBJ_HM_SIZE && !err; i++) {
+      for (Val *l = v->props[i]; l != Nil && !err; l = l->cdr) {
+        Val *key = l->car->car;
+        if (!first)
+          json_put(w, ",", 1);
+        first = false;
+        // Numeric keys are written as the string of their digits
+        if (key->type == TINT) {
+          json_put_str(w, buf, sprintf(buf, "%" PRId64, key->intv));
+        } else if (key->type == TBIG) {
+          char *digits = big_to_str(key);
+          json_put_str(w, digits, strlen(digits));
+          free(digits);
+        } else {
+          json_write(w, key);
+        }
+        json_put(w, ":", 1);
+        err = json_write(w, l->car->cdr);
+      }
+    }
+    json_put(w, "}", 1);
+  }
+  w->depth--;
+  return err;
+}
 
-  return make_int(root, pcg32_boundedrand(values->car->intv));
+// (json-stringify value [sb]) -> the JSON text of value, or sb with it
+// appended
+static Val *prim_json_stringify(void *root, Val **env, Val **list) {
+  DEFINE2(root, args, sb);
+  *args = eval_list(root, env, list);
+  int nargs = length(*args);
+  if (nargs < 1 || nargs > 2 ||
+      (nargs == 2 && (*args)->cdr->car->type != TSB))
+    error("json-stringify: expected a value and an optional string builder");
+  JsonWriter w = {NULL, 0, 0, 0};
+  char *err = json_write(&w, (*args)->car);
+  if (err) {
+    free(w.buf);
+    error(err);
+  }
+  Val *r;
+  if (nargs == 2) {
+    *sb = (*args)->cdr->car;
+    sb_reserve(root, sb, w.len);
+    memcpy((*sb)->buf->bdata + (*sb)->len, w.buf, w.len);
+    (*sb)->len += w.len;
+    r = *sb;
+  } else {
+    r = make_str_len(root, w.buf, w.len);
+  }
+  free(w.buf);
+  return r;
 }
 
 // }}}
@@ -1817,10 +7896,13 @@ static Val *prim_error(void *root, Val **env, Val **list) {
     error("error: takes exactly 1 argument");
   Val *values = eval_list(root, env, list);
   Val *str = values->car;
-  if (str->type != TSTR)
+  if (!is_str(str))
     error("error: 1st arg is not a string");
 
-  error(str->strv);
+  char msg[str->slen + 1];
+  memcpy(msg, str_ptr(str), str->slen);
+  msg[str->slen] = '\0';
+  error(msg);
 }
 
 // (trap-error fn error-fn)
@@ -1841,8 +7923,14 @@ static Val *prim_trap_error(void *root, Val **env, Val **list) {
             "Max error depth reached. Check for nested `trap-error` calls.\n");
     exit(1);
   }
+  size_t saved_prof_depth = prof_depth;
+  int saved_site = alloc_site;
+  int saved_region_depth = region_depth;
   int trapped = setjmp(error_jmp_env[error_depth++]);
   if (trapped != 0) {
+    prof_unwind(saved_prof_depth);
+    alloc_site = saved_site;
+    region_unwind(root, saved_region_depth);
     *call = make_str(root, error_value);
     free(error_value);
 
@@ -1856,8 +7944,413 @@ static Val *prim_trap_error(void *root, Val **env, Val **list) {
 
 // }}}
 
+// {{{ primitives: weak
+
+// (weak-ref expr)
+static Val *prim_weak_ref(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("weak-ref: expected exactly 1 arg");
+  DEFINE1(root, target);
+  *target = eval_list(root, env, list)->car;
+  return make_weak_ref(root, target);
+}
+
+// (weak-deref ref) -> the target, or nil once it has been collected
+static Val *prim_weak_deref(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("weak-deref: expected exactly 1 arg");
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TWEAK)
+    error("weak-deref: expected 1st argument to be weak-ref");
+  return args->car->target;
+}
+
+// (weak-table)
+static Val *prim_weak_table(void *root, Val **env, Val **list) {
+  (void)env;
+  if (length(*list) != 0)
+    error("weak-table: takes no args");
+  return make_weak_table(root);
+}
+
+// Keys are compared by identity, like eq? does for objects.
+static Val **weak_table_find(Val *table, Val *key) {
+  Val **e = &table->buckets[weak_hash(key)];
+  while (*e != Nil && (*e)->key != key)
+    e = &(*e)->next;
+  return e;
+}
+
+static Val *weak_table_args(void *root, Val **env, Val **list, int n,
+                            char *msg) {
+  if (length(*list) != n)
+    error(msg);
+  Val *args = eval_list(root, env, list);
+  if (args->car->type != TWTABLE)
+    error(msg);
+  return args;
+}
+
+// (weak-table-get table key) -> value, or nil if key is not in the table
+static Val *prim_weak_table_get(void *root, Val **env, Val **list) {
+  Val *args = weak_table_args(root, env, list, 2,
+                              "weak-table-get: expected weak-table and key");
+  Val *e = *weak_table_find(args->car, args->cdr->car);
+  return e != Nil ? e->value : Nil;
+}
+
+// (weak-table-set! table key value) -> value
+static Val *prim_weak_table_set(void *root, Val **env, Val **list) {
+  DEFINE1(root, args);
+  *args =
+      weak_table_args(root, env, list, 3,
+                      "weak-table-set!: expected weak-table, key and value");
+  Val *e = *weak_table_find((*args)->car, (*args)->cdr->car);
+  if (e != Nil) {
+    e->value = (*args)->cdr->cdr->car;
+    write_barrier(&e->value);
+    return e->value;
+  }
+
+  // Allocating may run GC, which rehashes the table
+  e = alloc(root, TEPH, sizeof(Val *) * 3);
+  Val *table = (*args)->car;
+  e->key = (*args)->cdr->car;
+  e->value = (*args)->cdr->cdr->car;
+  Val **bucket = &table->buckets[weak_hash(e->key)];
+  e->next = *bucket;
+  *bucket = e;
+  write_barrier(bucket);
+  table->count++;
+  return e->value;
+}
+
+// (weak-table-del! table key)
+static Val *prim_weak_table_del(void *root, Val **env, Val **list) {
+  Val *args = weak_table_args(root, env, list, 2,
+                              "weak-table-del!: expected weak-table and key");
+  Val **e = weak_table_find(args->car, args->cdr->car);
+  if (*e != Nil) {
+    *e = (*e)->next;
+    write_barrier(e);
+    args->car->count--;
+  }
+  return Nil;
+}
+
+// (weak-table-count table) -> number of entries
+static Val *prim_weak_table_count(void *root, Val **env, Val **list) {
+  Val *args = weak_table_args(root, env, list, 1,
+                              "weak-table-count: expected weak-table");
+  return make_int(root, args->car->count);
+}
+
+// }}}
+
+// {{{ primitives: profile
+
+static int prof_cmp_excl(const void *a, const void *b) {
+  uint64_t x = prof_entries[*(const size_t *)a].excl_ns;
+  uint64_t y = prof_entries[*(const size_t *)b].excl_ns;
+  return x < y ? -1 : x > y;
+}
+
+// Calls fn with profiling on. Kept out of prim_profile, whose DEFINE
+// reassigns root, so that no local changes between setjmp and longjmp.
+static void prof_call(void *root, Val **env, Val **fn) {
+  // Stop profiling before handing errors to the enclosing handler
+  prof_reset();
+  if (setjmp(error_jmp_env[error_depth++]) != 0) {
+    prof_reset();
+    char msg[strlen(error_value) + 1];
+    strcpy(msg, error_value);
+    free(error_value);
+    error(msg);
+  }
+  profiling = true;
+  apply_func(root, env, fn, &Nil);
+  profiling = false;
+  error_depth--;
+  prof_unwind(0);
+}
+
+// (profile thunk) -> ((name . sym) (fn . f) (calls . n) ...) ...
+static Val *prim_profile(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("profile: not given exactly 1 arg");
+  DEFINE5(root, fn, result, entry, key, val);
+  *fn = (*list)->car;
+  *fn = eval(root, env, fn);
+  if ((*fn)->type != TFUN)
+    error("profile: 1st arg not a function");
+  if (profiling)
+    error("profile: already profiling");
+  if (error_depth >= MAX_ERROR_DEPTH)
+    error("profile: max error depth reached");
+
+  prof_call(root, env, fn);
+
+  // Cons the entries from the cheapest to the most expensive, giving a list
+  // sorted by descending exclusive time.
+  size_t n = prof_nentries;
+  size_t order[n ? n : 1];
+  for (size_t i = 0; i < n; i++)
+    order[i] = i;
+  qsort(order, n, sizeof(size_t), prof_cmp_excl);
+
+  *result = Nil;
+  for (size_t i = 0; i < n; i++) {
+    ProfEntry *e = &prof_entries[order[i]];
+    *entry = Nil;
+
+#define prof_field(k, v)                                                       \
+  *key = intern(root, k);                                                      \
+  *val = v;                                                                    \
+  *entry = acons(root, key, val, entry);
+
+    prof_field("bytes", make_int(root, e->bytes));
+    prof_field("exclusive-us", make_int(root, e->excl_ns / 1000));
+    prof_field("inclusive-us", make_int(root, e->incl_ns / 1000));
+    prof_field("calls", make_int(root, e->calls));
+    prof_field("fn", e->fn);
+    prof_field("name", e->name ? e->name : Nil);
+
+#undef prof_field
+
+    *result = cons(root, entry, result);
+  }
+
+  prof_reset();
+  return *result;
+}
+
+static int bench_cmp_ns(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Most iterations bench takes, which keeps its samples under 80MB
+#define BENCH_MAX_ITERATIONS 10000000
+
+// Stores the time each of n calls of fn takes in samples. Frees samples before
+// handing errors to the enclosing handler, and is kept out of prim_bench for
+// the same reason as prof_call.
+static void bench_run(void *root, Val **env, Val **fn, uint64_t *samples,
+                      size_t n) {
+  if (setjmp(error_jmp_env[error_depth++]) != 0) {
+    free(samples);
+    char msg[strlen(error_value) + 1];
+    strcpy(msg, error_value);
+    free(error_value);
+    error(msg);
+  }
+  for (size_t i = 0; i < n; i++) {
+    uint64_t start = now_ns();
+    apply_func(root, env, fn, &Nil);
+    samples[i] = now_ns() - start;
+  }
+  error_depth--;
+}
+
+// (bench n thunk) -> ((iterations . n) (min-ns . n) (median-ns . n) ...)
+static Val *prim_bench(void *root, Val **env, Val **list) {
+  if (length(*list) != 2)
+    error("bench: not given exactly 2 args");
+  DEFINE4(root, args, fn, stats, key);
+  *args = eval_list(root, env, list);
+  if ((*args)->car->type != TINT || (*args)->car->intv < 1 ||
+      (*args)->car->intv > BENCH_MAX_ITERATIONS)
+    error("bench: 1st arg not an int from 1 to 10000000");
+  if ((*args)->cdr->car->type != TFUN)
+    error("bench: 2nd arg not a function");
+  if (error_depth >= MAX_ERROR_DEPTH)
+    error("bench: max error depth reached");
+  size_t n = (*args)->car->intv;
+  *fn = (*args)->cdr->car;
+
+  // Warm up
+  size_t warmup = n / 10 > 0 ? n / 10 : 1;
+  for (size_t i = 0; i < warmup; i++)
+    apply_func(root, env, fn, &Nil);
+
+  uint64_t *samples = malloc(sizeof(uint64_t) * n);
+  if (samples == NULL)
+    error("bench: out of memory");
+  size_t start_bytes = mem_total;
+  size_t start_gcs = gc_count;
+  uint64_t start_gc_ns = gc_pause_ns;
+  bench_run(root, env, fn, samples, n);
+  size_t bytes = mem_total - start_bytes;
+  size_t gcs = gc_count - start_gcs;
+  uint64_t gc_ns = gc_pause_ns - start_gc_ns;
+
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; i++)
+    total += samples[i];
+  qsort(samples, n, sizeof(uint64_t), bench_cmp_ns);
+  uint64_t min = samples[0];
+  uint64_t median = samples[n / 2];
+  uint64_t p99 = samples[n * 99 / 100];
+  free(samples);
+
+  *stats = Nil;
+
+#define stat_field(k, v)                                                       \
+  *key = intern(root, k);                                                      \
+  *fn = make_int128(root, v);                                                  \
+  *stats = acons(root, key, fn, stats);
+
+  stat_field("gc-pause-ns", gc_ns);
+  stat_field("gc-count", gcs);
+  stat_field("bytes-per-iteration", bytes / n);
+  stat_field("mean-ns", total / n);
+  stat_field("p99-ns", p99);
+  stat_field("median-ns", median);
+  stat_field("min-ns", min);
+  stat_field("iterations", n);
+
+#undef stat_field
+
+  return *stats;
+}
+
+// }}}
+
+// {{{ primitives: gc
+
+// (gc)
+static Val *prim_gc(void *root, Val **env, Val **list) {
+  (void)env;
+  if (length(*list) != 0)
+    error("gc: takes no args");
+  gc_all(root);
+  return Nil;
+}
+
+// (gc-stats) -> ((count . n) (pause-us . n) ...)
+static Val *prim_gc_stats(void *root, Val **env, Val **list) {
+  (void)env;
+  if (length(*list) != 0)
+    error("gc-stats: takes no args");
+  DEFINE3(root, stats, key, val);
+  *stats = Nil;
+
+#define stat_field(k, v)                                                       \
+  *key = intern(root, k);                                                      \
+  *val = make_int(root, v);                                                    \
+  *stats = acons(root, key, val, stats);
+
+  stat_field("region-escaped", region_escaped);
+  stat_field("major-count", major_count);
+  stat_field("tenured", tenured.size);
+  stat_field("perm", perm_bytes);
+  stat_field("allocated", mem_total);
+  stat_field("peak-heap", mem_peak);
+  stat_field("heap", mem_nused);
+  stat_field("pause-us", gc_pause_ns / 1000);
+  stat_field("count", gc_count);
+
+#undef stat_field
+
+  return *stats;
+}
+
+// (gc-sites) -> ((site survival-percent pretenured) ...)
+static Val *prim_gc_sites(void *root, Val **env, Val **list) {
+  (void)env;
+  if (length(*list) != 0)
+    error("gc-sites: takes no args");
+  DEFINE4(root, sites_list, entry, rate, name);
+  *sites_list = Nil;
+  for (int i = NSITES - 1; i >= 0; i--) {
+    SiteStats *st = &sites[i];
+    *entry = pretenured[i] ? True : Nil;
+    *entry = cons(root, entry, &Nil);
+    *rate = make_int(root, st->sampled ? st->survived * 100 / st->sampled : 0);
+    *entry = cons(root, rate, entry);
+    *name = intern(root, (char *)st->name);
+    *entry = cons(root, name, entry);
+    *sites_list = cons(root, entry, sites_list);
+  }
+  return *sites_list;
+}
+
+// (with-region thunk)
+static Val *prim_with_region(void *root, Val **env, Val **list) {
+  if (length(*list) != 1)
+    error("with-region: not given exactly 1 arg");
+  DEFINE2(root, fn, result);
+  *fn = (*list)->car;
+  *fn = eval(root, env, fn);
+  if ((*fn)->type != TFUN)
+    error("with-region: 1st arg not a function");
+
+  region_depth++;
+  *result = cons(root, fn, &Nil);
+  *result = eval(root, env, result);
+  region_unwind(root, region_depth - 1);
+  return *result;
+}
+
+// (freeze-heap) -> number of bytes moved to the permanent region
+static Val *prim_freeze_heap(void *root, Val **env, Val **list) {
+  (void)env;
+  if (length(*list) != 0)
+    error("freeze-heap: takes no args");
+  return make_int(root, freeze_heap(root));
+}
+
+// Prints GC counters as JSON on stderr at exit, see SHI_STATS.
+static void print_stats() {
+  fprintf(stderr,
+          "{\"gc_count\":%zu,\"gc_pause_us\":%llu,\"peak_heap\":%zu,"
+          "\"allocated\":%zu,\"major_count\":%zu,\"tenured\":%zu}\n",
+          gc_count, (unsigned long long)(gc_pause_ns / 1000), mem_peak,
+          mem_total, major_count, tenured.size);
+}
+
+// }}}
+
 // {{{ primitives: os
 
+// Returns the file descriptor held by v, which can be an int or an open
+// handle. Raises msg otherwise.
+static int fd_arg(Val *v, char *msg) {
+  if (v->type == TINT)
+    return v->intv;
+  if (v->type == TRES && v->fd >= 0)
+    return v->fd;
+  error(msg);
+}
+
+// When the process has run out of file descriptors, collects garbage to close
+// the unreachable handles and returns true, so that the call can be retried.
+static bool fd_reclaim(void *root) {
+  if (errno != EMFILE && errno != ENFILE)
+    return false;
+  gc_all(root);
+  return true;
+}
+
+// Translates an fopen(3) mode into open(2) flags.
+static int open_flags(char *mode) {
+  int flags;
+  switch (mode[0]) {
+  case 'w':
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+    break;
+  case 'a':
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+    break;
+  default:
+    flags = O_RDONLY;
+  }
+  if (strchr(mode, '+'))
+    flags = (flags & ~O_WRONLY) | O_RDWR;
+  return flags;
+}
+
 // (write "str")
 static Val *prim_write(void *root, Val **env, Val **list) {
   if (length(*list) != 2)
@@ -1865,15 +8358,13 @@ static Val *prim_write(void *root, Val **env, Val **list) {
 
   Val *values = eval_list(root, env, list);
 
-  if (values->car->type != TINT)
-    error("write: 1st arg not file descriptor");
-  if (values->cdr->car->type != TSTR)
+  int fd = fd_arg(values->car, "write: 1st arg not file descriptor");
+  if (!is_str(values->cdr->car))
     error("write: 2nd arg not string");
 
-  int fd = values->car->intv;
-  char *str = values->cdr->car->strv;
+  Val *str = values->cdr->car;
 
-  if (write(fd, str, strlen(str)) < 0)
+  if (write(fd, str_ptr(str), str->slen) < 0)
     error("write: error");
   return Nil;
 }
@@ -1885,20 +8376,60 @@ static Val *prim_read(void *root, Val **env, Val **list) {
 
   Val *values = eval_list(root, env, list);
 
-  if (values->car->type != TINT)
-    error("read: 1st arg not file descriptor");
+  int fd = fd_arg(values->car, "read: 1st arg not file descriptor");
   if (values->cdr->car->type != TINT)
     error("read: 2nd arg not int");
 
-  int fd = values->car->intv;
   int len = values->cdr->car->intv;
 
   char str[len + 1];
-  bzero(str, len + 1);
-  if (read(fd, &str, len) < 0)
+  ssize_t n = read(fd, &str, len);
+  if (n < 0)
     error("read: error");
 
-  return make_str(root, str);
+  return make_str_len(root, str, n);
+}
+
+// (read-into! fd bytes [start [end]]) -> the number of bytes read into
+// [start, end) of the buffer, 0 at end of file
+static Val *prim_read_into(void *root, Val **env, Val **list) {
+  char *msg = "read-into!: expected fd, bytes and optional range";
+  int n = length(*list);
+  if (n < 2 || n > 4)
+    error(msg);
+  Val *values = eval_list(root, env, list);
+  int fd = fd_arg(values->car, msg);
+  Val *b = values->cdr->car;
+  if (b->type != TBYTES)
+    error(msg);
+  size_t start, end;
+  bytes_range(values->cdr->cdr, b->blen, &start, &end, msg);
+
+  // Nothing can allocate until read returns, so the buffer doesn't move
+  ssize_t got = read(fd, b->bdata + start, end - start);
+  if (got < 0)
+    error("read-into!: error");
+  return make_int(root, got);
+}
+
+// (write-bytes fd bytes [start [end]]) -> the number of bytes written
+static Val *prim_write_bytes(void *root, Val **env, Val **list) {
+  char *msg = "write-bytes: expected fd, bytes and optional range";
+  int n = length(*list);
+  if (n < 2 || n > 4)
+    error(msg);
+  Val *values = eval_list(root, env, list);
+  int fd = fd_arg(values->car, msg);
+  Val *b = values->cdr->car;
+  if (b->type != TBYTES)
+    error(msg);
+  size_t start, end;
+  bytes_range(values->cdr->cdr, b->blen, &start, &end, msg);
+
+  ssize_t put = write(fd, b->bdata + start, end - start);
+  if (put < 0)
+    error("write-bytes: error");
+  return make_int(root, put);
 }
 
 // (seconds)
@@ -1919,7 +8450,7 @@ static Val *prim_sleep(void *root, Val **env, Val **list) {
   if (values->car->type != TINT)
     error("sleep: 1st arg not int");
 
-  int milliseconds = values->car->intv;
+  int64_t milliseconds = values->car->intv;
   struct timespec ts;
   ts.tv_sec = milliseconds / 1000;
   ts.tv_nsec = (milliseconds % 1000) * 1000000;
@@ -1939,37 +8470,44 @@ static Val *prim_exit(void *root, Val **env, Val **list) {
   return Nil;
 }
 
-// (open path append-or-trunc) -> fd
+// (open path append-or-trunc) -> handle
 static Val *prim_open(void *root, Val **env, Val **list) {
   if (length(*list) < 1)
     error("open: not given a path");
-  Val *values = eval_list(root, env, list);
-  if (values->car->type != TSTR)
+  DEFINE1(root, values);
+  *values = eval_list(root, env, list);
+  if (!is_str((*values)->car))
     error("open: 1st arg not string");
 
   // Check 2nd param (passed a mode to fopen(3))
-  char *mode = "r";
-  Val *rest = values->cdr;
-  if (rest != Nil && rest->car->type == TSTR) {
-    mode = rest->car->strv;
+  int flags = open_flags("r");
+  Val *rest = (*values)->cdr;
+  if (rest != Nil && is_str(rest->car)) {
+    char mode[rest->car->slen + 1];
+    flags = open_flags(str_to_c(rest->car, mode, "open: bad mode"));
   }
 
-  FILE *fd;
-  if ((fd = fopen(values->car->strv, mode)) == NULL) {
+  char path[(*values)->car->slen + 1];
+  str_to_c((*values)->car, path, "open: path contains a NUL byte");
+  int fd = open(path, flags, 0666);
+  if (fd < 0 && fd_reclaim(root))
+    fd = open(path, flags, 0666);
+  if (fd < 0) {
     error("open: error opening file");
   }
-  return make_int(root, fileno(fd));
+  return make_handle(root, fd);
 }
 
-// (close fd)
+// (close fd-or-handle)
 static Val *prim_close(void *root, Val **env, Val **list) {
   if (length(*list) != 1)
     error("close: not given exactly 1 arg");
   Val *values = eval_list(root, env, list);
-  if (values->car->type != TINT)
-    error("open: 1st arg not int");
+  int fd = fd_arg(values->car, "close: 1st arg not an open file descriptor");
 
-  if (close(values->car->intv) < 0) {
+  if (values->car->type == TRES)
+    values->car->fd = -1;
+  if (close(fd) < 0) {
     error("close: error closing file");
   }
   return Nil;
@@ -1980,10 +8518,9 @@ static Val *prim_isatty(void *root, Val **env, Val **list) {
   if (length(*list) != 1)
     error("isatty: not given exactly 1 args");
   Val *values = eval_list(root, env, list);
-  if (values->car->type != TINT)
-    error("isatty: 1st arg not int");
+  int fd = fd_arg(values->car, "isatty: 1st arg not file descriptor");
 
-  return isatty(values->car->intv) ? True : Nil;
+  return isatty(fd) ? True : Nil;
 }
 
 // (getenv str)
@@ -1991,10 +8528,12 @@ static Val *prim_getenv(void *root, Val **env, Val **list) {
   if (length(*list) != 1)
     error("getenv: not given exactly 1 args");
   Val *values = eval_list(root, env, list);
-  if (values->car->type != TSTR)
+  if (!is_str(values->car))
     error("getenv: 1st arg not string");
 
-  char *val = getenv(values->car->strv);
+  char name[values->car->slen + 1];
+  str_to_c(values->car, name, "getenv: name contains a NUL byte");
+  char *val = getenv(name);
   if (val == NULL) {
     return Nil;
   }
@@ -2005,7 +8544,7 @@ static Val *prim_getenv(void *root, Val **env, Val **list) {
 
 // {{{ primitives: net
 
-// (socket domain type protocol) -> fd
+// (socket domain type protocol) -> handle
 static Val *prim_socket(void *root, Val **env, Val **list) {
   if (length(*list) != 3)
     error("socket: not given exactly 3 args");
@@ -2021,16 +8560,19 @@ static Val *prim_socket(void *root, Val **env, Val **list) {
   int type = values->cdr->car->intv;
   int protocol = values->cdr->cdr->car->intv;
 
-  int fd;
-  if ((fd = socket(domain, type, protocol)) < 0) {
+  int fd = socket(domain, type, protocol);
+  if (fd < 0 && fd_reclaim(root))
+    fd = socket(domain, type, protocol);
+  if (fd < 0) {
     error("socket: error creating socket");
   }
 
   if (setnonblock(fd) < 0) {
+    close(fd);
     error("socket: error making socket non-blocking");
   }
 
-  return make_int(root, fd);
+  return make_handle(root, fd);
 }
 
 // (bind-inet socket-fd host port) -> fd
@@ -2038,15 +8580,14 @@ static Val *prim_bind_inet(void *root, Val **env, Val **list) {
   if (length(*list) != 3)
     error("bind-inet: not given exactly 3 args");
   Val *values = eval_list(root, env, list);
-  if (values->car->type != TINT)
-    error("bind-inet: 1st arg not int");
-  if (values->cdr->car->type != TSTR)
+  int socket_fd = fd_arg(values->car, "bind-inet: 1st arg not socket");
+  if (!is_str(values->cdr->car))
     error("bind-inet: 2nd arg not string");
   if (values->cdr->cdr->car->type != TINT)
     error("bind-inet: 3rd arg not int");
 
-  int socket_fd = values->car->intv;
-  char *host = values->cdr->car->strv;
+  char host[values->cdr->car->slen + 1];
+  str_to_c(values->cdr->car, host, "bind-inet: host contains a NUL byte");
   int port = values->cdr->cdr->car->intv;
 
   struct sockaddr_in serv_addr;
@@ -2067,12 +8608,10 @@ static Val *prim_listen(void *root, Val **env, Val **list) {
   if (length(*list) != 2)
     error("listen: not given exactly 2 args");
   Val *values = eval_list(root, env, list);
-  if (values->car->type != TINT)
-    error("listen: 1st arg not int");
+  int socket_fd = fd_arg(values->car, "listen: 1st arg not socket");
   if (values->cdr->car->type != TINT)
     error("listen: 2nd arg not int");
 
-  int socket_fd = values->car->intv;
   int backlog_size = values->cdr->car->intv;
 
   if (listen(socket_fd, backlog_size) < 0) {
@@ -2095,21 +8634,21 @@ static Val *prim_listen(void *root, Val **env, Val **list) {
   return Nil;
 }
 
-// (accept socket-fd)
+// (accept socket-fd) -> handle, or nil if no connection is pending
 static Val *prim_accept(void *root, Val **env, Val **list) {
   if (length(*list) != 1)
     error("accept: not given exactly 1 args");
-  Val *values = eval_list(root, env, list);
-  if (values->car->type != TINT)
-    error("accept: 1st arg not int");
-
-  int client_fd;
-  int socket_fd = values->car->intv;
+  // Keep the listening handle alive in case accept needs to run GC
+  DEFINE1(root, values);
+  *values = eval_list(root, env, list);
+  int socket_fd = fd_arg((*values)->car, "accept: 1st arg not socket");
   struct sockaddr_in c_addr;
   socklen_t c_addr_len = sizeof(c_addr);
 
-  if ((client_fd = accept(socket_fd, (struct sockaddr *)&c_addr, &c_addr_len)) <
-      0) {
+  int client_fd = accept(socket_fd, (struct sockaddr *)&c_addr, &c_addr_len);
+  if (client_fd < 0 && fd_reclaim(root))
+    client_fd = accept(socket_fd, (struct sockaddr *)&c_addr, &c_addr_len);
+  if (client_fd < 0) {
     switch (errno) {
     case EINTR:
       return Nil; // accept interupted by a system call
@@ -2134,7 +8673,7 @@ static Val *prim_accept(void *root, Val **env, Val **list) {
     }
   }
 
-  return make_int(root, client_fd);
+  return make_handle(root, client_fd);
 }
 
 // }}}
@@ -2201,7 +8740,8 @@ static Val *prim_ev_start(void *root, Val **env, Val **list) {
   wdata->id = ev_next_id();                                                    \
   wdata->type = (*type)->intv;                                                 \
   wdata->env = *env;                                                           \
-  wdata->callback = *cb;
+  wdata->callback = *cb;                                                       \
+  wdata->fd = Nil;
 
   switch ((*type)->intv) {
   case EV_STAT:
@@ -2210,11 +8750,11 @@ static Val *prim_ev_start(void *root, Val **env, Val **list) {
   case EV_READ:
   case EV_WRITE: {
     *arg1 = (*values)->cdr->cdr->car; // fd
-    if ((*arg1)->type != TINT)
-      error("ev-start: io watcher needs a file descriptor");
+    int fd = fd_arg(*arg1, "ev-start: io watcher needs a file descriptor");
 
     ev_setup(ev_io, ev_io_watcher_callback);
-    ev_io_set(w, (*arg1)->intv, wdata->type);
+    wdata->fd = *arg1;
+    ev_io_set(w, fd, wdata->type);
     ev_io_start(EV_DEFAULT_ w);
 
     return make_int(root, wdata->id);
@@ -2375,10 +8915,12 @@ static Val *prim_linenoise(void *root, Val **env, Val **list) {
 
   DEFINE2(root, values, str);
   *values = eval_list(root, env, list);
-  if ((*values)->car->type != TSTR)
+  if (!is_str((*values)->car))
     error("linenoise: 1st arg not string");
 
-  char *line = linenoise((*values)->car->strv);
+  char prompt[(*values)->car->slen + 1];
+  str_to_c((*values)->car, prompt, "linenoise: prompt contains a NUL byte");
+  char *line = linenoise(prompt);
   if (line == NULL) {
     return Nil;
   }
@@ -2393,10 +8935,12 @@ static Val *prim_linenoise_history_load(void *root, Val **env, Val **list) {
     error("linenoise-history-load: not given exactly 1 argument");
 
   Val *values = eval_list(root, env, list);
-  if (values->car->type != TSTR)
+  if (!is_str(values->car))
     error("linenoise-history-load: 1st arg not string");
 
-  linenoiseHistoryLoad(values->car->strv);
+  char *msg = "linenoise-history-load: path contains a NUL byte";
+  char path[values->car->slen + 1];
+  linenoiseHistoryLoad(str_to_c(values->car, path, msg));
   return Nil;
 }
 
@@ -2406,10 +8950,12 @@ static Val *prim_linenoise_history_add(void *root, Val **env, Val **list) {
     error("linenoise-history-add: not given exactly 1 argument");
 
   Val *values = eval_list(root, env, list);
-  if (values->car->type != TSTR)
+  if (!is_str(values->car))
     error("linenoise-history-add: 1st arg not string");
 
-  linenoiseHistoryAdd(values->car->strv);
+  char *msg = "linenoise-history-add: line contains a NUL byte";
+  char line[values->car->slen + 1];
+  linenoiseHistoryAdd(str_to_c(values->car, line, msg));
   return values->car;
 }
 
@@ -2419,10 +8965,12 @@ static Val *prim_linenoise_history_save(void *root, Val **env, Val **list) {
     error("linenoise-history-save: not given exactly 1 argument");
 
   Val *values = eval_list(root, env, list);
-  if (values->car->type != TSTR)
+  if (!is_str(values->car))
     error("linenoise-history-save: 1st arg not string");
 
-  linenoiseHistorySave(values->car->strv);
+  char *msg = "linenoise-history-save: path contains a NUL byte";
+  char path[values->car->slen + 1];
+  linenoiseHistorySave(str_to_c(values->car, path, msg));
   return Nil;
 }
 
@@ -2467,91 +9015,714 @@ static void define_constants(void *root, Val **env) {
 #undef defint
 }
 
+// Every primitive, in registration order. The index of a primitive in this
+// table is also how heap images refer to it.
+typedef struct PrimitiveDef {
+  char *name;
+  Primitive *fn;
+} PrimitiveDef;
+
+static const PrimitiveDef primitives[] = {
+    // Lists
+    {"cons", prim_cons},
+    {"list", prim_list},
+    {"car", prim_car},
+    {"cdr", prim_cdr},
+    {"set-car!", prim_set_car},
+
+    // Vectors
+    {"vec", prim_vec},
+    {"vec-len", prim_vec_len},
+    {"vec-ref", prim_vec_ref},
+    {"vec-set!", prim_vec_set},
+    {"vec-push!", prim_vec_push},
+    {"vec->list", prim_vec_to_list},
+    {"list->vec", prim_list_to_vec},
+
+    // Typed arrays
+    {"make-array", prim_make_array},
+    {"list->array", prim_list_to_array},
+    {"array->list", prim_array_to_list},
+    {"array-len", prim_array_len},
+    {"array-ref", prim_array_ref},
+    {"array-set!", prim_array_set},
+    {"array-sum", prim_array_sum},
+    {"array-min", prim_array_min},
+    {"array-max", prim_array_max},
+    {"array-dot", prim_array_dot},
+    {"array-add", prim_array_add},
+    {"array-mul", prim_array_mul},
+    {"array-prefix-sum", prim_array_prefix_sum},
+    {"array-histogram", prim_array_histogram},
+
+    // Bytevectors
+    {"make-bytes", prim_make_bytes},
+    {"bytes-len", prim_bytes_len},
+    {"bytes-slice", prim_bytes_slice},
+    {"bytes-ref", prim_bytes_ref},
+    {"bytes-set!", prim_bytes_set},
+    {"str->bytes", prim_str_to_bytes},
+    {"bytes->str", prim_bytes_to_str},
+
+    // Strings
+    {"str", prim_str},
+    {"str-len", prim_str_len},
+    {"str-sub", prim_str_sub},
+    {"str-split", prim_str_split},
+    {"str-join", prim_str_join},
+    {"str-index", prim_str_index},
+    {"str-contains?", prim_str_contains},
+    {"str-starts-with?", prim_str_starts_with},
+    {"str-replace", prim_str_replace},
+    {"str-trim", prim_str_trim},
+    {"str-valid-utf8?", prim_str_valid_utf8},
+    {"str-char-len", prim_str_char_len},
+    {"str-char-offset", prim_str_char_offset},
+    {"str-char-at", prim_str_char_at},
+    {"str->codepoints", prim_str_to_codepoints},
+    {"codepoints->str", prim_codepoints_to_str},
+    {"str-upcase", prim_str_upcase},
+    {"str-downcase", prim_str_downcase},
+
+    // String builders
+    {"sb-new", prim_sb_new},
+    {"sb-append!", prim_sb_append},
+    {"sb-len", prim_sb_len},
+    {"sb->str", prim_sb_to_str},
+
+    // Regular expressions
+    {"re-compile", prim_re_compile},
+    {"re-match", prim_re_match},
+    {"re-find-all", prim_re_find_all},
+    {"re-replace", prim_re_replace},
+
+    // JSON
+    {"json-parse", prim_json_parse},
+    {"json-stringify", prim_json_stringify},
+    {"json-parser", prim_json_parser},
+    {"json-feed!", prim_json_feed},
+
+    // Language
+    {"def", prim_def},
+    {"def-global", prim_def_global},
+    {"set", prim_set},
+    {"fn", prim_fn},
+    {"if", prim_if},
+    {"do", prim_do},
+    {"while", prim_while},
+    {"eq?", prim_eq},
+    {"apply", prim_apply},
+    {"type", prim_type},
+    {"eval", prim_eval},
+    {"read-sexp", prim_read_sexp},
+    {"sym", prim_sym},
+
+    // Macro
+    {"quote", prim_quote},
+    {"gensym", prim_gensym},
+    {"macro", prim_macro},
+    {"macro-expand", prim_macro_expand},
+
+    // Object
+    {"obj", prim_obj},
+    {"obj-get", prim_obj_get},
+    {"obj-set", prim_obj_set},
+    {"obj-del", prim_obj_del},
+    {"obj-proto", prim_obj_proto},
+    {"obj-proto-set!", prim_obj_proto_set},
+    {"obj->alist", prim_obj_to_alist},
+
+    // Math
+    {"+", prim_plus},
+    {"-", prim_minus},
+    {"*", prim_mul},
+    {"/", prim_div},
+    {"mod", prim_mod},
+    {"sqrt", prim_sqrt},
+    {"exp", prim_exp},
+    {"log", prim_log},
+    {"floor", prim_floor},
+    {"ceil", prim_ceil},
+    {"round", prim_round},
+    {"<", prim_lt},
+    {"=", prim_num_eq},
+    {"rand", prim_rand},
+
+    // Error
+    {"error", prim_error},
+    {"trap-error", prim_trap_error},
+
+    // Profile
+    {"profile", prim_profile},
+    {"bench", prim_bench},
+
+    // GC
+    {"gc", prim_gc},
+    {"gc-stats", prim_gc_stats},
+    {"gc-sites", prim_gc_sites},
+    {"freeze-heap", prim_freeze_heap},
+    {"with-region", prim_with_region},
+
+    // Weak
+    {"weak-ref", prim_weak_ref},
+    {"weak-deref", prim_weak_deref},
+    {"weak-table", prim_weak_table},
+    {"weak-table-get", prim_weak_table_get},
+    {"weak-table-set!", prim_weak_table_set},
+    {"weak-table-del!", prim_weak_table_del},
+    {"weak-table-count", prim_weak_table_count},
+
+    // OS
+    {"pr-str", prim_pr_str},
+    {"write", prim_write},
+    {"read", prim_read},
+    {"read-into!", prim_read_into},
+    {"write-bytes", prim_write_bytes},
+    {"seconds", prim_seconds},
+    {"sleep", prim_sleep},
+    {"exit", prim_exit},
+    {"open", prim_open},
+    {"close", prim_close},
+    {"isatty", prim_isatty},
+    {"getenv", prim_getenv},
+
+    // Net
+    {"socket", prim_socket},
+    {"bind-inet", prim_bind_inet},
+    {"listen", prim_listen},
+    {"accept", prim_accept},
+
+    // Ev
+    {"ev-start", prim_ev_start},
+    {"ev-stop", prim_ev_stop},
+
+    // Term
+    {"term-raw", prim_term_raw},
+
+    // Linenoise
+    {"linenoise", prim_linenoise},
+    {"linenoise-history-load", prim_linenoise_history_load},
+    {"linenoise-history-add", prim_linenoise_history_add},
+    {"linenoise-history-save", prim_linenoise_history_save},
+
+    {NULL, NULL},
+};
+
 static void define_primitives(void *root, Val **env) {
-  // Lists
-  add_primitive(root, env, "cons", prim_cons);
-  add_primitive(root, env, "car", prim_car);
-  add_primitive(root, env, "cdr", prim_cdr);
-  add_primitive(root, env, "set-car!", prim_set_car);
-
-  // Strings
-  add_primitive(root, env, "str", prim_str);
-  add_primitive(root, env, "str-len", prim_str_len);
-
-  // Language
-  add_primitive(root, env, "def", prim_def);
-  add_primitive(root, env, "def-global", prim_def_global);
-  add_primitive(root, env, "set", prim_set);
-  add_primitive(root, env, "fn", prim_fn);
-  add_primitive(root, env, "if", prim_if);
-  add_primitive(root, env, "do", prim_do);
-  add_primitive(root, env, "while", prim_while);
-  add_primitive(root, env, "eq?", prim_eq);
-  add_primitive(root, env, "apply", prim_apply);
-  add_primitive(root, env, "type", prim_type);
-  add_primitive(root, env, "eval", prim_eval);
-  add_primitive(root, env, "read-sexp", prim_read_sexp);
-  add_primitive(root, env, "sym", prim_sym);
-
-  // Macro
-  add_primitive(root, env, "quote", prim_quote);
-  add_primitive(root, env, "gensym", prim_gensym);
-  add_primitive(root, env, "macro", prim_macro);
-  add_primitive(root, env, "macro-expand", prim_macro_expand);
-
-  // Object
-  add_primitive(root, env, "obj", prim_obj);
-  add_primitive(root, env, "obj-get", prim_obj_get);
-  add_primitive(root, env, "obj-set", prim_obj_set);
-  add_primitive(root, env, "obj-del", prim_obj_del);
-  add_primitive(root, env, "obj-proto", prim_obj_proto);
-  add_primitive(root, env, "obj-proto-set!", prim_obj_proto_set);
-  add_primitive(root, env, "obj->alist", prim_obj_to_alist);
-
-  // Math
-  add_primitive(root, env, "+", prim_plus);
-  add_primitive(root, env, "-", prim_minus);
-  add_primitive(root, env, "<", prim_lt);
-  add_primitive(root, env, "=", prim_num_eq);
-  add_primitive(root, env, "rand", prim_rand);
-
-  // Error
-  add_primitive(root, env, "error", prim_error);
-  add_primitive(root, env, "trap-error", prim_trap_error);
-
-  // OS
-  add_primitive(root, env, "pr-str", prim_pr_str);
-  add_primitive(root, env, "write", prim_write);
-  add_primitive(root, env, "read", prim_read);
-  add_primitive(root, env, "seconds", prim_seconds);
-  add_primitive(root, env, "sleep", prim_sleep);
-  add_primitive(root, env, "exit", prim_exit);
-  add_primitive(root, env, "open", prim_open);
-  add_primitive(root, env, "close", prim_close);
-  add_primitive(root, env, "isatty", prim_isatty);
-  add_primitive(root, env, "getenv", prim_getenv);
+  for (const PrimitiveDef *p = primitives; p->name; p++)
+    add_primitive(root, env, p->name, p->fn);
+}
+// }}}
 
-  // Net
-  add_primitive(root, env, "socket", prim_socket);
-  add_primitive(root, env, "bind-inet", prim_bind_inet);
-  add_primitive(root, env, "listen", prim_listen);
-  add_primitive(root, env, "accept", prim_accept);
+// {{{ prelude
 
-  // Ev
-  add_primitive(root, env, "ev-start", prim_ev_start);
-  add_primitive(root, env, "ev-stop", prim_ev_stop);
+// The prelude is compiled at build time by `shi-boot --compile-prelude`: every
+// top-level form is read and macro-expanded once, then serialized in a compact
+// binary form embedded as `prelude_image`. At startup the expanded forms are
+// rebuilt directly and evaluated, skipping the reader and the expansion of
+// `defn`, `defmacro` and friends.
+//
+// Format: "SHIP" <version> <nsyms> (<len> <name>)* <nforms> <expr>*
+// where numbers are LEB128 varints and an <expr> is one of:
+//   'n'                      nil
+//   'i' <zigzag varint>      integer
+//   's' <len> <bytes>        string
+//   'y' <symbol index>       symbol
+//   'l' <n> <expr>*n <expr>  list of n items followed by its tail
+
+#define PRELUDE_IMAGE_VERSION 4
+
+#ifdef SHI_BOOTSTRAP
+
+typedef struct ImageBuf {
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+} ImageBuf;
+
+static void image_put(ImageBuf *b, const void *data, size_t len) {
+  if (b->len + len > b->cap) {
+    while (b->len + len > b->cap)
+      b->cap = b->cap ? b->cap * 2 : 4096;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+static void image_put_byte(ImageBuf *b, unsigned char c) {
+  image_put(b, &c, 1);
+}
+
+static void image_put_varint(ImageBuf *b, uint64_t v) {
+  do {
+    unsigned char c = v & 0x7f;
+    v >>= 7;
+    image_put_byte(b, v ? c | 0x80 : c);
+  } while (v);
+}
+
+// Names of the symbols referenced by the image, in index order. Names are
+// kept instead of the symbols themselves as GC may move those.
+static char **image_syms = NULL;
+static size_t image_nsyms = 0;
+
+static size_t image_sym_index(char *name) {
+  for (size_t i = 0; i < image_nsyms; i++)
+    if (strcmp(image_syms[i], name) == 0)
+      return i;
+  image_syms = realloc(image_syms, sizeof(char *) * (image_nsyms + 1));
+  image_syms[image_nsyms] = strdup(name);
+  return image_nsyms++;
+}
+
+// Encodes v, returns false if it contains values that can't be serialized
+// (e.g. functions spliced in by a macro).
+static bool image_encode(ImageBuf *b, Val *v) {
+  switch (v->type) {
+  case TNIL:
+    image_put_byte(b, 'n');
+    return true;
+  case TINT:
+    image_put_byte(b, 'i');
+    image_put_varint(b, ((uint64_t)v->intv << 1) ^ (uint64_t)(v->intv >> 63));
+    return true;
+  case TBIG:
+    image_put_byte(b, 'b');
+    image_put_byte(b, v->sign < 0);
+    image_put_varint(b, v->nlimbs);
+    for (int i = 0; i < v->nlimbs; i++)
+      image_put_varint(b, v->limbs[i]);
+    return true;
+  case TFLOAT:
+    image_put_byte(b, 'f');
+    image_put(b, &v->floatv, sizeof(double));
+    return true;
+  case TSTR:
+  case TSLICE:
+    image_put_byte(b, 's');
+    image_put_varint(b, v->slen);
+    image_put(b, str_ptr(v), v->slen);
+    return true;
+  case TSYM:
+    image_put_byte(b, 'y');
+    image_put_varint(b, image_sym_index(v->symv));
+    return true;
+  case TCELL: {
+    size_t n = 0;
+    Val *p = v;
+    for (; p->type == TCELL; p = p->cdr)
+      n++;
+    image_put_byte(b, 'l');
+    image_put_varint(b, n);
+    for (p = v; p->type == TCELL; p = p->cdr)
+      if (!image_encode(b, p->car))
+        return false;
+    return image_encode(b, p);
+  }
+  default:
+    return false;
+  }
+}
+
+// Reads, expands and evaluates the text prelude, printing the compiled image
+// as C source on stdout.
+static void compile_prelude(void *root, Val **env) {
+  DEFINE2(root, expr, expanded);
+  ImageBuf forms = {NULL, 0, 0};
+  size_t nforms = 0;
+
+  Reader *r = reader_new(prelude_contents, strlen(prelude_contents));
+  for (;;) {
+    *expr = read_expr(r, root);
+    if (!*expr)
+      break;
+    if (*expr == Cparen || *expr == Ccurly || *expr == Cbracket ||
+        *expr == Dot)
+      error("compile-prelude: stray token in prelude");
+
+    // Expand top-level macros until the head is not a macro anymore
+    *expanded = *expr;
+    for (;;) {
+      Val *e = macroexpand(root, env, expanded);
+      if (e == *expanded)
+        break;
+      *expanded = e;
+    }
+
+    size_t mark = forms.len;
+    if (!image_encode(&forms, *expanded)) {
+      forms.len = mark;
+      image_encode(&forms, *expr);
+    }
+    nforms++;
+
+    // Later forms may depend on the macros and functions defined by this one
+    eval(root, env, expanded);
+  }
+  reader_destroy(r);
+
+  ImageBuf image = {NULL, 0, 0};
+  image_put(&image, "SHIP", 4);
+  image_put_byte(&image, PRELUDE_IMAGE_VERSION);
+  image_put_varint(&image, image_nsyms);
+  for (size_t i = 0; i < image_nsyms; i++) {
+    image_put_varint(&image, strlen(image_syms[i]));
+    image_put(&image, image_syms[i], strlen(image_syms[i]));
+  }
+  image_put_varint(&image, nforms);
+  image_put(&image, forms.data, forms.len);
+
+  printf("// Generated from prelude.shi by `shi-boot --compile-prelude`.\n");
+  printf("static const unsigned char prelude_image[] = {");
+  for (size_t i = 0; i < image.len; i++)
+    printf("%s0x%02x,", i % 12 ? " " : "\n  ", image.data[i]);
+  printf("\n};\n");
+  free(image.data);
+  free(forms.data);
+}
+
+// Reads and evaluates the text prelude.
+static void load_prelude(void *root, Val **env) {
+  DEFINE2(root, read_sexp_sym, prelude);
+  *read_sexp_sym = intern(root, "read-sexp");
+  *prelude = make_str(root, (char *)prelude_contents);
+  *prelude = cons(root, prelude, &Nil);
+  *prelude = cons(root, read_sexp_sym, prelude);
+  *prelude = eval(root, env, prelude);
+  eval(root, env, prelude);
+}
+
+#else
+
+typedef struct ImageReader {
+  const unsigned char *p;
+  const unsigned char *end;
+} ImageReader;
+
+static uint64_t image_varint(ImageReader *r) {
+  uint64_t v = 0;
+  for (int shift = 0; r->p < r->end; shift += 7) {
+    unsigned char c = *r->p++;
+    v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return v;
+  }
+  error("prelude: truncated image");
+}
+
+// Decodes one expression. `syms` is a root frame holding the interned
+// symbols of the image, see load_prelude().
+static Val *image_decode(ImageReader *r, void *root, void **syms) {
+  if (r->p >= r->end)
+    error("prelude: truncated image");
+  switch (*r->p++) {
+  case 'n':
+    return Nil;
+  case 'i': {
+    uint64_t v = image_varint(r);
+    return make_int(root, (int64_t)((v >> 1) ^ -(v & 1)));
+  }
+  case 'f': {
+    if (r->end - r->p < (ptrdiff_t)sizeof(double))
+      error("prelude: truncated image");
+    double d;
+    memcpy(&d, r->p, sizeof(double));
+    r->p += sizeof(double);
+    return make_float(root, d);
+  }
+  case 'b': {
+    if (r->p >= r->end)
+      error("prelude: truncated image");
+    int sign = *r->p++ ? -1 : 1;
+    Big b = big_alloc(image_varint(r));
+    b.sign = sign;
+    for (size_t i = 0; i < b.n; i++)
+      b.d[i] = image_varint(r);
+    return make_big(root, &b);
+  }
+  case 's': {
+    size_t len = image_varint(r);
+    Val *str = make_str_len(root, (const char *)r->p, len);
+    r->p += len;
+    return str;
+  }
+  case 'y':
+    return syms[image_varint(r) + 1];
+  case 'l': {
+    DEFINE3(root, head, item, tail);
+    size_t n = image_varint(r);
+    *head = Nil;
+    for (size_t i = 0; i < n; i++) {
+      *item = image_decode(r, root, syms);
+      *head = cons(root, item, head);
+    }
+    *tail = image_decode(r, root, syms);
+    Val *ret = reverse(*head);
+    (*head)->cdr = *tail;
+    write_barrier(&(*head)->cdr);
+    return ret;
+  }
+  default:
+    error("prelude: bad image");
+  }
+}
+
+// Rebuilds and evaluates the forms of the compiled prelude one by one.
+static void load_prelude(void *root, Val **env) {
+  ImageReader r = {prelude_image, prelude_image + sizeof(prelude_image)};
+  if (memcmp(r.p, "SHIP", 4) != 0 || r.p[4] != PRELUDE_IMAGE_VERSION)
+    error("prelude: bad image");
+  r.p += 5;
+
+  // Interned symbols are kept in a heap allocated root frame so that the GC
+  // keeps them up to date while the forms are being rebuilt.
+  size_t nsyms = image_varint(&r);
+  void **syms = malloc(sizeof(void *) * (nsyms + 2));
+  syms[0] = root;
+  for (size_t i = 1; i <= nsyms; i++)
+    syms[i] = NULL;
+  syms[nsyms + 1] = ROOT_END;
+  root = syms;
+
+  for (size_t i = 0; i < nsyms; i++) {
+    size_t len = image_varint(&r);
+    char name[len + 1];
+    memcpy(name, r.p, len);
+    name[len] = '\0';
+    r.p += len;
+    syms[i + 1] = intern(root, name);
+  }
+
+  DEFINE1(root, expr);
+  size_t nforms = image_varint(&r);
+  for (size_t i = 0; i < nforms; i++) {
+    alloc_site = SITE_READER;
+    *expr = image_decode(&r, root, syms);
+    alloc_site = SITE_DEFAULT;
+    eval(root, env, expr);
+  }
+  free(syms);
+}
+
+#endif
+
+// }}}
+
+// {{{ image
+
+// Heap images let applications skip their whole initialisation. With
+// `--save-image path [file ...]` the prelude and the given files are evaluated
+// in the global env, then the heap is compacted and written to `path`. With
+// `--image path` the heap is mapped back from the file and `shi-main` runs
+// right away.
+//
+// The file is a page holding an ImageHeader followed by the heap contents.
+// Heap pointers are stored as offsets from the start of the heap (biased so
+// that they never clash with NULL or constants), constants such as nil as
+// small odd numbers and primitives as their index in `primitives`, so that the
+// image can be relocated wherever it gets mapped.
+
+#define IMAGE_MAGIC "SHIIMG\0"
+#define IMAGE_VERSION 13
+#define IMAGE_HEADER_SIZE 4096
+#define IMAGE_HEAP_BIAS 16
+
+typedef struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t memory_size;
+  uint64_t nused;
+  uint64_t symbols;
+  uint64_t env;
+  int64_t gensym_count;
+} ImageHeader;
+
+// Set from the command line flags
+static char *image_save_path = NULL;
+static bool image_loaded = false;
+
+static void image_constants(Val *consts[6]) {
+  consts[0] = True;
+  consts[1] = Nil;
+  consts[2] = Dot;
+  consts[3] = Cparen;
+  consts[4] = Ccurly;
+  consts[5] = Cbracket;
+}
+
+static uint64_t image_encode_ptr(Val *p) {
+  if (p == NULL)
+    return 0;
+  ptrdiff_t offset = (uint8_t *)p - (uint8_t *)memory;
+  if (offset >= 0 && (size_t)offset < mem_nused)
+    return offset + IMAGE_HEAP_BIAS;
+  Val *consts[6];
+  image_constants(consts);
+  for (int i = 0; i < 6; i++)
+    if (p == consts[i])
+      return i * 2 + 1;
+  error("save-image: pointer outside of the heap");
+}
+
+static Val *image_decode_ptr(uint64_t v) {
+  if (v == 0)
+    return NULL;
+  if (v & 1) {
+    Val *consts[6];
+    image_constants(consts);
+    if (v / 2 >= 6)
+      error("image: bad constant");
+    return consts[v / 2];
+  }
+  if (v - IMAGE_HEAP_BIAS >= mem_nused)
+    error("image: bad pointer");
+  return (Val *)((uint8_t *)memory + v - IMAGE_HEAP_BIAS);
+}
+
+static size_t image_primitive_index(Primitive *fn) {
+  for (size_t i = 0; primitives[i].name; i++)
+    if (primitives[i].fn == fn)
+      return i;
+  error("save-image: unknown primitive");
+}
 
-  // Term
-  add_primitive(root, env, "term-raw", prim_term_raw);
+// Applies encode (or decode) to every pointer of the heap copy at `heap`.
+static void image_relocate(uint8_t *heap, size_t nused, bool encode) {
+  size_t nprims = 0;
+  while (primitives[nprims].name)
+    nprims++;
+
+  for (uint8_t *p = heap; p < heap + nused; p += obj_size((Val *)p)) {
+    Val *obj = (Val *)p;
+    if (!encode && obj->type == TWEAK)
+      registry_add(&weak_refs, &weak_nrefs, &weak_refs_cap, obj);
+    if (!encode && obj->type == TWTABLE)
+      registry_add(&weak_tables, &weak_ntables, &weak_tables_cap, obj);
+    // File descriptors do not carry over to another process
+    if (!encode && obj->type == TRES)
+      obj->fd = -1;
+    if (obj->type == TPRI) {
+      if (encode) {
+        obj->priv = (Primitive *)(uintptr_t)image_primitive_index(obj->priv);
+      } else {
+        size_t i = (uintptr_t)obj->priv;
+        if (i >= nprims)
+          error("image: bad primitive");
+        obj->priv = primitives[i].fn;
+      }
+      continue;
+    }
+    size_t n;
+    Val **fields = obj_pointers_all(obj, &n);
+    for (size_t i = 0; i < n; i++) {
+      if (encode)
+        fields[i] = (Val *)(uintptr_t)image_encode_ptr(fields[i]);
+      else
+        fields[i] = image_decode_ptr((uintptr_t)fields[i]);
+    }
+  }
+}
+
+// Compacts the heap and writes it to path.
+static void save_image(void *root, Val **env, char *path) {
+  if (ev_watchers != NULL)
+    error("save-image: event watchers are active");
+  if (perm_nspaces > 0)
+    error("save-image: heap is frozen");
+  gc_full(root);
+
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.memory_size = MEMORY_SIZE;
+  header.nused = mem_nused;
+  header.symbols = image_encode_ptr(symbols);
+  header.env = image_encode_ptr(*env);
+  header.gensym_count = gensym_count;
+
+  uint8_t *heap = malloc(mem_nused);
+  memcpy(heap, memory, mem_nused);
+  image_relocate(heap, mem_nused, true);
+
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    error("save-image: error opening file");
+  char page[IMAGE_HEADER_SIZE];
+  memset(page, 0, sizeof(page));
+  memcpy(page, &header, sizeof(header));
+  bool ok = fwrite(page, sizeof(page), 1, f) == 1 &&
+            fwrite(heap, 1, mem_nused, f) == mem_nused;
+  ok = fclose(f) == 0 && ok;
+  free(heap);
+  if (!ok)
+    error("save-image: error writing file");
+}
+
+// Maps the image at path as the current heap and returns its global env.
+static Val *load_image(char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    error("image: error opening file");
+  ImageHeader header;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != IMAGE_VERSION)
+    error("image: not a shi heap image");
+  if (header.memory_size != MEMORY_SIZE || header.nused > MEMORY_SIZE)
+    error("image: heap size mismatch");
+
+  // Map the file privately over the start of a fresh semispace, so that the
+  // pages are loaded lazily and the rest of the semispace stays usable.
+  memory = alloc_semispace();
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t len = roundup(header.nused, page);
+  if (len > 0 &&
+      mmap(memory, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+           IMAGE_HEADER_SIZE) == MAP_FAILED)
+    error("image: error mapping file");
+  close(fd);
+
+  mem_nused = header.nused;
+  image_relocate(memory, mem_nused, false);
+  // Weak tables hash their keys by address
+  for (size_t i = 0; i < weak_ntables; i++)
+    weak_rehash(weak_tables[i], false);
+  symbols = image_decode_ptr(header.symbols);
+  gensym_count = header.gensym_count;
+  image_loaded = true;
+  return image_decode_ptr(header.env);
+}
 
-  // Linenoise
-  add_primitive(root, env, "linenoise", prim_linenoise);
-  add_primitive(root, env, "linenoise-history-load",
-                prim_linenoise_history_load);
-  add_primitive(root, env, "linenoise-history-add", prim_linenoise_history_add);
-  add_primitive(root, env, "linenoise-history-save",
-                prim_linenoise_history_save);
+// Reads and evaluates every expression of the file at path in env.
+static void load_file(void *root, Val **env, char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    error("load: error opening file");
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *contents = malloc(size + 1);
+  size_t nread = fread(contents, 1, size, f);
+  contents[nread] = '\0';
+  fclose(f);
+
+  DEFINE1(root, expr);
+  Reader *r = reader_new(contents, strlen(contents));
+  free(contents);
+  for (;;) {
+    *expr = read_expr(r, root);
+    if (!*expr)
+      break;
+    if (*expr == Cparen || *expr == Ccurly || *expr == Cbracket ||
+        *expr == Dot)
+      error("load: stray token");
+    eval(root, env, expr);
+  }
+  reader_destroy(r);
 }
+
 // }}}
 
 // {{{ main
@@ -2574,16 +9745,20 @@ static void shi_init_cb(struct ev_loop *loop, ev_timer *w, int revents) {
   // the stack from previous `root`s. But, since this is our entrypoint and
   // that we have no good ways of relaying root to shi_init_cb, it's safe.
   void *root = NULL;
-  DEFINE4(root, env, shi_main, read_sexp_sym, prelude);
+  DEFINE3(root, env, shi_main, files);
   *env = (Val *)w->data;
 
-  // Read and evaluate prelude
-  *read_sexp_sym = intern(root, "read-sexp");
-  *prelude = make_str(root, (char *)prelude_contents);
-  *prelude = cons(root, prelude, &Nil);
-  *prelude = cons(root, read_sexp_sym, prelude);
-  *prelude = eval(root, env, prelude);
-  eval(root, env, prelude);
+  if (!image_loaded)
+    load_prelude(root, env);
+
+  if (image_save_path != NULL) {
+    // Files to preload are the arguments following the image path
+    *files = env_get(env, intern(root, "*args*"))->cdr->cdr;
+    for (; *files != Nil; *files = (*files)->cdr)
+      load_file(root, env, (*files)->car->strv);
+    save_image(root, env, image_save_path);
+    exit(0);
+  }
 
   *shi_main = intern(root, "shi-main");
   *shi_main = cons(root, shi_main, &Nil);
@@ -2597,28 +9772,63 @@ int main(int argc, char **argv) {
   // Debug flags
   debug_gc = get_env_flag("SHI_DEBUG_GC");
   always_gc = get_env_flag("SHI_ALWAYS_GC");
+  char *gc_order = getenv("SHI_GC_ORDER");
+  gc_hier = gc_order && strcmp(gc_order, "hier") == 0;
+  char *threads = getenv("SHI_GC_THREADS");
+  if (threads && atoi(threads) > 1)
+    gc_threads = atoi(threads) < 64 ? atoi(threads) : 64;
+  pretenuring = !get_env_flag("SHI_NO_PRETENURE");
+#ifdef X86_SIMD
+  cpu_avx2 = __builtin_cpu_supports("avx2") && !get_env_flag("SHI_NO_SIMD");
+  cpu_sse2 = !get_env_flag("SHI_NO_SIMD");
+#endif
+  if (get_env_flag("SHI_STATS"))
+    atexit(print_stats);
+
+  // Heap image flags, removed from *args*
+  char *image_path = NULL;
+  int argstart = 1;
+  if (argc >= 3 && strcmp(argv[1], "--save-image") == 0) {
+    image_save_path = argv[2];
+    argstart = 3;
+  } else if (argc >= 3 && strcmp(argv[1], "--image") == 0) {
+    image_path = argv[2];
+    argstart = 3;
+  }
 
-  // Memory allocation
-  memory = alloc_semispace();
-
-  // Constants and primitives
-  symbols = Nil;
   void *root = NULL;
   DEFINE4(root, env, sh_args_sym, sh_args, sh_arg);
-  *env = make_obj_alist(root, &Nil, &Nil);
-  define_constants(root, env);
-  define_primitives(root, env);
+  if (image_path != NULL) {
+    *env = load_image(image_path);
+  } else {
+    // Memory allocation
+    memory = alloc_semispace();
+
+    // Constants and primitives
+    symbols = Nil;
+    *env = make_obj_alist(root, &Nil, &Nil);
+    define_constants(root, env);
+    define_primitives(root, env);
+  }
 
   // Register shell args in env
   *sh_args_sym = intern(root, "*args*");
-  *sh_args = Nil;
-  for (int i = 0; i < argc; i++) {
+  *sh_arg = make_str(root, argv[0]);
+  *sh_args = cons(root, sh_arg, &Nil);
+  for (int i = argstart; i < argc; i++) {
     *sh_arg = make_str(root, argv[i]);
     *sh_args = cons(root, sh_arg, sh_args);
   }
   *sh_args = reverse(*sh_args);
   env_set(root, env, sh_args_sym, sh_args);
 
+#ifdef SHI_BOOTSTRAP
+  if (argc == 2 && strcmp(argv[1], "--compile-prelude") == 0) {
+    compile_prelude(root, env);
+    return 0;
+  }
+#endif
+
   // Start event loop
   ev_timer *shi_init_w = malloc(sizeof(ev_timer));
   ev_timer_init(shi_init_w, shi_init_cb, 0., 0.);
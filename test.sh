@@ -45,6 +45,20 @@ function run() {
   fi
 }
 
+# Runs a test, then runs it again with the collector in hier copy order and
+# with 4 collector threads. Threads only copy heaps of 4MB and more.
+function run_gc() {
+  run "$@"
+  if [[ -z "$filter" || "$1" =~ "$filter" ]]; then
+    echo -n "Testing $1 (SHI_GC_ORDER=hier) ... "
+    SHI_GC_ORDER=hier do_run "$@"
+    echo ok
+    echo -n "Testing $1 (SHI_GC_THREADS=4) ... "
+    SHI_GC_THREADS=4 do_run "$@"
+    echo ok
+  fi
+}
+
 # Basic data types
 run integer 1 1
 run integer -1 -1
@@ -64,6 +78,20 @@ run '<' t '(< 2 3)'
 run '<' '()' '(< 3 3)'
 run '<' '()' '(< 4 3)'
 
+run '*' 24 '(* 2 3 4)'
+run / -3 '(/ -7 2)'
+run mod '(1 -1 0)' '(list (mod -7 2) (mod 7 -2) (mod 8 2))'
+run 'int overflow' 9223372036854775808 '(+ 9223372036854775807 1)'
+run bignum 99999999999999999999999999999000000000000000000000000000000 \
+  '(* 99999999999999999999999999999 1000000000000000000000000000000)'
+run bignum 9223372036854775807 '(- (+ 9223372036854775807 1) 1)'
+run bignum '(t t)' '(def f (* 340282366920938463463374607431768211457 18446744073709551629))
+  (list (= (/ f 18446744073709551629) 340282366920938463463374607431768211457) (< 18446744073709551629 f))'
+run float 0.30000000000000004 '(* 3 0.1)'
+run float '(-0.0025 3.5 1.0)' '(list -2.5e-3 (/ 7 2.0) (+ 0.5 0.5))'
+run float '(t ())' '(list (< 1 1.5) (= 2 2.5))'
+run 'float math' '(1.4142135623730951 2 3 -3)' '(list (sqrt 2) (floor 2.7) (ceil 2.1) (round -2.5))'
+
 run 'literal list' '(a b c)' "'(a b c)"
 run 'literal list' '(a b . c)' "'(a b . c)"
 
@@ -76,6 +104,30 @@ run cdr "(b c)" "(cdr '(a b c))"
 
 run set-car! "(x . b)" "(def obj (cons 'a 'b)) (set-car! obj 'x) obj"
 
+# Vectors
+run vec '[1 2 (3)]' "[1 (+ 1 1) '(3)]"
+run vec-ref '(c 3)' "(def v (list->vec '(a b c))) (list (vec-ref v 2) (vec-len v))"
+run vec-set! '[a x c]' "(def v (vec 'a 'b 'c)) (vec-set! v 1 'x) v"
+run vec-push! '(100 99 (0 1 2))' "(def v []) (def i 0)
+  (while (< i 100) (vec-push! v i) (set i (+ i 1)))
+  (list (vec-len v) (nth v 99) (vec->list (vec 0 1 2)))"
+run vec-print-long '(24579 24579 "[12345 12345")' '(def s "12345,") (def i 0) (while (< i 12) (set s (str s s)) (set i (+ i 1)))
+  (def v (json-parse (str "[" s "0]"))) (list (str-len (pr-str v)) (str-len (pr-str (vec->list v))) (str-sub (pr-str v) 0 12))'
+
+# Typed arrays
+run array '(0.0 2.5 0.0)' "(def a (make-array 'f64 3)) (array-set! a 1 2.5) (array->list a)"
+run array-sum '(91 91 91.0 18446744073709551614)' "(def l '(3 -1 4 1 5 -9 2 6 5 3 5 8 9 7 9 3 2 3 8 4 6 2 6))
+  (list (array-sum (list->array 'i32 l)) (array-sum (list->array 'i64 l))
+        (array-sum (list->array 'f64 l))
+        (array-sum (list->array 'i64 '(9223372036854775807 9223372036854775807))))"
+run array-min '(-9 9 685)' "(def a (list->array 'i64 '(3 -1 4 1 5 -9 2 6 5 3 5 8 9 7 9 3 2 3 8 4 6 2 6)))
+  (list (array-min a) (array-max a) (array-dot a a))"
+run array-add '((2 4 6 8 10 12 14 16 18) (1 4 9 16 25 36 49 64 81))' "(def a (list->array 'i32 '(1 2 3 4 5 6 7 8 9)))
+  (list (array->list (array-add a a)) (array->list (array-mul a a)))"
+run array-prefix-sum '(1.0 3.0 6.0)' "(array->list (array-prefix-sum (list->array 'f64 '(1 2 3))))"
+run array-histogram '(1 1 10 11)' "(array->list (array-histogram
+  (list->array 'f64 '(3 -1 4 1 5 -9 2 6 5 3 5 8 9 7 9 3 2 3 8 4 6 2 6)) -10 10 4))"
+
 # Comments
 run comment 5 "
   ; 2
@@ -171,9 +223,69 @@ run recursion 55 '(def f (fn (x) (if (= x 0) 0 (+ (f (+ x -1)) x)))) (f 10)'
 # string
 run string '"asd"' '"asd"'
 run string-escape '"a\n\t\"sd"' '"a\n\t\"sd"'
+run str-len '(5 0)' '(list (str-len (str "ab" "" "cde")) (str-len ""))'
+run string-nul '("a\x0z" 3 t ())' '(list "a\x0z" (str-len "a\x0z") (eq? "a\x0z" (str "a\x0" "z")) (eq? "a\x0z" "a\x0y"))'
+run string-nul '"sym: string contains a NUL byte"' '(trap-error (fn () (sym "a\x0")) (fn (e) e))'
+run str-sub '("lo, wor" "lo, world and more" "wo" str t)' '(def s (str-sub "hello, world and more" 3))
+  (list (str-sub s 0 7) s (str-sub (str-sub s 2) 2 4) (type s) (eq? s "lo, world and more"))'
+run str-sub '"str-sub: expected a string, start and optional end in range"' '(trap-error (fn () (str-sub "abc" 2 1)) (fn (e) e))'
+run str-split '("a" "" "a fairly long field" "")' '(str-split "a,,a fairly long field," ",")'
+run str-split '(("GET" "/index.html" "HTTP/1.1") 7)' '(def parts (str-split (str "GET /index.html HTTP/1.1" "\r\nHost: x") "\r\n"))
+  (gc) (list (str-split (car parts) " ") (str-len (nth parts 1)))'
+run str-index '(13 () 0 35)' '(list (str-index "hello world, hello" "hello" 1) (str-index "abc" "d") (str-index "abc" "")
+  (str-index "the quick brown fox jumps over the lazy dog" "lazy"))'
+run str-contains? '(t ())' '(list (str-contains? "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab" "aab") (str-contains? "aaaa" "aab"))'
+run str-starts-with? '(t ())' '(list (str-starts-with? "hello" "he") (str-starts-with? "he" "hello"))'
+run str-replace '("a::b::c" "abc" "bb")' '(list (str-replace "a.b.c" "." "::") (str-replace "abc" "x" "y") (str-replace "aaaa" "aa" "b"))'
+run str-join '("a, , c" "" "-x")' "(list (str-join \", \" '(\"a\" \"\" \"c\")) (str-join \"-\" '()) (str-join \"-\" '(\"\" \"x\")))"
+run str-trim '("hi there" "")' '(list (str-trim "  \t hi there \n") (str-trim "   "))'
+run str-char-len '(5 6)' '(list (str-char-len "héllo") (str-len "héllo"))'
+run str-char-at '("\u672C" 6 9)' '(list (str-char-at "日本語" 1) (str-char-offset "日本語" 2) (str-char-offset "日本語" 3))'
+run str-char-long '(301 "z" 600 "\u00E9")' "(def b (sb-new)) (def i 0) (while (< i 300) (sb-append! b \"é\") (set i (+ i 1)))
+  (sb-append! b \"z\") (def s (sb->str b))
+  (list (str-char-len s) (str-char-at s 300) (str-char-offset s 300) (str-char-at s 211))"
+run str-upcase '("STRA\u00DFE" "\u00E0\u00E9\u00EE \u03C9\u03BC")' '(list (str-upcase "straße") (str-downcase "ÀÉÎ Ωμ"))'
+run str-valid-utf8? '(t ())' "(def b (make-bytes 2)) (bytes-set! b 0 'u8 195) (list (str-valid-utf8? \"日本\") (str-valid-utf8? (bytes->str b)))"
+run 'str->codepoints' '((97 233 127881) (97 65533 65533 98))' "(def b (str->bytes \"a...b\")) (bytes-set! b 1 'u8 239) (bytes-set! b 2 'u8 191) (bytes-set! b 3 'u8 225)
+  (list (str->codepoints \"aé🎉\") (str->codepoints (bytes->str b)))"
+run 'codepoints->str' '("H\u00E9\U0001F600" t)' "(list (codepoints->str '(72 233 128512)) (eq? (codepoints->str (str->codepoints \"日本\")) \"日本\"))"
+run str-char-invalid '(4 (65533 65533 97 65533) 3 "a" 512 "a")' "(def b (make-bytes 4)) (bytes-set! b 0 'u8 192) (bytes-set! b 1 'u8 128) (bytes-set! b 2 'u8 97) (bytes-set! b 3 'u8 240)
+  (def s (bytes->str b)) (def l s) (def i 0) (while (< i 7) (set l (str l l)) (set i (+ i 1)))
+  (list (str-char-len s) (str->codepoints s) (str-char-offset s 3) (str-char-at s 2) (str-char-len l) (str-char-at l 302))"
+run re-compile '(<regex "a+b"> regex t)' '(def r (re-compile "a+b")) (list r (type r) (regex? r))'
+run re-compile-error '"re-compile: missing )"' '(trap-error (fn () (re-compile "a(b")) (fn (e) e))'
+run re-match '("bob@example.com" "bob" "example")' '(re-match (re-compile "(\\w+)@(\\w+)\\.com") "mail bob@example.com now")'
+run re-match-start '(("34") () ("ac" ()))' '(list (re-match "\\d+" "ab 12 34" 5) (re-match "^\\d+" "ab 12 34" 3) (re-match "a(b)?c" "ac"))'
+run re-match-utf8 '(("\u00E9\u00E9") ("\u03B1\u03B2\u03B3"))' '(list (re-match "é+" "caféé!") (re-match "[α-ω]+" "abc αβγ"))'
+run re-match-priority '(("xx") ("abcd" "a" "bcd" "") ("a\\b"))' '(list (re-match "x{2,3}?" "xxxx") (re-match "(a|ab)(c|bcd)(d*)" "abcd") (re-match "[a\\\\]+b" "a\\b"))'
+run re-find-all '(("1" "22" "333") ("" "aa" ""))' '(list (re-find-all "[0-9]+" "a1 b22 c333") (re-find-all "a*" "baa"))'
+run re-replace '("20-10 and 4-3" "-b--c-" "abc")' '(list (re-replace "(\\d+)-(\\d+)" "10-20 and 3-4" "\\2-\\1") (re-replace "a*" "baac" "-") (re-replace "x" "abc" "y"))'
+run re-replace-fn '"HELLO WORLD"' '(re-replace "\\w+" "hello world" (fn (m) (str-upcase (car m))))'
+run re-linear 1 "(def s (sb-new)) (def i 0) (while (< i 5000) (sb-append! s \"a\") (set i (+ i 1)))
+  (length (re-find-all \"(a*)*b|a+\" (sb->str s)))"
+run json-parse '([1 -25.0 t () ()] "x\ny" ())' '(def o (json-parse " {\"a\": [1, -2.5e1, true, false, null], \"b\": {\"c\": \"x\\ny\", \"d\": {}}} "))
+  (list (obj-get o "a") (obj-get (obj-get o "b") "c") (obj->alist (obj-get (obj-get o "b") "d")))'
+run json-parse-unicode t '(eq? (json-parse "\"\\u00e9\\ud83d\\ude00\\/\"") "\u00e9\U0001F600/")'
+run json-parse-big '[123456789012345678901234 -9007199254740993 0.5]' '(json-parse "[123456789012345678901234,-9007199254740993,5e-1]")'
+run json-parse-error '("json-parse: invalid literal at offset 1" "json-parse: trailing characters at offset 1" "json-parse: invalid \\u escape at offset 1")' '(map (fn (s) (trap-error (fn () (json-parse s)) (fn (e) e))) (list " tru" "01" "\"\\udc00\""))'
+run json-stringify '"[1,-2.5,\"a\\\"b\\n\",\"c\",[true,null],{\"k\":[]}]"' '(json-stringify (list 1 -2.5 "a\"b\n" (quote c) (vec t nil) (obj nil (list (cons (quote k) (vec))))))'
+run json-stringify-sb '"x=[1]"' '(def b (sb-new)) (sb-append! b "x=") (sb->str (json-stringify (list 1) b))'
+run json-stringify-error '"json-stringify: nested too deeply"' '(def l (list 1)) (set-car! l l) (trap-error (fn () (json-stringify l)) (fn (e) e))'
+run json-feed '(() ([1 2]) ("a b" 3) (t))' '(def p (json-parser))
+  (map (fn (c) (map (fn (v) (obj-get v "k")) (json-feed! p c))) (list "{\"k\": [1" ", 2]}\n{\"k\":\"a " "b\"} {\"k\":3}" "{\"k\":true}"))'
+run json-feed-end '(() (12) (3) () (t))' '(def p (json-parser))
+  (list (json-feed! p "1") (json-feed! p "2 3") (json-feed! p " tr") (json-feed! p "ue") (json-feed! p))'
+run sb '("ab\x0zcd" 6 sb)' '(def b (sb-new 1)) (sb-append! b "ab" "\x0z") (sb-append! b "cd")
+  (list (sb->str b) (sb-len b) (type b))'
+run sb '(3890 3890 t)' "(def b (sb-new)) (def i 0) (while (< i 1000) (sb-append! b (pr-str i) \".\") (set i (+ i 1)))
+  (list (str-len (sb->str b)) (sb-len b) (sb? b))"
+run read-all '(10007 t)' "(def s \"0123456789abc\") (def i 0) (while (< i 10) (set s (str s s)) (set i (+ i 1)))
+  (set s (str-sub s 0 10007)) (def fd (open \"/tmp/shi-test-read-all\" \"w\")) (write fd s) (close fd)
+  (def r (read-all \"/tmp/shi-test-read-all\")) (list (str-len r) (eq? r s))"
 
 # apply
 run apply '3' "(apply + '(1 2))"
+run apply-list '((a b) ((1 2) (c d)) a)' "(list (apply list '(a b)) (map (fn (x) (apply list x)) '((1 2) (c d))) (apply car '((a b))))"
 
 # type
 run type-int 'int' '(type 1)'
@@ -252,3 +364,78 @@ run extend '(1 2 3 4 5)' "(extend '(1) '() '(2 3 4) '(5))"
 
 # syntax (suite)
 run let1 '1' '(let ((x 1)) x)'
+
+# profile
+run profile 2 "(def f (fn (x) x))
+  (def p (profile (fn () (f 1) (f 2))))
+  (alist-get (car (filter (fn (e) (eq? (alist-get e 'name) 'f)) p)) 'calls)"
+run profile t "(list? (trap-error (fn () (profile (fn () (error \"x\")))) (fn (e) (profile (fn () 1)))))"
+
+# gc
+run gc-stats t "(int? (alist-get (gc-stats) 'count))"
+run gc t "(def n (alist-get (gc-stats) 'count)) (gc) (< n (alist-get (gc-stats) 'count))"
+run_gc gc-large '(t 4097 "[1,\"ab\",2.5,{\"k\":[123456789012345678901]}]" t t)' '(def s "[1,\"ab\",2.5,{\"k\":[123456789012345678901]}],")
+  (def i 0) (while (< i 12) (set s (str s s)) (set i (+ i 1)))
+  (def d (json-parse (str "[" s "0]"))) (def c (str->codepoints s)) (def p (str-split s ","))
+  (def n (alist-get (gc-stats) (quote count))) (gc)
+  (list (< n (alist-get (gc-stats) (quote count))) (vec-len d) (json-stringify (vec-ref d 4095))
+    (eq? (codepoints->str c) s) (eq? (str-join "," p) s))'
+run_gc freeze-heap "(3 (4) 2)" "(def x (list 1 2)) (freeze-heap) (set x (cons 3 x))
+  (set-car! (cdr x) (list 4)) (gc) x"
+run_gc freeze-heap "((k 9))" "(def o (obj nil ())) (obj-set o 'j 1) (freeze-heap)
+  (obj-set o 'k (list 9)) (gc) (obj-del o 'j) (obj->alist o)"
+run_gc pretenure "(t 300 (1 2))" "(def l nil) (def i 0)
+  (while (< i 300) (set l (cons (obj nil ()) l)) (set i (+ i 1)))
+  (gc) (def o (obj nil ())) (obj-set o 'k (list 1 2)) (gc)
+  (list (cadr (alist-get (gc-sites) 'obj)) (length l) (obj-get o 'k))"
+run_gc with-region "((1 2) (3) (4))" "(def x nil) (def o (obj nil ()))
+  (def r (with-region (fn () (set x (list 3)) (obj-set o 'k (list 4)) (list 1 2))))
+  (gc) (list r x (obj-get o 'k))"
+run_gc with-region '("ab" 524288)' '(def src "\"ab\" ")
+  (def i 0) (while (< i 18) (set src (str src src)) (set i (+ i 1)))
+  (def l (with-region (fn () (read-sexp (str "(" src ")")))))
+  (with-region (fn () (def j 0) (while (< j 20000) (list j j j) (set j (+ j 1)))))
+  (list (car l) (str-len (str-join "" l)))'
+run_gc with-region "(\"e\" (5))" "(def x nil)
+  (list (trap-error (fn () (with-region (fn () (set x (list 5)) (error \"e\")))) (fn (e) e)) x)"
+
+# weak
+run_gc weak-ref "((1) ())" "(def x (list 1)) (def w (weak-ref x)) (def w2 (weak-ref (list 2)))
+  (gc) (list (weak-deref w) (weak-deref w2))"
+run_gc weak-table "(1 10)" "(def t (weak-table)) (def k (list 1)) (weak-table-set! t k 10)
+  (weak-table-set! t (list 2) 20) (gc) (list (weak-table-count t) (weak-table-get t k))"
+run_gc weak-table 0 "(def t (weak-table)) (def k (list 1)) (weak-table-set! t k (list k))
+  (set k nil) (gc) (weak-table-count t)"
+run apply-weak "((1) 0 weak-ref weak-table)" "(def x (list 1)) (def w (weak-ref x)) (def t (weak-table))
+  (list (apply weak-deref (list w)) (apply weak-table-count (list t)) (eval (list 'type w)) (eval (list 'type t)))"
+
+# handles
+run open handle "(type (open \"/dev/null\"))"
+run close "\"close: 1st arg not an open file descriptor\"" "(def h (open \"/dev/null\"))
+  (close h) (trap-error (fn () (close h)) (fn (e) e))"
+run handle-finalizer t "(def fd (pr-str (open \"/dev/null\"))) (gc)
+  (eq? fd (pr-str (open \"/dev/null\")))"
+run apply-handle '(handle () "<handle closed>")' "(def h (open \"/dev/null\"))
+  (list (eval (list 'type h)) (apply close (list h)) (pr-str h))"
+
+# bytes
+run bytes-ref '(222 3735928559 4022250974 513)' "(def b (make-bytes 8))
+  (bytes-set! b 0 'u32be 3735928559) (bytes-set! b 4 'u16le 258)
+  (list (bytes-ref b 0 'u8) (bytes-ref b 0 'u32be) (bytes-ref b 0 'u32le) (bytes-ref b 4 'u16be))"
+run bytes-ref 18446744073709551615 "(def b (make-bytes 8)) (bytes-set! b 0 'u64le 18446744073709551615) (bytes-ref b 0 'u64be)"
+run bytes-slice '(3 "lo")' "(def b (bytes-slice (str->bytes \"hello\") 2)) (list (bytes-len b) (bytes->str b 1))"
+run 'bytes->str' '(2 "\x0\x0")' "(def s (bytes->str (make-bytes 2))) (list (str-len s) s)"
+run read-into! '(4 0 "abc" 0)' "(def fd (open \"/tmp/shi-test-bytes\" \"w\"))
+  (write-bytes fd (str->bytes \"xabcx\") 1 4) (write-bytes fd (make-bytes 1)) (close fd)
+  (def b (make-bytes 6)) (def fd (open \"/tmp/shi-test-bytes\" \"r\"))
+  (list (read-into! fd b 2) (read-into! fd b) (bytes->str b 2 5) (bytes-ref b 5 'u8))"
+
+# bench
+run bench 10 "(alist-get (bench 10 (fn () (+ 1 2))) 'iterations)"
+run bench t "(def b (bench 5 (fn () (range 0 10))))
+  (and (<= (alist-get b 'min-ns) (alist-get b 'median-ns))
+       (<= (alist-get b 'median-ns) (alist-get b 'p99-ns))
+       (< 0 (alist-get b 'bytes-per-iteration)))"
+run bench-errors '("bench: 1st arg not an int from 1 to 10000000" "boom")' "(def c 0)
+  (list (trap-error (fn () (bench 4294967296 (fn () 1))) (fn (e) e))
+        (trap-error (fn () (bench 3 (fn () (set c (+ c 1)) (if (= c 3) (error \"boom\"))))) (fn (e) e)))"